@@ -22,11 +22,133 @@
 using std::cerr;
 
 #include "barnes_hut.hpp"
+#include "thread_pool.hpp"
+
+/**
+ * Walks the tree for a range of particles, or groups of them, on behalf of
+ * the thread pool.
+ */
+class WalkTask : public ThreadPool::Task
+{
+	public:
+		WalkTask( ParticleSystem* iPS, Quadtree* iQT, LinearQuadtree* iLQT,
+				bool iTreeOrder ) :
+			ThreadPool::Task(), //{{{
+			ps( iPS ),
+			qt( iQT ),
+			lqt( iLQT ),
+			treeOrder( iTreeOrder ),
+			groups( iTreeOrder && ( iLQT->getGroupCount() > 0 ))
+		{
+		} //}}}
+
+		/**
+		 * Returns the system indice of the i'th particle walked.
+		 * @param i : position in the walk
+		 * @return : indice of particle in the system
+		 */
+		unsigned int particle( unsigned int i ) const
+		{ //{{{
+			return this->treeOrder ? this->lqt->getOrder( i ) : i;
+		} //}}}
+
+		/**
+		 * Returns how many interactions the i'th piece of work took last time.
+		 * @param i : position in the walk
+		 * @return : interactions of that particle, or of every particle in
+		 * that group
+		 */
+		unsigned long long cost( unsigned int i ) const
+		{ //{{{
+			if( !this->groups )
+				return this->ps->getCost( this->particle( i ) );
+
+			const LinearQuadtree::Node& node =
+				this->lqt->getNode( this->lqt->getGroup( i ) );
+			unsigned long long total = 0;
+			for( unsigned int j = node.first; j < node.first + node.count; j++ )
+				total += this->ps->getCost( this->particle( j ) );
+			return total;
+		} //}}}
+
+		/**
+		 * Returns true if the walk is over groups instead of particles.
+		 * @return : true if walking groups
+		 */
+		bool isGrouped() const
+		{ //{{{
+			return this->groups;
+		} //}}}
+
+		void process( unsigned int first, unsigned int last )
+		{ //{{{
+			if( this->groups )
+			{
+				this->lqt->updateGroups( first, last );
+				return;
+			}
+
+			for( unsigned int i = first; i < last; i++ )
+			{
+				if( this->lqt != NULL )
+					this->lqt->update( this->particle( i ) );
+				else
+					this->qt->update( i );
+			}
+		} //}}}
+
+	private:
+		ParticleSystem* ps;
+		Quadtree* qt;
+		LinearQuadtree* lqt;
+		/// True to walk particles in the linear quad tree's order.
+		bool treeOrder;
+		/// True to walk the linear quad tree's groups.
+		bool groups;
+
+		WalkTask( const WalkTask& rhs );
+		WalkTask& operator=( const WalkTask& rhs );
+};
+
+/// Levels below the root a dual tree walk is split at. Each of the up to
+/// 4^levels cells there is walked on its own, with no regard for the number
+/// of threads, so the forces found do not depend on it.
+static const unsigned int DUAL_TREE_LEVELS = 4;
+
+/**
+ * Walks a range of subtrees of a quad tree against the whole tree on behalf
+ * of the thread pool.
+ */
+class DualTreeTask : public ThreadPool::Task
+{
+	public:
+		DualTreeTask( const Quadtree* iRoot, const Quadtree** iSubtrees ) :
+			ThreadPool::Task(), //{{{
+			root( iRoot ),
+			subtrees( iSubtrees )
+		{
+		} //}}}
+
+		void process( unsigned int first, unsigned int last )
+		{ //{{{
+			for( unsigned int i = first; i < last; i++ )
+				this->subtrees[ i ]->updateDual( this->root );
+		} //}}}
+
+	private:
+		const Quadtree* root;
+		const Quadtree** subtrees;
+
+		DualTreeTask( const DualTreeTask& rhs );
+		DualTreeTask& operator=( const DualTreeTask& rhs );
+};
 
 BarnesHut::BarnesHut( ParticleSystem* iPS, Quadtree* iQT ) :
 	ps( iPS ), //{{{
 	qt( iQT ),
-	numThreads( 4 ),
+	lqt( NULL ),
+	numThreads( ThreadPool::instance()->getSize() ),
+	dualTree( false ),
 	first( 0 ),
 	last( 0 )
 {
@@ -37,47 +159,86 @@ void BarnesHut::run()
 	if( first >= last )
 		return;
 
-	if(( this->ps == NULL ) || ( this->qt == NULL ))
+	if(( this->ps == NULL ) || (( this->qt == NULL ) && ( this->lqt == NULL )))
 	{
 		cerr << "Tried to run Barnes-Hut with a null ps or qt\n";
 		return;
 	}
 
-	if( this->numThreads == 0 )
-	{
-		for( unsigned int i = first; (i < this->last) && (i < this->ps->getSize());
-				i++ )
-		{
-			this->qt->update( this->ps->getParticle( i ) );
-		}
+	unsigned int end = (this->last < this->ps->getSize()) ?
+		this->last : this->ps->getSize();
 
+	if( this->dualTree && ( this->lqt == NULL ) && ( this->first == 0 ) &&
+		( end == this->ps->getSize() ))
+	{
+		this->runDualTree();
 		return;
 	}
 
-	unsigned int tThreads = (this->numThreads > (this->last - this->first)) ?
-		(this->last - this->first) : this->numThreads;
-	unsigned int ppt = (this->last - this->first) / tThreads;
+	// Neighbours in the tree walk nearly the same cells, so when every
+	// particle is wanted go through them in tree order
+	bool treeOrder = ( this->lqt != NULL ) && ( this->first == 0 ) &&
+		( end == this->ps->getSize() ) &&
+		( this->lqt->getParticleSystem() == this->ps );
+	WalkTask task( this->ps, this->qt, this->lqt, treeOrder );
+	unsigned int begin = this->first;
+	if( task.isGrouped() )
+	{
+		begin = 0;
+		end = this->lqt->getGroupCount();
+	}
+	if( this->numThreads == 0 )
+	{
+		task.process( begin, end );
+		return;
+	}
 
-	BarnesHut** workers = new BarnesHut*[ this->numThreads ];
+	ThreadPool* pool = ThreadPool::instance();
+	unsigned int zones = (this->numThreads < pool->getSize()) ?
+		this->numThreads : pool->getSize();
 
-	for( unsigned int i = 0; i < tThreads; i++ )
+	// Split into zones of equal cost using the last walk's interaction
+	// counts, falling back to equal sized zones if there was no last walk {{{
+	unsigned long long total = 0;
+	for( unsigned int i = begin; i < end; i++ )
+		total += task.cost( i );
+	if(( zones < 2 ) || ( total == 0 ))
 	{
-		workers[ i ] = new BarnesHut( this->ps, this->qt );
-		workers[ i ]->setFirst( this->first + i * ppt );
-		workers[ i ]->setLast( this->first + (i + 1) * ppt );
-		if( i == (tThreads - 1) )
-			workers[ i ]->setLast( this->last );
-		workers[ i ]->setNumberOfThreads( 0 );
-		workers[ i ]->start();
-		workers[ i ]->wait( 10 );
+		pool->run( &task, begin, end, zones );
+		return;
 	}
 
-	for( unsigned int i = 0; i < tThreads; i++ )
+	unsigned int* bounds = new unsigned int[ zones + 1 ];
+	unsigned long long sum = 0;
+	unsigned int zone = 1;
+	bounds[ 0 ] = begin;
+	for( unsigned int i = begin; (i < end) && (zone < zones); i++ )
 	{
-		workers[ i ]->wait();
-		delete workers[ i ];
+		sum += task.cost( i );
+		while(( zone < zones ) && ( sum * zones >= total * zone ))
+			bounds[ zone++ ] = i + 1;
 	}
-	delete workers;
+	while( zone <= zones )
+		bounds[ zone++ ] = end; //}}}
+
+	pool->run( &task, bounds, zones );
+	delete[] bounds;
+} //}}}
+
+void BarnesHut::runDualTree()
+{ //{{{
+	unsigned int most = 1;
+	for( unsigned int i = 0; i < DUAL_TREE_LEVELS; i++ )
+		most *= 4;
+	const Quadtree** subtrees = new const Quadtree*[ most ];
+	unsigned int count = this->qt->getSubtrees( subtrees, DUAL_TREE_LEVELS );
+
+	DualTreeTask task( this->qt, subtrees );
+	if( this->numThreads == 0 )
+		task.process( 0, count );
+	else
+		ThreadPool::instance()->run( &task, 0, count, this->numThreads, 1 );
+	delete[] subtrees;
 } //}}}
 
 ParticleSystem* BarnesHut::getParticleSystem()
@@ -90,11 +251,21 @@ Quadtree* BarnesHut::getQuadTree()
 	return this->qt;
 } //}}}
 
+LinearQuadtree* BarnesHut::getLinearQuadTree()
+{ //{{{
+	return this->lqt;
+} //}}}
+
 unsigned int BarnesHut::getNumberOfThreads() const
 { //{{{
 	return this->numThreads;
 } //}}}
 
+bool BarnesHut::getDualTree() const
+{ //{{{
+	return this->dualTree;
+} //}}}
+
 unsigned int BarnesHut::getFirst() const
 { //{{{
 	return this->first;
@@ -115,11 +286,21 @@ void BarnesHut::setQuadTree( Quadtree* nQT )
 	this->qt = nQT;
 } //}}}
 
+void BarnesHut::setLinearQuadTree( LinearQuadtree* nLQT )
+{ //{{{
+	this->lqt = nLQT;
+} //}}}
+
 void BarnesHut::setNumberOfThreads( unsigned int num )
 { //{{{
 	this->numThreads = num;
 } //}}}
 
+void BarnesHut::setDualTree( bool nDualTree )
+{ //{{{
+	this->dualTree = nDualTree;
+} //}}}
+
 void BarnesHut::setFirst( unsigned int nFirst )
 { //{{{
 	this->first = nFirst;
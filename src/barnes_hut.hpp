@@ -24,10 +24,12 @@
 
 #include "particle_system.hpp"
 #include "quadtree.hpp"
+#include "linear_quadtree.hpp"
 
 /**
- * Class representing a thread (potentially with subthreads) used to apply the
- * Barnes-Hut algorithm to a partial or whole particle system.
+ * Class representing a thread used to apply the Barnes-Hut algorithm to a
+ * partial or whole particle system. The work is spread over the shared
+ * ThreadPool, so run() may also be called directly from any thread.
  */
 class BarnesHut : public QThread
 {
@@ -55,10 +57,20 @@ class BarnesHut : public QThread
 		Quadtree* getQuadTree();
 
 		/**
-		 * Return the number of threads this should use.
+		 * Get the linear quad tree associated with this.
+		 */
+		LinearQuadtree* getLinearQuadTree();
+
+		/**
+		 * Return the most threads from the shared pool this should use.
 		 */
 		unsigned int getNumberOfThreads() const;
 
+		/**
+		 * Return true if the quad tree is walked by a dual tree walk.
+		 */
+		bool getDualTree() const;
+
 		/**
 		 * Return the indice of the first particle to act upon.
 		 */
@@ -82,11 +94,27 @@ class BarnesHut : public QThread
 		void setQuadTree( Quadtree* nQT );
 
 		/**
-		 * Set the number of threads this should use.
-		 * @param num : number of threads
+		 * Associate a new linear quad tree with this, which is used instead of
+		 * the quad tree when it is not NULL.
+		 * @param nLQT : new linear quad tree
+		 */
+		void setLinearQuadTree( LinearQuadtree* nLQT );
+
+		/**
+		 * Set the most threads from the shared pool this should use.
+		 * @param num : number of threads, 0 to run only in the calling thread
 		 */
 		void setNumberOfThreads( unsigned int num );
 
+		/**
+		 * Set whether the quad tree is walked by a dual tree walk, where
+		 * pairs of cells far enough apart interact as a whole, instead of
+		 * once from the root for each particle. Only used when every
+		 * particle of the system is acted upon.
+		 * @param nDualTree : true for a dual tree walk
+		 */
+		void setDualTree( bool nDualTree );
+
 		/**
 		 * Set the indice of the first particle to be acted upon.
 		 * @param nFirst : new first indice
@@ -100,9 +128,18 @@ class BarnesHut : public QThread
 		void setLast( unsigned int nLast );
 
 	private:
+		/**
+		 * Walks the quad tree by a dual tree walk for every particle,
+		 * splitting it into subtrees shared out between threads.
+		 */
+		void runDualTree();
+
 		ParticleSystem* ps;
 		Quadtree* qt;
+		LinearQuadtree* lqt;
 		unsigned int numThreads;
+		/// True to walk the quad tree by a dual tree walk.
+		bool dualTree;
 		unsigned int first;
 		unsigned int last;
 
@@ -0,0 +1,607 @@
+/** {{{
+ * Copyright 2010 Jeff Chapman.
+ *
+ * This file is a part of Barnes-Hut
+ *
+ * Barnes-Hut is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Barnes-Hut is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Barnes-Hut.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */// }}}
+
+#include "compressed_stream.hpp"
+using std::string;
+using std::ifstream;
+using std::ofstream;
+
+#include <iostream>
+using std::cerr;
+
+#include <cstring>
+
+#ifdef COMPRESS_GZIP
+#include <zlib.h>
+#endif
+#ifdef COMPRESS_ZSTD
+#include <zstd.h>
+#endif
+
+/// Blocks in the ring between a thread and its caller.
+static const unsigned int COMPRESSED_BLOCKS = 3;
+/// Plain bytes in each block, enough for every thread of the pool to parse
+/// a good share of.
+static const size_t COMPRESSED_BLOCK_BYTES = 16 << 20;
+/// Compressed bytes read or written at a time.
+static const size_t COMPRESSED_BUFFER_BYTES = 1 << 20;
+/// Compression levels; fast ones, as files are written once per run and the
+/// thread should keep up with formatting.
+static const int GZIP_LEVEL = 1;
+static const int ZSTD_LEVEL = 3;
+
+CompressedReader::CompressedReader( string iFileName, Compression iFormat,
+		size_t iBlockBytes ) :
+	QThread(), //{{{
+	fileName( iFileName ),
+	format( iFormat ),
+	file(),
+	input( NULL ),
+	inputLength( 0 ),
+	inputUsed( 0 ),
+	stream( NULL ),
+	ended( false ),
+	blocks( NULL ),
+	blockBytes( ( iBlockBytes > 0 ) ? iBlockBytes : COMPRESSED_BLOCK_BYTES ),
+	lengths( NULL ),
+	lock(),
+	filled(),
+	emptied(),
+	produced( 0 ),
+	taken( 0 ),
+	released( 0 ),
+	holding( false ),
+	finished( false ),
+	error( false ),
+	stopping( false )
+{
+	this->blocks = new char*[ COMPRESSED_BLOCKS ];
+	this->lengths = new size_t[ COMPRESSED_BLOCKS ];
+	for( unsigned int b = 0; b < COMPRESSED_BLOCKS; b++ )
+	{
+		this->blocks[ b ] = new char[ this->blockBytes ];
+		this->lengths[ b ] = 0;
+	}
+} //}}}
+
+CompressedReader::~CompressedReader()
+{ //{{{
+	this->lock.lock();
+	this->stopping = true;
+	this->emptied.wakeAll();
+	this->lock.unlock();
+	this->wait();
+
+	for( unsigned int b = 0; b < COMPRESSED_BLOCKS; b++ )
+		delete[] this->blocks[ b ];
+	delete[] this->blocks;
+	delete[] this->lengths;
+	delete[] this->input;
+} //}}}
+
+Compression CompressedReader::detect( string fileName )
+{ //{{{
+	ifstream file( fileName.c_str(), ifstream::binary );
+	unsigned char magic[ 4 ] = { 0, 0, 0, 0 };
+	file.read( (char*)magic, 4 );
+	if(( file.gcount() >= 2 ) && ( magic[ 0 ] == 0x1f ) && ( magic[ 1 ] == 0x8b ))
+		return COMPRESSION_GZIP;
+	if(( file.gcount() == 4 ) && ( magic[ 0 ] == 0x28 ) &&
+		( magic[ 1 ] == 0xb5 ) && ( magic[ 2 ] == 0x2f ) && ( magic[ 3 ] == 0xfd ))
+		return COMPRESSION_ZSTD;
+	return COMPRESSION_NONE;
+} //}}}
+
+Compression CompressedReader::fromName( string fileName )
+{ //{{{
+	if(( fileName.size() > 3 ) &&
+		( fileName.compare( fileName.size() - 3, 3, ".gz" ) == 0 ))
+		return COMPRESSION_GZIP;
+	if(( fileName.size() > 4 ) &&
+		( fileName.compare( fileName.size() - 4, 4, ".zst" ) == 0 ))
+		return COMPRESSION_ZSTD;
+	return COMPRESSION_NONE;
+} //}}}
+
+bool CompressedReader::isSupported( Compression format )
+{ //{{{
+#ifdef COMPRESS_GZIP
+	if( format == COMPRESSION_GZIP )
+		return true;
+#endif
+#ifdef COMPRESS_ZSTD
+	if( format == COMPRESSION_ZSTD )
+		return true;
+#endif
+	return ( format == COMPRESSION_NONE );
+} //}}}
+
+const char* CompressedReader::getName( Compression format )
+{ //{{{
+	if( format == COMPRESSION_GZIP )
+		return "gzip";
+	if( format == COMPRESSION_ZSTD )
+		return "zstd";
+	return "no compression";
+} //}}}
+
+const char* CompressedReader::next( size_t& length )
+{ //{{{
+	QMutexLocker locker( &this->lock );
+	if( this->holding )
+	{
+		this->released++;
+		this->holding = false;
+		this->emptied.wakeAll();
+	}
+
+	while(( this->taken == this->produced ) && !this->finished )
+		this->filled.wait( &this->lock );
+	if( this->taken == this->produced )
+	{
+		length = 0;
+		return NULL;
+	}
+
+	unsigned int slot = this->taken % COMPRESSED_BLOCKS;
+	this->taken++;
+	this->holding = true;
+	length = this->lengths[ slot ];
+	return this->blocks[ slot ];
+} //}}}
+
+bool CompressedReader::failed() const
+{ //{{{
+	QMutexLocker locker( &this->lock );
+	return this->error;
+} //}}}
+
+void CompressedReader::run()
+{ //{{{
+	bool good = this->open();
+	while( good )
+	{
+		// Wait for a block the caller is done with
+		unsigned int slot = 0;
+		{
+			QMutexLocker locker( &this->lock );
+			while(( this->produced - this->released >= COMPRESSED_BLOCKS ) &&
+					!this->stopping )
+				this->emptied.wait( &this->lock );
+			if( this->stopping )
+				break;
+			slot = this->produced % COMPRESSED_BLOCKS;
+		}
+
+		size_t length = 0;
+		good = this->fill( this->blocks[ slot ], length );
+		if( !good || ( length == 0 ))
+			break;
+
+		QMutexLocker locker( &this->lock );
+		this->lengths[ slot ] = length;
+		this->produced++;
+		this->filled.wakeAll();
+	}
+
+#ifdef COMPRESS_GZIP
+	if(( this->format == COMPRESSION_GZIP ) && ( this->stream != NULL ))
+	{
+		inflateEnd( (z_stream*)this->stream );
+		delete (z_stream*)this->stream;
+	}
+#endif
+#ifdef COMPRESS_ZSTD
+	if(( this->format == COMPRESSION_ZSTD ) && ( this->stream != NULL ))
+		ZSTD_freeDCtx( (ZSTD_DCtx*)this->stream );
+#endif
+	this->stream = NULL;
+	this->file.close();
+
+	QMutexLocker locker( &this->lock );
+	this->finished = true;
+	this->error = !good;
+	this->filled.wakeAll();
+} //}}}
+
+bool CompressedReader::open()
+{ //{{{
+	if( !CompressedReader::isSupported( this->format ))
+	{
+		cerr << this->fileName << " is compressed with "
+			<< CompressedReader::getName( this->format )
+			<< ", which this was built without\n";
+		return false;
+	}
+
+	this->file.open( this->fileName.c_str(), ifstream::binary );
+	if( !this->file.good() )
+	{
+		cerr << "ParticleSystem was passed bad file\n";
+		return false;
+	}
+	if( this->format != COMPRESSION_NONE )
+		this->input = new char[ COMPRESSED_BUFFER_BYTES ];
+
+#ifdef COMPRESS_GZIP
+	if( this->format == COMPRESSION_GZIP )
+	{
+		z_stream* z = new z_stream;
+		memset( z, 0, sizeof( z_stream ));
+		// 16 more window bits has zlib expect a gzip header
+		if( inflateInit2( z, 16 + MAX_WBITS ) != Z_OK )
+		{
+			cerr << "Could not start inflating " << this->fileName << "\n";
+			delete z;
+			return false;
+		}
+		this->stream = z;
+	}
+#endif
+#ifdef COMPRESS_ZSTD
+	if( this->format == COMPRESSION_ZSTD )
+	{
+		this->stream = ZSTD_createDCtx();
+		if( this->stream == NULL )
+		{
+			cerr << "Could not start inflating " << this->fileName << "\n";
+			return false;
+		}
+	}
+#endif
+	return true;
+} //}}}
+
+bool CompressedReader::fill( char* block, size_t& length )
+{ //{{{
+	length = 0;
+	if( this->format == COMPRESSION_NONE )
+	{
+		this->file.read( block, this->blockBytes );
+		length = this->file.gcount();
+		this->ended = ( length < this->blockBytes );
+		return !this->file.bad();
+	}
+
+	while(( length < this->blockBytes ) && !this->ended )
+	{
+		if( this->inputUsed == this->inputLength )
+			this->refill();
+		bool empty = ( this->inputUsed == this->inputLength );
+		size_t before = length;
+
+#ifdef COMPRESS_GZIP
+		if( this->format == COMPRESSION_GZIP )
+		{ //{{{
+			z_stream* z = (z_stream*)this->stream;
+			z->next_in = (Bytef*)( this->input + this->inputUsed );
+			z->avail_in = (uInt)( this->inputLength - this->inputUsed );
+			z->next_out = (Bytef*)( block + length );
+			z->avail_out = (uInt)( this->blockBytes - length );
+			int result = inflate( z, Z_NO_FLUSH );
+			length = this->blockBytes - z->avail_out;
+			this->inputUsed = this->inputLength - z->avail_in;
+
+			if( result == Z_STREAM_END )
+			{
+				// A gzip file can be several streams one after another
+				if(( this->inputUsed == this->inputLength ) &&
+					( this->refill() == 0 ))
+					this->ended = true;
+				else
+					inflateReset( z );
+			}
+			else if(( result != Z_OK ) && ( result != Z_BUF_ERROR ))
+			{
+				cerr << this->fileName << " could not be inflated: "
+					<< (( z->msg != NULL ) ? z->msg : "bad data") << "\n";
+				return false;
+			}
+		} //}}}
+#endif
+#ifdef COMPRESS_ZSTD
+		if( this->format == COMPRESSION_ZSTD )
+		{ //{{{
+			ZSTD_inBuffer in = { this->input, this->inputLength, this->inputUsed };
+			ZSTD_outBuffer out = { block, this->blockBytes, length };
+			size_t result = ZSTD_decompressStream( (ZSTD_DCtx*)this->stream,
+					&out, &in );
+			if( ZSTD_isError( result ))
+			{
+				cerr << this->fileName << " could not be inflated: "
+					<< ZSTD_getErrorName( result ) << "\n";
+				return false;
+			}
+			length = out.pos;
+			this->inputUsed = in.pos;
+
+			// A frame was finished; the file can hold more of them
+			if(( result == 0 ) && ( this->inputUsed == this->inputLength ) &&
+				( this->refill() == 0 ))
+				this->ended = true;
+		} //}}}
+#endif
+
+		// Out of input with nothing left to give means the file was cut short
+		if( !this->ended && empty && ( length == before ))
+		{
+			cerr << this->fileName << " ends in the middle of its "
+				<< CompressedReader::getName( this->format ) << " data\n";
+			return false;
+		}
+	}
+	return true;
+} //}}}
+
+size_t CompressedReader::refill()
+{ //{{{
+	this->file.read( this->input, COMPRESSED_BUFFER_BYTES );
+	this->inputLength = this->file.gcount();
+	this->inputUsed = 0;
+	return this->inputLength;
+} //}}}
+
+CompressedWriter::CompressedWriter( string iFileName, Compression iFormat,
+		size_t iBlockBytes ) :
+	QThread(), //{{{
+	fileName( iFileName ),
+	format( iFormat ),
+	file(),
+	output( NULL ),
+	stream( NULL ),
+	blocks( NULL ),
+	blockBytes( ( iBlockBytes > 0 ) ? iBlockBytes : COMPRESSED_BLOCK_BYTES ),
+	lengths( NULL ),
+	lock(),
+	filled(),
+	emptied(),
+	produced( 0 ),
+	written( 0 ),
+	closing( false ),
+	error( false )
+{
+	this->blocks = new char*[ COMPRESSED_BLOCKS ];
+	this->lengths = new size_t[ COMPRESSED_BLOCKS ];
+	for( unsigned int b = 0; b < COMPRESSED_BLOCKS; b++ )
+	{
+		this->blocks[ b ] = new char[ this->blockBytes ];
+		this->lengths[ b ] = 0;
+	}
+	this->start();
+} //}}}
+
+CompressedWriter::~CompressedWriter()
+{ //{{{
+	this->close();
+	for( unsigned int b = 0; b < COMPRESSED_BLOCKS; b++ )
+		delete[] this->blocks[ b ];
+	delete[] this->blocks;
+	delete[] this->lengths;
+	delete[] this->output;
+} //}}}
+
+void CompressedWriter::write( const char* data, size_t length )
+{ //{{{
+	// Only the caller changes produced, so the block being filled can be
+	// found without the lock
+	while( length > 0 )
+	{
+		unsigned int slot = this->produced % COMPRESSED_BLOCKS;
+		size_t room = this->blockBytes - this->lengths[ slot ];
+		size_t n = ( length < room ) ? length : room;
+		memcpy( this->blocks[ slot ] + this->lengths[ slot ], data, n );
+		this->lengths[ slot ] += n;
+		data += n;
+		length -= n;
+		if( this->lengths[ slot ] == this->blockBytes )
+			this->handOver();
+	}
+} //}}}
+
+bool CompressedWriter::close()
+{ //{{{
+	this->lock.lock();
+	if( !this->closing )
+	{
+		if( this->lengths[ this->produced % COMPRESSED_BLOCKS ] > 0 )
+			this->produced++;
+		this->closing = true;
+		this->filled.wakeAll();
+	}
+	this->lock.unlock();
+
+	this->wait();
+	QMutexLocker locker( &this->lock );
+	return !this->error;
+} //}}}
+
+void CompressedWriter::run()
+{ //{{{
+	bool good = this->open();
+	while( true )
+	{
+		unsigned int slot = 0;
+		{
+			QMutexLocker locker( &this->lock );
+			while(( this->written == this->produced ) && !this->closing )
+				this->filled.wait( &this->lock );
+			if( this->written == this->produced )
+				break;
+			slot = this->written % COMPRESSED_BLOCKS;
+		}
+
+		// After a failure blocks are still taken, so the caller never waits
+		// for ever, but go nowhere
+		if( good )
+			good = this->pack( this->blocks[ slot ], this->lengths[ slot ], false );
+
+		QMutexLocker locker( &this->lock );
+		this->written++;
+		this->emptied.wakeAll();
+	}
+	if( good )
+		good = this->pack( NULL, 0, true );
+
+#ifdef COMPRESS_GZIP
+	if(( this->format == COMPRESSION_GZIP ) && ( this->stream != NULL ))
+	{
+		deflateEnd( (z_stream*)this->stream );
+		delete (z_stream*)this->stream;
+	}
+#endif
+#ifdef COMPRESS_ZSTD
+	if(( this->format == COMPRESSION_ZSTD ) && ( this->stream != NULL ))
+		ZSTD_freeCCtx( (ZSTD_CCtx*)this->stream );
+#endif
+	this->stream = NULL;
+	if( this->file.is_open() )
+	{
+		this->file.close();
+		if( good && this->file.fail() )
+		{
+			cerr << "Could not save all of " << this->fileName << "\n";
+			good = false;
+		}
+	}
+
+	QMutexLocker locker( &this->lock );
+	this->error = !good;
+} //}}}
+
+bool CompressedWriter::open()
+{ //{{{
+	if( !CompressedReader::isSupported( this->format ))
+	{
+		cerr << "Could not save " << this->fileName << " with "
+			<< CompressedReader::getName( this->format )
+			<< ", which this was built without\n";
+		return false;
+	}
+
+	this->file.open( this->fileName.c_str(), ofstream::binary );
+	if( !this->file.good() )
+	{
+		cerr << "Could not save to file\n";
+		return false;
+	}
+	this->output = new char[ COMPRESSED_BUFFER_BYTES ];
+
+#ifdef COMPRESS_GZIP
+	if( this->format == COMPRESSION_GZIP )
+	{
+		z_stream* z = new z_stream;
+		memset( z, 0, sizeof( z_stream ));
+		// 16 more window bits has zlib write a gzip header
+		if( deflateInit2( z, GZIP_LEVEL, Z_DEFLATED, 16 + MAX_WBITS, 8,
+				Z_DEFAULT_STRATEGY ) != Z_OK )
+		{
+			cerr << "Could not start compressing " << this->fileName << "\n";
+			delete z;
+			return false;
+		}
+		this->stream = z;
+	}
+#endif
+#ifdef COMPRESS_ZSTD
+	if( this->format == COMPRESSION_ZSTD )
+	{
+		ZSTD_CCtx* c = ZSTD_createCCtx();
+		if(( c == NULL ) || ZSTD_isError( ZSTD_CCtx_setParameter( c,
+				ZSTD_c_compressionLevel, ZSTD_LEVEL )))
+		{
+			cerr << "Could not start compressing " << this->fileName << "\n";
+			ZSTD_freeCCtx( c );
+			return false;
+		}
+		this->stream = c;
+	}
+#endif
+	return true;
+} //}}}
+
+bool CompressedWriter::pack( const char* block, size_t length, bool last )
+{ //{{{
+	if( this->format == COMPRESSION_NONE )
+		this->file.write( block, length );
+
+#if !defined( COMPRESS_GZIP ) && !defined( COMPRESS_ZSTD )
+	// Only the codecs care which block ends the file
+	(void)last;
+#endif
+
+#ifdef COMPRESS_GZIP
+	if( this->format == COMPRESSION_GZIP )
+	{ //{{{
+		z_stream* z = (z_stream*)this->stream;
+		z->next_in = (Bytef*)block;
+		z->avail_in = (uInt)length;
+		do
+		{
+			z->next_out = (Bytef*)this->output;
+			z->avail_out = (uInt)COMPRESSED_BUFFER_BYTES;
+			if( ::deflate( z, last ? Z_FINISH : Z_NO_FLUSH ) == Z_STREAM_ERROR )
+			{
+				cerr << "Could not compress " << this->fileName << "\n";
+				return false;
+			}
+			this->file.write( this->output,
+					COMPRESSED_BUFFER_BYTES - z->avail_out );
+		} while( z->avail_out == 0 );
+	} //}}}
+#endif
+#ifdef COMPRESS_ZSTD
+	if( this->format == COMPRESSION_ZSTD )
+	{ //{{{
+		ZSTD_inBuffer in = { block, length, 0 };
+		bool done = false;
+		while( !done )
+		{
+			ZSTD_outBuffer out = { this->output, COMPRESSED_BUFFER_BYTES, 0 };
+			size_t remaining = ZSTD_compressStream2( (ZSTD_CCtx*)this->stream,
+					&out, &in, last ? ZSTD_e_end : ZSTD_e_continue );
+			if( ZSTD_isError( remaining ))
+			{
+				cerr << "Could not compress " << this->fileName << ": "
+					<< ZSTD_getErrorName( remaining ) << "\n";
+				return false;
+			}
+			this->file.write( this->output, out.pos );
+			done = last ? ( remaining == 0 ) : ( in.pos == in.size );
+		}
+	} //}}}
+#endif
+
+	if( !this->file.good() )
+	{
+		cerr << "Could not save all of " << this->fileName << "\n";
+		return false;
+	}
+	return true;
+} //}}}
+
+void CompressedWriter::handOver()
+{ //{{{
+	QMutexLocker locker( &this->lock );
+	this->produced++;
+	this->filled.wakeAll();
+	while( this->produced - this->written >= COMPRESSED_BLOCKS )
+		this->emptied.wait( &this->lock );
+	this->lengths[ this->produced % COMPRESSED_BLOCKS ] = 0;
+} //}}}
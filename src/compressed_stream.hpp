@@ -0,0 +1,275 @@
+/** {{{
+ * Copyright 2010 Jeff Chapman.
+ *
+ * This file is a part of Barnes-Hut
+ *
+ * Barnes-Hut is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Barnes-Hut is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Barnes-Hut.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */// }}}
+#ifndef COMPRESSED_STREAM_HPP
+#define COMPRESSED_STREAM_HPP
+
+#include <string>
+#include <fstream>
+
+#include <QtCore/QThread>
+#include <QtCore/QMutex>
+#include <QtCore/QWaitCondition>
+
+/**
+ * Ways a particle file can be compressed. gzip needs the program built with
+ * COMPRESS_GZIP and zstd with COMPRESS_ZSTD (make gzip=1 zstd=1).
+ */
+enum Compression
+{
+	COMPRESSION_NONE,
+	COMPRESSION_GZIP,
+	COMPRESSION_ZSTD
+};
+
+/**
+ * Reads a file as a series of blocks of plain bytes, inflated if it is
+ * compressed, by a thread of its own while the caller works on the blocks
+ * before.
+ *
+ * A few blocks are kept in a ring. The thread fills any that are free, and
+ * waits when the caller falls behind; the caller waits when it gets ahead.
+ */
+class CompressedReader : public QThread
+{
+	public:
+		/**
+		 * Open a file, ready to start().
+		 * @param iFileName : name of file to read
+		 * @param iFormat : how it is compressed
+		 * @param iBlockBytes : most bytes in a block, 0 for the default
+		 */
+		CompressedReader( std::string iFileName, Compression iFormat,
+				size_t iBlockBytes = 0 );
+
+		/**
+		 * Stops the thread if it is still going and deletes all blocks.
+		 */
+		~CompressedReader();
+
+		/**
+		 * Returns how a file is compressed, going by its first few bytes.
+		 * @param fileName : name of file to look at
+		 * @return : its compression, COMPRESSION_NONE if it is not
+		 * compressed or can not be read
+		 */
+		static Compression detect( std::string fileName );
+
+		/**
+		 * Returns how a file should be compressed, going by its name.
+		 * @param fileName : name of file, ending in .gz or .zst if it is to
+		 * be compressed
+		 * @return : its compression
+		 */
+		static Compression fromName( std::string fileName );
+
+		/**
+		 * Returns true if this was built able to handle a compression.
+		 * @param format : compression to check
+		 * @return : true if it can be read and written
+		 */
+		static bool isSupported( Compression format );
+
+		/**
+		 * Returns the name of a compression, for messages.
+		 * @param format : compression
+		 * @return : its name
+		 */
+		static const char* getName( Compression format );
+
+		/**
+		 * Hands back the last block and waits for the next one. The block
+		 * stays as it is until the next call.
+		 * @param length : set to the number of bytes in the block
+		 * @return : the block, NULL at the end of the file or on an error
+		 */
+		const char* next( size_t& length );
+
+		/**
+		 * Returns true if the file could not be read or inflated. Only
+		 * meaningful once next() has returned NULL.
+		 * @return : true if something went wrong
+		 */
+		bool failed() const;
+
+	protected:
+		/**
+		 * Inflates the whole file into the ring of blocks.
+		 */
+		void run();
+
+	private:
+		/**
+		 * Opens the file and sets up the decompressor.
+		 * @return : false, with a message printed, if either failed
+		 */
+		bool open();
+
+		/**
+		 * Inflates as much as fits into a block.
+		 * @param block : block to fill
+		 * @param length : set to the number of bytes put in it
+		 * @return : false, with a message printed, if the file is damaged
+		 */
+		bool fill( char* block, size_t& length );
+
+		/**
+		 * Reads the next run of compressed bytes from the file.
+		 * @return : number of bytes read, 0 at the end of the file
+		 */
+		size_t refill();
+
+		std::string fileName;
+		Compression format;
+		std::ifstream file;
+		/// Compressed bytes read from the file, how many and how many of
+		/// them have been inflated.
+		char* input;
+		size_t inputLength;
+		size_t inputUsed;
+		/// State of the zlib or zstd decompressor.
+		void* stream;
+		/// True once the end of the compressed data has been reached.
+		bool ended;
+
+		/// Ring of blocks, the most each can hold and the length of what each
+		/// holds.
+		char** blocks;
+		size_t blockBytes;
+		size_t* lengths;
+
+		/// Protects everything below.
+		mutable QMutex lock;
+		QWaitCondition filled;
+		QWaitCondition emptied;
+		/// Blocks inflated, handed to the caller and handed back so far.
+		unsigned int produced;
+		unsigned int taken;
+		unsigned int released;
+		/// True while the caller holds the last block it was handed.
+		bool holding;
+		/// True once the thread has filled its last block.
+		bool finished;
+		bool error;
+		/// True to have the thread give up early.
+		bool stopping;
+
+		CompressedReader( const CompressedReader& rhs );
+		CompressedReader& operator=( const CompressedReader& rhs );
+};
+
+/**
+ * Writes a file, compressed or not, on a thread of its own, so the caller
+ * can get on with making the next bytes while the last ones are compressed
+ * and written.
+ *
+ * Bytes written are gathered into blocks from a small ring, which the
+ * thread takes in turn; the caller only waits when every block is full.
+ */
+class CompressedWriter : public QThread
+{
+	public:
+		/**
+		 * Create a file and start the thread writing to it.
+		 * @param iFileName : name of file to write
+		 * @param iFormat : how to compress it
+		 * @param iBlockBytes : most bytes in a block, 0 for the default
+		 */
+		CompressedWriter( std::string iFileName, Compression iFormat,
+				size_t iBlockBytes = 0 );
+
+		/**
+		 * Closes the file if close() was not called and deletes all blocks.
+		 */
+		~CompressedWriter();
+
+		/**
+		 * Adds bytes to the end of the file.
+		 * @param data : bytes to add
+		 * @param length : number of bytes
+		 */
+		void write( const char* data, size_t length );
+
+		/**
+		 * Writes out everything left, ends the compressed stream and waits
+		 * for the thread to finish.
+		 * @return : false, with a message printed, if anything could not be
+		 * written
+		 */
+		bool close();
+
+	protected:
+		/**
+		 * Compresses and writes blocks until closed.
+		 */
+		void run();
+
+	private:
+		/**
+		 * Sets up the compressor.
+		 * @return : false, with a message printed, if it could not be
+		 */
+		bool open();
+
+		/**
+		 * Compresses a block, or all that is left when finishing, and writes
+		 * out what that gives.
+		 * @param block : bytes to compress
+		 * @param length : number of bytes
+		 * @param last : true to end the compressed stream after them
+		 * @return : false, with a message printed, if it failed
+		 */
+		bool pack( const char* block, size_t length, bool last );
+
+		/**
+		 * Hands the block being filled to the thread and waits for the next
+		 * one to be free.
+		 */
+		void handOver();
+
+		std::string fileName;
+		Compression format;
+		std::ofstream file;
+		/// Compressed bytes waiting to be written to the file.
+		char* output;
+		/// State of the zlib or zstd compressor.
+		void* stream;
+
+		/// Ring of blocks, the most each can hold and the length of what
+		/// each holds. The caller fills block produced % COMPRESSED_BLOCKS.
+		char** blocks;
+		size_t blockBytes;
+		size_t* lengths;
+
+		/// Protects everything below.
+		QMutex lock;
+		QWaitCondition filled;
+		QWaitCondition emptied;
+		/// Blocks handed to the thread, and written out by it, so far.
+		unsigned int produced;
+		unsigned int written;
+		/// True once the caller has nothing more to write.
+		bool closing;
+		bool error;
+
+		CompressedWriter( const CompressedWriter& rhs );
+		CompressedWriter& operator=( const CompressedWriter& rhs );
+};
+
+#endif // COMPRESSED_STREAM_HPP
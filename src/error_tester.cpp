@@ -26,6 +26,7 @@ using std::cerr;
 using std::stringstream;
 
 #include <fstream>
+using std::ifstream;
 using std::ofstream;
 
 #include <iomanip>
@@ -37,19 +38,88 @@ using std::setw;
 using std::numeric_limits;
 
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <stdint.h>
 
 #include "error_tester.hpp"
 using std::string;
 
 #include "barnes_hut.hpp"
 
+/// Seconds between checkpoints unless told otherwise.
+static const unsigned int CHECKPOINT_SECONDS = 60;
+static const char CHECKPOINT_MAGIC[ 4 ] = { 'B', 'H', 'E', 'T' };
+static const uint32_t CHECKPOINT_VERSION = 1;
+
+/**
+ * Start of a checkpoint file, describing the test it is of. It is followed
+ * by a byte for each tau saying whether it is done, the fx and fy RMSE and
+ * the mean interactions of each tau, then the brute-force fx and fy of every
+ * particle. Values are as this was built, so a checkpoint is only read by
+ * the same build that wrote it.
+ */
+struct CheckpointHeader
+{
+	char magic[ 4 ];
+	uint32_t version;
+	/// sizeof( Real ) of the brute-force forces.
+	uint32_t realBytes;
+	uint32_t order;
+	uint32_t leafCapacity;
+	uint32_t fmmOrder;
+	uint32_t steps;
+	uint32_t particles;
+	long double minTau;
+	long double maxTau;
+	long double tauDelta;
+};
+
+/**
+ * Prints the RMSE of one run against another, both as is and relative to the
+ * RMS force of the first.
+ * @param what : what is being compared, to start the line with
+ * @param reference : run taken to be right
+ * @param other : run compared against it
+ * @return : a long double[ 2 ] containing fx and fy error values
+ */
+static long double* reportRMSE( const char* what, ParticleSystem* reference,
+		ParticleSystem* other )
+{ //{{{
+	long double* RMSE = ErrorTester::calculateRMSE( reference, other );
+	long double rmsFX = 0, rmsFY = 0;
+	for( unsigned int i = 0; i < reference->getSize(); i++ )
+	{
+		rmsFX += (long double)reference->getFX( i ) * reference->getFX( i );
+		rmsFY += (long double)reference->getFY( i ) * reference->getFY( i );
+	}
+	rmsFX = sqrt( rmsFX / reference->getSize() );
+	rmsFY = sqrt( rmsFY / reference->getSize() );
+
+	cout << what << " RMSE: "
+		<< fixed << setprecision( 12 ) << RMSE[ 0 ] << '\t' << RMSE[ 1 ] << '\n'
+		<< "Relative to the RMS force: "
+		<< RMSE[ 0 ] / rmsFX << '\t' << RMSE[ 1 ] / rmsFY << '\n';
+	return RMSE;
+} //}}}
+
 ErrorTester::ErrorTester( std::string iFileName, long double iTau ) :
 	fileName( iFileName ), //{{{
 	minTau( 0.0 ),
 	maxTau( iTau ),
 	tauDelta( 0.0001 ),
+	order( 1 ),
+	leafCapacity( 1 ),
+	fmmOrder( 0 ),
 	bruteForce( NULL ),
-	RMSE( NULL )
+	steps( 0 ),
+	RMSE( NULL ),
+	work( NULL ),
+	checkpointInterval( CHECKPOINT_SECONDS ),
+	resumed( false ),
+	arena()
 {
 	this->bruteForce = new ParticleSystem();
 } //}}}
@@ -61,6 +131,12 @@ ErrorTester::~ErrorTester()
 		delete this->bruteForce;
 		this->bruteForce = NULL;
 	}
+	for( unsigned int i = 0; ( this->RMSE != NULL ) && ( i < this->steps ); i++ )
+		delete[] this->RMSE[ i ];
+	delete[] this->RMSE;
+	this->RMSE = NULL;
+	delete[] this->work;
+	this->work = NULL;
 } //}}}
 
 void ErrorTester::run()
@@ -75,63 +151,271 @@ void ErrorTester::run()
 		cerr << "Brute force calculation was not providided\n";
 		return;
 	}
-	if( this->minTau < 2.0 * numeric_limits<long double>::epsilon() )
-		this->minTau = this->tauDelta;
 
-	unsigned int totalSteps = 1 +
-		(int)( ( this->maxTau - this->minTau ) / this->tauDelta );
+	// Results picked up by resume() are carried on from, anything else is
+	// started over
+	if( !this->resumed )
+		this->resetResults();
+	this->resumed = false;
 	cout << "[" << this->minTau << ", " << this->maxTau << "] "
-		<< this->tauDelta << " (" << totalSteps << ")\n";
+		<< this->tauDelta << " (" << this->steps << ")\n";
 
-	this->RMSE = new long double*[ totalSteps ];
 	ParticleSystem* ctauPS = new ParticleSystem();
 	(*ctauPS) = *(this->bruteForce);
-	Quadtree* ctauQT = new Quadtree( ctauPS );
-	BarnesHut* mBH = new BarnesHut( ctauPS, ctauQT );
-	mBH->setLast( ctauPS->getSize() );
+	Quadtree* ctauQT = NULL;
+	BarnesHut* mBH = NULL;
+	LinearQuadtree* ctauLQT = NULL;
+	FastMultipole* mFMM = NULL;
+	if( this->fmmOrder > 0 )
+	{
+		ctauLQT = new LinearQuadtree();
+		ctauLQT->setLeafCapacity( this->leafCapacity );
+		ctauLQT->build( ctauPS );
+		mFMM = new FastMultipole( ctauLQT, this->fmmOrder );
+	}
+	else
+	{
+		ctauQT = new Quadtree( ctauPS, &this->arena, this->leafCapacity );
+		if( this->order > 1 )
+			ctauQT->setOrder( this->order );
+		mBH = new BarnesHut( ctauPS, ctauQT );
+		mBH->setLast( ctauPS->getSize() );
+	}
 
-	for( long double ctau = this->minTau; ctau < this->maxTau;
-			ctau += this->tauDelta )
+	time_t lastCheckpoint = time( NULL );
+	for( unsigned int i = 0; i < this->steps; i++ )
 	{
-		ctauPS->zeroForces();
-		ctauQT->setTau( ctau );
+		if( this->RMSE[ i ] != NULL )
+			continue;
 
-		mBH->start();
-		mBH->wait();
+		long double ctau = this->minTau + i * this->tauDelta;
+		ctauPS->zeroForces();
+		if( mFMM != NULL )
+		{
+			mFMM->setTau( ctau );
+			mFMM->run();
+		}
+		else
+		{
+			ctauQT->setTau( ctau );
+			mBH->run();
+		}
 
-		unsigned int i = (int)((ctau - this->minTau) / this->tauDelta);
 		this->RMSE[ i ] = ErrorTester::calculateRMSE(
 				this->bruteForce, ctauPS );
+
+		unsigned long long interactions = 0;
+		for( unsigned int j = 0; j < ctauPS->getSize(); j++ )
+			interactions += ctauPS->getCost( j );
+		this->work[ i ] = (long double)interactions / ctauPS->getSize();
+
+		if(( this->checkpointInterval > 0 ) && ( i + 1 < this->steps ) &&
+			( time( NULL ) - lastCheckpoint >= (time_t)this->checkpointInterval ))
+		{
+			this->checkpoint();
+			lastCheckpoint = time( NULL );
+		}
 	}
-	delete ctauPS;
+	delete mBH;
+	delete mFMM;
+	delete ctauLQT;
 	delete ctauQT;
+	delete ctauPS;
+	this->arena.reset();
 
-	this->save();
+	// Once the results are safely saved the checkpoint is no longer needed
+	if( this->save() )
+		remove(( this->resultName() + ".checkpoint" ).c_str() );
 } //}}}
 
-void ErrorTester::save() const
+bool ErrorTester::save() const
 { //{{{
-	stringstream tmp; tmp << this->fileName << "_" << this->minTau
-		<< "_" << this->maxTau << "_" << this->tauDelta;
-	cout << "Saving RMSE values to " << tmp.str() << "\n";
-	ofstream outFile( tmp.str().c_str() );
+	string name = this->resultName();
+	cout << "Saving RMSE values to " << name << "\n";
+	ofstream outFile( name.c_str() );
 
 	if( !outFile.good() )
 	{
 		cerr << "Could not save RMSE values\n";
-		return;
+		return false;
 	}
 
-	unsigned int totalSteps = 1 +
-		(int)( ( this->maxTau - this->minTau ) / this->tauDelta );
-	for( long double ctau = this->minTau; ctau < this->maxTau;
-			ctau += this->tauDelta )
+	for( unsigned int i = 0; i < this->steps; i++ )
 	{
-		unsigned int i = (int)((ctau - this->minTau) / this->tauDelta);
+		if( this->RMSE[ i ] == NULL )
+			continue;
+		long double ctau = this->minTau + i * this->tauDelta;
 		outFile
 			<< fixed << setprecision( 8 ) << setw( 12 ) << ctau << '\t'
 			<< fixed << setprecision( 12 ) << setw( 16 ) << this->RMSE[ i ][ 0 ] << '\t'
-			<< fixed << setprecision( 12 ) << setw( 16 ) << this->RMSE[ i ][ 1 ] << '\n';
+			<< fixed << setprecision( 12 ) << setw( 16 ) << this->RMSE[ i ][ 1 ] << '\t'
+			<< fixed << setprecision( 2 ) << setw( 10 ) << this->work[ i ] << '\n';
+	}
+	return outFile.good();
+} //}}}
+
+bool ErrorTester::resume()
+{ //{{{
+	string name = this->resultName() + ".checkpoint";
+	ifstream file( name.c_str(), ifstream::binary );
+	CheckpointHeader header;
+	if( !file.read( (char*)&header, sizeof( header )))
+	{
+		cerr << "There is no checkpoint " << name << " to resume from\n";
+		return false;
+	}
+
+	// The checkpoint has to be of this test, this build and this file {{{
+	this->resetResults();
+	ParticleSystem* ps = new ParticleSystem( this->fileName );
+	const char* problem = NULL;
+	if(( memcmp( header.magic, CHECKPOINT_MAGIC, sizeof( header.magic )) != 0 ) ||
+		( header.version != CHECKPOINT_VERSION ))
+		problem = "is not a checkpoint this can read";
+	else if( header.realBytes != sizeof( Real ))
+		problem = "was made by a build of another precision";
+	else if(( header.order != this->order ) ||
+		( header.leafCapacity != this->leafCapacity ) ||
+		( header.fmmOrder != this->fmmOrder ) ||
+		( header.steps != this->steps ) ||
+		( fabs( header.minTau - this->minTau ) > this->tauDelta / 2 ) ||
+		( fabs( header.maxTau - this->maxTau ) > this->tauDelta / 2 ) ||
+		( fabs( header.tauDelta - this->tauDelta ) > this->tauDelta / 1e6 ))
+		problem = "is of a test with other settings";
+	else if(( ps->getSize() < 1 ) || ( header.particles != ps->getSize() ))
+		problem = "does not fit the particles in the file";
+	if( problem != NULL )
+	{
+		cerr << name << " " << problem << "\n";
+		delete ps;
+		return false;
+	} //}}}
+
+	// Read what was done, then give the particles their brute-force forces {{{
+	char* done = new char[ this->steps ];
+	long double* values = new long double[ 3 * this->steps ];
+	file.read( done, this->steps );
+	file.read( (char*)values, 3 * this->steps * sizeof( long double ));
+	file.read( (char*)ps->getFXs(), ps->getSize() * sizeof( Real ));
+	file.read( (char*)ps->getFYs(), ps->getSize() * sizeof( Real ));
+	if( !file )
+	{
+		cerr << name << " is shorter than it should be\n";
+		delete[] done;
+		delete[] values;
+		delete ps;
+		return false;
+	}
+
+	unsigned int count = 0;
+	for( unsigned int i = 0; i < this->steps; i++ )
+	{
+		if( !done[ i ] )
+			continue;
+		this->RMSE[ i ] = new long double[ 2 ];
+		this->RMSE[ i ][ 0 ] = values[ 3 * i ];
+		this->RMSE[ i ][ 1 ] = values[ 3 * i + 1 ];
+		this->work[ i ] = values[ 3 * i + 2 ];
+		count++;
+	}
+	delete[] done;
+	delete[] values; //}}}
+
+	this->setBruteForce( ps );
+	delete ps;
+	this->resumed = true;
+	cout << "Resuming from " << name << " with " << count << " of "
+		<< this->steps << " taus done\n";
+	return true;
+} //}}}
+
+string ErrorTester::resultName() const
+{ //{{{
+	stringstream tmp; tmp << this->fileName << "_" << this->minTau
+		<< "_" << this->maxTau << "_" << this->tauDelta;
+	// Everything resume() checks is named, so tests that differ in any of it
+	// never share a checkpoint
+	if( this->fmmOrder > 0 )
+		tmp << "_f" << this->fmmOrder;
+	if( this->order > 1 )
+		tmp << "_o" << this->order;
+	if( this->leafCapacity > 1 )
+		tmp << "_b" << this->leafCapacity;
+	return tmp.str();
+} //}}}
+
+bool ErrorTester::checkpoint() const
+{ //{{{
+	string name = this->resultName() + ".checkpoint";
+	string partName = name + ".part";
+
+	CheckpointHeader header;
+	memset( &header, 0, sizeof( header ));
+	memcpy( header.magic, CHECKPOINT_MAGIC, sizeof( header.magic ));
+	header.version = CHECKPOINT_VERSION;
+	header.realBytes = sizeof( Real );
+	header.order = this->order;
+	header.leafCapacity = this->leafCapacity;
+	header.fmmOrder = this->fmmOrder;
+	header.steps = this->steps;
+	header.particles = this->bruteForce->getSize();
+	header.minTau = this->minTau;
+	header.maxTau = this->maxTau;
+	header.tauDelta = this->tauDelta;
+
+	char* done = new char[ this->steps ];
+	long double* values = new long double[ 3 * this->steps ];
+	for( unsigned int i = 0; i < this->steps; i++ )
+	{
+		done[ i ] = ( this->RMSE[ i ] != NULL );
+		values[ 3 * i ] = done[ i ] ? this->RMSE[ i ][ 0 ] : 0;
+		values[ 3 * i + 1 ] = done[ i ] ? this->RMSE[ i ][ 1 ] : 0;
+		values[ 3 * i + 2 ] = done[ i ] ? this->work[ i ] : 0;
+	}
+
+	ofstream file( partName.c_str(), ofstream::binary );
+	file.write( (const char*)&header, sizeof( header ));
+	file.write( done, this->steps );
+	file.write( (const char*)values, 3 * this->steps * sizeof( long double ));
+	file.write( (const char*)this->bruteForce->getFXs(),
+			header.particles * sizeof( Real ));
+	file.write( (const char*)this->bruteForce->getFYs(),
+			header.particles * sizeof( Real ));
+	file.close();
+	delete[] done;
+	delete[] values;
+
+	// Only put it in place of the last checkpoint once it is all written
+	if( !file || ( rename( partName.c_str(), name.c_str() ) != 0 ))
+	{
+		cerr << "Could not save checkpoint " << name << "\n";
+		remove( partName.c_str() );
+		return false;
+	}
+	return true;
+} //}}}
+
+void ErrorTester::resetResults()
+{ //{{{
+	for( unsigned int i = 0; ( this->RMSE != NULL ) && ( i < this->steps ); i++ )
+		delete[] this->RMSE[ i ];
+	delete[] this->RMSE;
+	delete[] this->work;
+
+	if( this->minTau < 2.0 * numeric_limits<long double>::epsilon() )
+		this->minTau = this->tauDelta;
+
+	// Count the taus below the max without adding up rounding errors
+	this->steps = 0;
+	while( this->minTau + this->steps * this->tauDelta < this->maxTau )
+		this->steps++;
+
+	this->RMSE = new long double*[ this->steps ];
+	this->work = new long double[ this->steps ];
+	for( unsigned int i = 0; i < this->steps; i++ )
+	{
+		this->RMSE[ i ] = NULL;
+		this->work[ i ] = 0;
 	}
 } //}}}
 
@@ -160,6 +444,26 @@ long double ErrorTester::getTauDelta() const
 	return this->tauDelta;
 } //}}}
 
+unsigned int ErrorTester::getOrder() const
+{ //{{{
+	return this->order;
+} //}}}
+
+unsigned int ErrorTester::getLeafCapacity() const
+{ //{{{
+	return this->leafCapacity;
+} //}}}
+
+unsigned int ErrorTester::getFmmOrder() const
+{ //{{{
+	return this->fmmOrder;
+} //}}}
+
+unsigned int ErrorTester::getCheckpointInterval() const
+{ //{{{
+	return this->checkpointInterval;
+} //}}}
+
 void ErrorTester::setBruteForce( ParticleSystem* nBruteForce )
 { //{{{
 	*(this->bruteForce) = *nBruteForce;
@@ -185,6 +489,26 @@ void ErrorTester::setTauDelta( long double nTauDelta )
 	this->tauDelta = nTauDelta;
 } //}}}
 
+void ErrorTester::setOrder( unsigned int nOrder )
+{ //{{{
+	this->order = nOrder;
+} //}}}
+
+void ErrorTester::setLeafCapacity( unsigned int nLeafCapacity )
+{ //{{{
+	this->leafCapacity = nLeafCapacity;
+} //}}}
+
+void ErrorTester::setFmmOrder( unsigned int nFmmOrder )
+{ //{{{
+	this->fmmOrder = nFmmOrder;
+} //}}}
+
+void ErrorTester::setCheckpointInterval( unsigned int nSeconds )
+{ //{{{
+	this->checkpointInterval = nSeconds;
+} //}}}
+
 ParticleSystem* ErrorTester::generateBruteForce( string fileName )
 { //{{{
 	cout << "Beginning brute-force calculation\n";
@@ -196,13 +520,13 @@ ParticleSystem* ErrorTester::generateBruteForce( string fileName )
 		return NULL;
 	}
 
-	Quadtree BFTree( bfResult );
+	NodeArena BFArena;
+	Quadtree BFTree( bfResult, &BFArena );
 	BFTree.setTau( 0 );
 
 	BarnesHut bruteForceBH( bfResult, &BFTree );
 	bruteForceBH.setLast( bfResult->getSize() );
-	bruteForceBH.start();
-	bruteForceBH.wait();
+	bruteForceBH.run();
 
 	cout << "Brute-force calculation done\n";
 	return bfResult;
@@ -217,13 +541,16 @@ long double* ErrorTester::calculateRMSE( ParticleSystem* bruteForce,
 		return RMSE;
 
 	long double sumErrorSquaredFX = 0.0, sumErrorSquaredFY = 0.0;
-	Particle* bfP; Particle* bhP;
+	const Real* bfFX = bruteForce->getFXs();
+	const Real* bfFY = bruteForce->getFYs();
+	const Real* bhFX = BarnesHut->getFXs();
+	const Real* bhFY = BarnesHut->getFYs();
 	for( unsigned int i = 0; i < bruteForce->getSize(); i++ )
 	{
-		bfP = bruteForce->getParticle( i );
-		bhP = BarnesHut->getParticle( i );
-		sumErrorSquaredFX += (bfP->fx - bhP->fx) * (bfP->fx - bhP->fx);
-		sumErrorSquaredFY += (bfP->fy - bhP->fy) * (bfP->fy - bhP->fy);
+		long double ex = (long double)bfFX[ i ] - bhFX[ i ];
+		long double ey = (long double)bfFY[ i ] - bhFY[ i ];
+		sumErrorSquaredFX += ex * ex;
+		sumErrorSquaredFY += ey * ey;
 	}
 	RMSE[ 0 ] = sqrt( sumErrorSquaredFX / bruteForce->getSize() );
 	RMSE[ 1 ] = sqrt( sumErrorSquaredFY / bruteForce->getSize() );
@@ -231,3 +558,82 @@ long double* ErrorTester::calculateRMSE( ParticleSystem* bruteForce,
 	return RMSE;
 } //}}}
 
+long double* ErrorTester::compareMixedPrecision( string fileName,
+		long double tau )
+{ //{{{
+	ParticleSystem full( fileName );
+	if( full.getSize() < 1 )
+	{
+		cerr << "Mixed precision comparison could not be completed\n";
+		return NULL;
+	}
+	ParticleSystem mixed( full );
+
+	// Both walk the same tree shape and open nodes on the same positive and
+	// negative moments, so the difference is the cost of the precision: the
+	// float copies, and the few nodes rounding moves across the opening test
+	LinearQuadtree fullLQT;
+	fullLQT.setTau( tau );
+	fullLQT.build( &full );
+	LinearQuadtree mixedLQT;
+	mixedLQT.setTau( tau );
+	mixedLQT.setMixedPrecision( true );
+	mixedLQT.build( &mixed );
+
+	BarnesHut mBH( &full );
+	mBH.setLinearQuadTree( &fullLQT );
+	mBH.setLast( full.getSize() );
+	mBH.run();
+
+	mBH.setParticleSystem( &mixed );
+	mBH.setLinearQuadTree( &mixedLQT );
+	mBH.run();
+
+	return reportRMSE( "Mixed against full precision", &full, &mixed );
+} //}}}
+
+long double* ErrorTester::compareDualTree( string fileName, long double tau,
+		unsigned int leafCapacity, unsigned int order )
+{ //{{{
+	ParticleSystem single( fileName );
+	if( single.getSize() < 1 )
+	{
+		cerr << "Dual tree comparison could not be completed\n";
+		return NULL;
+	}
+	ParticleSystem dual( single );
+
+	// Both trees have the same shape, so only the walk differs
+	NodeArena compareArena;
+	Quadtree singleQT( &single, &compareArena, leafCapacity );
+	singleQT.setTau( tau );
+	Quadtree dualQT( &dual, &compareArena, leafCapacity );
+	dualQT.setTau( tau );
+	if( order > 1 )
+	{
+		singleQT.setOrder( order );
+		dualQT.setOrder( order );
+	}
+
+	BarnesHut mBH( &single, &singleQT );
+	mBH.setLast( single.getSize() );
+	mBH.run();
+
+	mBH.setParticleSystem( &dual );
+	mBH.setQuadTree( &dualQT );
+	mBH.setDualTree( true );
+	mBH.run();
+
+	unsigned long long singleWork = 0, dualWork = 0;
+	for( unsigned int i = 0; i < single.getSize(); i++ )
+	{
+		singleWork += single.getCost( i );
+		dualWork += dual.getCost( i );
+	}
+	cout << "Mean interactions per particle: "
+		<< fixed << setprecision( 2 )
+		<< (long double)singleWork / single.getSize() << " walked singly, "
+		<< (long double)dualWork / dual.getSize() << " dual tree\n";
+
+	return reportRMSE( "Dual tree against single walk", &single, &dual );
+} //}}}
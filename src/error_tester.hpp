@@ -26,10 +26,18 @@
 
 #include "particle_system.hpp"
 #include "quadtree.hpp"
+#include "linear_quadtree.hpp"
+#include "fast_multipole.hpp"
+#include "node_arena.hpp"
 
 /**
  * ErrorTester represents a thread responsible for running an RMS error test on
  * a range of tau values for use in output verification.
+ *
+ * Every so often while it runs, the taus done so far, their RMSE and
+ * interaction counts, and the brute-force forces are saved to a checkpoint
+ * file beside the results, so a test that is stopped can be picked up where
+ * it left off with resume().
  */
 class ErrorTester : public QThread
 {
@@ -53,8 +61,20 @@ class ErrorTester : public QThread
 
 		/**
 		 * Saves this system's collected RMSE values to a file.
+		 * @return : true if the file was written
+		 */
+		bool save() const;
+
+		/**
+		 * Picks up a test stopped part way from its checkpoint, for the next
+		 * run() to carry on from. The particles are loaded from the file and
+		 * given the brute-force forces saved in the checkpoint, so no
+		 * brute-force simulation is needed. The tau bounds, tau delta and
+		 * tree settings must be set as they were first.
+		 * @return : false, with a message printed, if there is no
+		 * checkpoint for this test or it does not fit the file
 		 */
-		void save() const;
+		bool resume();
 
 		/**
 		 * Returns a pointer to the current brute-force simulation.
@@ -86,6 +106,30 @@ class ErrorTester : public QThread
 		 */
 		long double getTauDelta() const;
 
+		/**
+		 * Returns the order of the moments the tested tree uses.
+		 * @return : order of moments
+		 */
+		unsigned int getOrder() const;
+
+		/**
+		 * Returns the most particles a leaf of the tested tree holds.
+		 * @return : leaf capacity
+		 */
+		unsigned int getLeafCapacity() const;
+
+		/**
+		 * Returns the order of the fast multipole method's expansions.
+		 * @return : order, 0 if Barnes-Hut is tested instead
+		 */
+		unsigned int getFmmOrder() const;
+
+		/**
+		 * Returns the seconds between checkpoints.
+		 * @return : checkpoint interval, 0 if none are made
+		 */
+		unsigned int getCheckpointInterval() const;
+
 		/**
 		 * Sets the brute-force simulation to point towards something new.
 		 * @param nBruteForce : pointer to new simulation
@@ -116,6 +160,33 @@ class ErrorTester : public QThread
 		 */
 		void setTauDelta( long double nTauDelta = 0.0001 );
 
+		/**
+		 * Sets the order of the moments the tested tree uses, so the error of
+		 * each order can be compared at the same tau.
+		 * @param nOrder : 1 for the monopole alone, 2 to add the quadrupole
+		 */
+		void setOrder( unsigned int nOrder = 1 );
+
+		/**
+		 * Sets the most particles a leaf of the tested tree holds.
+		 * @param nLeafCapacity : new leaf capacity
+		 */
+		void setLeafCapacity( unsigned int nLeafCapacity = 1 );
+
+		/**
+		 * Tests the fast multipole method on a linear quad tree instead of
+		 * Barnes-Hut, tau being what it tests pairs of cells against.
+		 * @param nFmmOrder : order of the expansions, 0 to test Barnes-Hut
+		 */
+		void setFmmOrder( unsigned int nFmmOrder = 0 );
+
+		/**
+		 * Sets the least seconds between checkpoints. One is made after the
+		 * first tau done once this many seconds have gone by since the last.
+		 * @param nSeconds : new interval, 0 to make no checkpoints
+		 */
+		void setCheckpointInterval( unsigned int nSeconds = 60 );
+
 		/**
 		 * Creates a brute-force simulation and returns it.
 		 * @param fileName : file to load
@@ -131,14 +202,77 @@ class ErrorTester : public QThread
 		static long double* calculateRMSE( ParticleSystem* bruteForce,
 				ParticleSystem* BarnesHut );
 
+		/**
+		 * Runs the Barnes-Hut algorithm on a file with a linear quad tree
+		 * in full and in mixed precision, and reports the RMSE between them.
+		 * Both use the same opening test, so this is what the precision
+		 * costs.
+		 * @param fileName : file to load
+		 * @param tau : tau to use for both
+		 * @return : a long double[ 2 ] containing fx and fy error values, or
+		 * NULL if the file could not be loaded
+		 */
+		static long double* compareMixedPrecision( std::string fileName,
+				long double tau );
+
+		/**
+		 * Runs the Barnes-Hut algorithm on a file with a quad tree walked
+		 * once for each particle and by a dual tree walk, and reports the
+		 * RMSE between them and the interactions each took.
+		 * @param fileName : file to load
+		 * @param tau : tau to use for both
+		 * @param leafCapacity : most particles in a leaf of the tree
+		 * @param order : order of the moments of the tree's cells
+		 * @return : a long double[ 2 ] containing fx and fy error values, or
+		 * NULL if the file could not be loaded
+		 */
+		static long double* compareDualTree( std::string fileName,
+				long double tau, unsigned int leafCapacity = 1,
+				unsigned int order = 1 );
+
 	private:
+		/**
+		 * Returns the name results are saved to, made of the file name and
+		 * the settings of the test.
+		 * @return : name of results file
+		 */
+		std::string resultName() const;
+
+		/**
+		 * Saves every tau done so far, with the brute-force forces, to the
+		 * checkpoint file. It is written to a temporary file first, so an
+		 * interrupted checkpoint leaves the last one as it was.
+		 * @return : false, with a message printed, if it could not be
+		 */
+		bool checkpoint() const;
+
+		/**
+		 * Works out the taus to test from the bounds and delta, and forgets
+		 * any results.
+		 */
+		void resetResults();
+
 		std::string fileName;
 		long double minTau;
 		long double maxTau;
 		long double tauDelta;
+		unsigned int order;
+		unsigned int leafCapacity;
+		unsigned int fmmOrder;
 
 		ParticleSystem* bruteForce;
+		/// Number of taus tested, and the RMSE at each, NULL for those not
+		/// done yet.
+		unsigned int steps;
 		long double** RMSE;
+		/// Mean number of interactions per particle at each tau.
+		long double* work;
+		unsigned int checkpointInterval;
+		/// True if results were picked up by resume() for run() to keep.
+		bool resumed;
+
+		/// Holds the nodes of the tree, kept between runs.
+		NodeArena arena;
 
 		ErrorTester( const ErrorTester& rhs );
 		ErrorTester& operator=( const ErrorTester& rhs );
@@ -0,0 +1,512 @@
+/** {{{
+ * Copyright 2010 Jeff Chapman.
+ *
+ * This file is a part of Barnes-Hut
+ *
+ * Barnes-Hut is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Barnes-Hut is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Barnes-Hut.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */// }}}
+
+#include <iostream>
+using std::cerr;
+
+#include <limits>
+using std::numeric_limits;
+
+#include <cmath>
+
+#include "fast_multipole.hpp"
+#include "thread_pool.hpp"
+
+/// Highest order of expansion supported.
+static const unsigned int MAX_ORDER = 16;
+/// Subtrees the work is cut into, so idle threads can steal. This does not
+/// depend on the number of threads, as the cells paired up and so the
+/// forces found depend on where the work is cut.
+static const unsigned int SUBTREES = 64;
+static const Real ZERO_MASS = 2.0 * numeric_limits<Real>::epsilon();
+
+/**
+ * Returns where the coefficient of x^a y^b is kept in an expansion, which
+ * holds every order in turn.
+ * @param a : power of x
+ * @param b : power of y
+ * @return : indice of coefficient
+ */
+static inline unsigned int coefficient( unsigned int a, unsigned int b )
+{ //{{{
+	return (a + b) * (a + b + 1) / 2 + b;
+} //}}}
+
+/**
+ * Fills in v^k / k! for k from 0 to order.
+ * @param v : value
+ * @param order : highest power
+ * @param powers : order + 1 results
+ */
+static inline void scaledPowers( Real v, unsigned int order, Real* powers )
+{ //{{{
+	powers[ 0 ] = 1;
+	for( unsigned int k = 1; k <= order; k++ )
+		powers[ k ] = powers[ k - 1 ] * v / k;
+} //}}}
+
+/**
+ * Calculates every partial derivative of 1/|r| up to an order at a point in
+ * the plane. Writing f_j for the j'th derivative of (r^2)^(-1/2) with respect
+ * to r^2, the derivatives of f_j satisfy
+ * D(a + 1, b) f_j = x D(a, b) f_j+1 + a D(a - 1, b) f_j+1,
+ * and likewise in y, so each order is built from the one before it.
+ * @param x : x coordinate of point
+ * @param y : y coordinate of point
+ * @param order : highest order of derivative
+ * @param table : (order + 1) expansions of room; the first holds the results
+ */
+static void derivatives( Real x, Real y, unsigned int order, Real* table )
+{ //{{{
+	unsigned int size = coefficient( 0, order ) + 1;
+	Real inverse = 1.0 / ( x * x + y * y );
+	Real f = sqrt( inverse );
+	for( unsigned int j = 0; j <= order; j++ )
+	{
+		table[ j * size ] = f;
+		f *= -(2.0 * j + 1.0) * inverse;
+	}
+
+	for( unsigned int n = 1; n <= order; n++ )
+	{
+		for( unsigned int j = 0; j + n <= order; j++ )
+		{
+			Real* t = table + j * size;
+			const Real* u = t + size;
+			for( unsigned int b = 0; b <= n; b++ )
+			{
+				unsigned int a = n - b;
+				Real v = 0;
+				if( a > 0 )
+				{
+					v = x * u[ coefficient( a - 1, b ) ];
+					if( a > 1 )
+						v += (a - 1) * u[ coefficient( a - 2, b ) ];
+				}
+				else
+				{
+					v = y * u[ coefficient( 0, b - 1 ) ];
+					if( b > 1 )
+						v += (b - 1) * u[ coefficient( 0, b - 2 ) ];
+				}
+				t[ coefficient( a, b ) ] = v;
+			}
+		}
+	}
+} //}}}
+
+/**
+ * Evaluates a range of subtrees on behalf of the thread pool.
+ */
+class FastMultipoleTask : public ThreadPool::Task
+{
+	public:
+		FastMultipoleTask( FastMultipole* iFMM ) :
+			ThreadPool::Task(), //{{{
+			fmm( iFMM )
+		{
+		} //}}}
+
+		void process( unsigned int first, unsigned int last )
+		{ //{{{
+			this->fmm->evaluate( first, last );
+		} //}}}
+
+	private:
+		FastMultipole* fmm;
+
+		FastMultipoleTask( const FastMultipoleTask& rhs );
+		FastMultipoleTask& operator=( const FastMultipoleTask& rhs );
+};
+
+FastMultipole::FastMultipole( LinearQuadtree* iLQT, unsigned int iOrder ) :
+	mLQT( iLQT ), //{{{
+	order( 6 ),
+	tau( 0.5 ),
+	numThreads( ThreadPool::instance()->getSize() ),
+	mCoefficients( 0 ),
+	mMultipoles( NULL ),
+	mLocals( NULL ),
+	mFar( NULL ),
+	mFX( NULL ),
+	mFY( NULL ),
+	mNear( NULL ),
+	mSubtrees( NULL ),
+	mSubtreeCount( 0 )
+{
+	this->setOrder( iOrder );
+} //}}}
+
+FastMultipole::~FastMultipole()
+{ //{{{
+} //}}}
+
+void FastMultipole::run()
+{ //{{{
+	if(( this->mLQT == NULL ) || ( this->mLQT->getParticleSystem() == NULL ))
+	{
+		cerr << "Tried to run the fast multipole method without a tree\n";
+		return;
+	}
+	unsigned int nodes = this->mLQT->getNodeCount();
+	if( nodes == 0 )
+		return;
+	unsigned int size = this->mLQT->getNode( 0 ).count;
+
+	this->mCoefficients = coefficient( 0, this->order ) + 1;
+	this->mMultipoles = new Real[ 2 * nodes * this->mCoefficients ];
+	this->mLocals = this->mMultipoles + nodes * this->mCoefficients;
+	this->mFar = new unsigned int[ nodes ];
+	this->mFX = new Accumulator[ 2 * size ];
+	this->mFY = this->mFX + size;
+	this->mNear = new unsigned int[ size ];
+	for( unsigned int i = 0; i < nodes * this->mCoefficients; i++ )
+		this->mLocals[ i ] = 0;
+	for( unsigned int n = 0; n < nodes; n++ )
+		this->mFar[ n ] = 0;
+	for( unsigned int i = 0; i < size; i++ )
+	{
+		this->mFX[ i ] = this->mFY[ i ] = 0;
+		this->mNear[ i ] = 0;
+	}
+
+	this->upward();
+
+	unsigned int most = size / SUBTREES;
+	this->findSubtrees( (most > 0) ? most : 1 );
+	if( this->numThreads == 0 )
+		this->evaluate( 0, this->mSubtreeCount );
+	else
+	{
+		FastMultipoleTask task( this );
+		ThreadPool::instance()->run( &task, 0, this->mSubtreeCount,
+				this->numThreads, 1 );
+	}
+
+	delete[] this->mMultipoles;
+	delete[] this->mFar;
+	delete[] this->mFX;
+	delete[] this->mNear;
+	delete[] this->mSubtrees;
+	this->mMultipoles = this->mLocals = NULL;
+	this->mFar = NULL;
+	this->mFX = this->mFY = NULL;
+	this->mNear = NULL;
+	this->mSubtrees = NULL;
+	this->mSubtreeCount = 0;
+} //}}}
+
+void FastMultipole::evaluate( unsigned int first, unsigned int last )
+{ //{{{
+	Real* scratch = new Real[ (this->order + 1) * this->mCoefficients ];
+	for( unsigned int s = first; s < last; s++ )
+	{
+		unsigned int t = this->mSubtrees[ s ];
+		this->interact( t, 0, scratch );
+		this->downward( t, 0 );
+	}
+	delete[] scratch;
+} //}}}
+
+void FastMultipole::upward()
+{ //{{{
+	const Real* x = this->mLQT->getXs();
+	const Real* y = this->mLQT->getYs();
+	const Real* m = this->mLQT->getMasses();
+	unsigned int p = this->order;
+	Real px[ MAX_ORDER + 1 ], py[ MAX_ORDER + 1 ];
+
+	// Children always come after their parents
+	for( unsigned int n = this->mLQT->getNodeCount(); n-- > 0; )
+	{
+		const LinearQuadtree::Node& node = this->mLQT->getNode( n );
+		Real* M = this->mMultipoles + n * this->mCoefficients;
+		for( unsigned int k = 0; k < this->mCoefficients; k++ )
+			M[ k ] = 0;
+		Real cx = node.left + node.size / 2.0;
+		Real cy = node.bottom + node.size / 2.0;
+
+		if( node.childCount == 0 )
+		{
+			for( unsigned int j = node.first; j < node.first + node.count; j++ )
+			{
+				scaledPowers( x[ j ] - cx, p, px );
+				scaledPowers( y[ j ] - cy, p, py );
+				for( unsigned int a = 0; a <= p; a++ )
+					for( unsigned int b = 0; a + b <= p; b++ )
+						M[ coefficient( a, b ) ] += m[ j ] * px[ a ] * py[ b ];
+			}
+			continue;
+		}
+
+		// Shift each child's multipole from its center to this one's
+		for( unsigned int c = 0; c < node.childCount; c++ )
+		{
+			const LinearQuadtree::Node& child =
+				this->mLQT->getNode( node.firstChild + c );
+			const Real* C = this->mMultipoles +
+				(node.firstChild + c) * this->mCoefficients;
+			scaledPowers( child.left + child.size / 2.0 - cx, p, px );
+			scaledPowers( child.bottom + child.size / 2.0 - cy, p, py );
+			for( unsigned int a = 0; a <= p; a++ )
+				for( unsigned int b = 0; a + b <= p; b++ )
+				{
+					Real sum = 0;
+					for( unsigned int i = 0; i <= a; i++ )
+						for( unsigned int j = 0; j <= b; j++ )
+							sum += C[ coefficient( i, j ) ] * px[ a - i ] * py[ b - j ];
+					M[ coefficient( a, b ) ] += sum;
+				}
+		}
+	}
+
+	// Only M2L reads the multipoles from here on, and it wants those of odd
+	// order negated, as the sources sit at -v from the center
+	for( unsigned int n = 0; n < this->mLQT->getNodeCount(); n++ )
+	{
+		Real* M = this->mMultipoles + n * this->mCoefficients;
+		for( unsigned int q = 1; q <= p; q += 2 )
+			for( unsigned int k = coefficient( q, 0 ); k <= coefficient( 0, q ); k++ )
+				M[ k ] = -M[ k ];
+	}
+} //}}}
+
+void FastMultipole::interact( unsigned int a, unsigned int b, Real* scratch )
+{ //{{{
+	const LinearQuadtree::Node& A = this->mLQT->getNode( a );
+	const LinearQuadtree::Node& B = this->mLQT->getNode( b );
+
+	if( a == b )
+	{
+		if( A.childCount == 0 )
+		{
+			this->direct( a, b );
+			return;
+		}
+		for( unsigned int i = 0; i < A.childCount; i++ )
+			for( unsigned int j = 0; j < A.childCount; j++ )
+				this->interact( A.firstChild + i, A.firstChild + j, scratch );
+		return;
+	}
+	// Far enough apart, so B's multipole becomes part of A's local expansion {{{
+	Real rx = (A.left + A.size / 2.0) - (B.left + B.size / 2.0);
+	Real ry = (A.bottom + A.size / 2.0) - (B.bottom + B.size / 2.0);
+	Real d = sqrt( rx * rx + ry * ry );
+	bool overlaps = ( A.left < B.left + B.size ) && ( B.left < A.left + A.size ) &&
+		( A.bottom < B.bottom + B.size ) && ( B.bottom < A.bottom + A.size );
+	if(( A.size + B.size < this->tau * d ) && !overlaps )
+	{
+		// Going order by order, the coefficients of each order are
+		// contiguous and every sum is a plain dot product
+		unsigned int p = this->order;
+		derivatives( rx, ry, p, scratch );
+		const Real* M = this->mMultipoles + b * this->mCoefficients;
+		Real* L = this->mLocals + a * this->mCoefficients;
+		for( unsigned int q = 0; q <= p; q++ )
+			for( unsigned int j = 0; j <= q; j++ )
+			{
+				Real sum = 0;
+				for( unsigned int r = 0; q + r <= p; r++ )
+				{
+					const Real* Mr = M + coefficient( r, 0 );
+					const Real* D = scratch + coefficient( q + r, 0 ) + j;
+					for( unsigned int l = 0; l <= r; l++ )
+						sum += Mr[ l ] * D[ l ];
+				}
+				L[ coefficient( q - j, j ) ] += sum;
+			}
+		this->mFar[ a ]++;
+		return;
+	} //}}}
+
+	// Otherwise open the larger cell, or add up two leaves directly {{{
+	if(( A.childCount > 0 ) && (( B.childCount == 0 ) || ( A.size >= B.size )))
+	{
+		for( unsigned int i = 0; i < A.childCount; i++ )
+			this->interact( A.firstChild + i, b, scratch );
+		return;
+	}
+	if( B.childCount > 0 )
+	{
+		for( unsigned int j = 0; j < B.childCount; j++ )
+			this->interact( a, B.firstChild + j, scratch );
+		return;
+	} //}}}
+
+	this->direct( a, b );
+} //}}}
+
+void FastMultipole::direct( unsigned int a, unsigned int b )
+{ //{{{
+	const LinearQuadtree::Node& A = this->mLQT->getNode( a );
+	const LinearQuadtree::Node& B = this->mLQT->getNode( b );
+	const Real* x = this->mLQT->getXs();
+	const Real* y = this->mLQT->getYs();
+	const Real* m = this->mLQT->getMasses();
+	for( unsigned int i = A.first; i < A.first + A.count; i++ )
+	{
+		Accumulator fx = 0, fy = 0;
+		for( unsigned int j = B.first; j < B.first + B.count; j++ )
+		{
+			if(( j == i ) || ( fabs( m[ j ] ) < ZERO_MASS ))
+				continue;
+			Real dx = x[ j ] - x[ i ];
+			Real dy = y[ j ] - y[ i ];
+			Real d2 = dx * dx + dy * dy;
+			Real s = m[ j ] / ( sqrt( d2 ) * d2 );
+			fx += dx * s;
+			fy += dy * s;
+			this->mNear[ i ]++;
+		}
+		this->mFX[ i ] += fx;
+		this->mFY[ i ] += fy;
+	}
+} //}}}
+
+void FastMultipole::downward( unsigned int n, unsigned int far )
+{ //{{{
+	const LinearQuadtree::Node& node = this->mLQT->getNode( n );
+	const Real* L = this->mLocals + n * this->mCoefficients;
+	unsigned int p = this->order;
+	Real cx = node.left + node.size / 2.0;
+	Real cy = node.bottom + node.size / 2.0;
+	Real px[ MAX_ORDER + 1 ], py[ MAX_ORDER + 1 ];
+	far += this->mFar[ n ];
+
+	if( node.childCount > 0 )
+	{
+		// Shift this's local expansion to each child's center
+		for( unsigned int c = 0; c < node.childCount; c++ )
+		{
+			const LinearQuadtree::Node& child =
+				this->mLQT->getNode( node.firstChild + c );
+			Real* C = this->mLocals + (node.firstChild + c) * this->mCoefficients;
+			scaledPowers( child.left + child.size / 2.0 - cx, p, px );
+			scaledPowers( child.bottom + child.size / 2.0 - cy, p, py );
+			for( unsigned int a = 0; a <= p; a++ )
+				for( unsigned int b = 0; a + b <= p; b++ )
+				{
+					Real sum = 0;
+					for( unsigned int i = 0; a + b + i <= p; i++ )
+						for( unsigned int j = 0; a + b + i + j <= p; j++ )
+							sum += L[ coefficient( a + i, b + j ) ] * px[ i ] * py[ j ];
+					C[ coefficient( a, b ) ] += sum;
+				}
+			this->downward( node.firstChild + c, far );
+		}
+		return;
+	}
+
+	// The force is the gradient of the local expansion at each particle
+	const Real* x = this->mLQT->getXs();
+	const Real* y = this->mLQT->getYs();
+	const Real* m = this->mLQT->getMasses();
+	ParticleSystem* ps = this->mLQT->getParticleSystem();
+	for( unsigned int j = node.first; j < node.first + node.count; j++ )
+	{
+		scaledPowers( x[ j ] - cx, p, px );
+		scaledPowers( y[ j ] - cy, p, py );
+		Accumulator fx = this->mFX[ j ], fy = this->mFY[ j ];
+		for( unsigned int a = 0; a < p; a++ )
+			for( unsigned int b = 0; a + b < p; b++ )
+			{
+				fx += L[ coefficient( a + 1, b ) ] * px[ a ] * py[ b ];
+				fy += L[ coefficient( a, b + 1 ) ] * px[ a ] * py[ b ];
+			}
+		unsigned int indice = this->mLQT->getOrder( j );
+		ps->addForce( indice, m[ j ] * fx, m[ j ] * fy );
+		ps->setCost( indice, far + this->mNear[ j ] );
+	}
+} //}}}
+
+void FastMultipole::findSubtrees( unsigned int most )
+{ //{{{
+	unsigned int nodes = this->mLQT->getNodeCount();
+	this->mSubtrees = new unsigned int[ nodes ];
+	this->mSubtreeCount = 0;
+
+	unsigned int* stack = new unsigned int[ nodes ];
+	unsigned int depth = 0;
+	stack[ depth++ ] = 0;
+	while( depth > 0 )
+	{
+		unsigned int n = stack[ --depth ];
+		const LinearQuadtree::Node& node = this->mLQT->getNode( n );
+		if(( node.childCount == 0 ) || ( node.count <= most ))
+		{
+			this->mSubtrees[ this->mSubtreeCount++ ] = n;
+			continue;
+		}
+		for( unsigned int c = node.childCount; c-- > 0; )
+			stack[ depth++ ] = node.firstChild + c;
+	}
+	delete[] stack;
+} //}}}
+
+LinearQuadtree* FastMultipole::getLinearQuadTree()
+{ //{{{
+	return this->mLQT;
+} //}}}
+
+unsigned int FastMultipole::getOrder() const
+{ //{{{
+	return this->order;
+} //}}}
+
+Real FastMultipole::getTau() const
+{ //{{{
+	return this->tau;
+} //}}}
+
+unsigned int FastMultipole::getNumberOfThreads() const
+{ //{{{
+	return this->numThreads;
+} //}}}
+
+void FastMultipole::setLinearQuadTree( LinearQuadtree* nLQT )
+{ //{{{
+	this->mLQT = nLQT;
+} //}}}
+
+void FastMultipole::setOrder( unsigned int nOrder )
+{ //{{{
+	if(( nOrder < 1 ) || ( nOrder > MAX_ORDER ))
+	{
+		cerr << "Expansions of order " << nOrder << " are not supported, "
+			<< "keeping order " << this->order << "\n";
+		return;
+	}
+	this->order = nOrder;
+} //}}}
+
+void FastMultipole::setTau( Real nTau )
+{ //{{{
+	this->tau = nTau;
+} //}}}
+
+void FastMultipole::setNumberOfThreads( unsigned int num )
+{ //{{{
+	this->numThreads = num;
+} //}}}
+
+unsigned int FastMultipole::getMaxOrder()
+{ //{{{
+	return MAX_ORDER;
+} //}}}
@@ -0,0 +1,194 @@
+/** {{{
+ * Copyright 2010 Jeff Chapman.
+ *
+ * This file is a part of Barnes-Hut
+ *
+ * Barnes-Hut is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Barnes-Hut is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Barnes-Hut.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */// }}}
+#ifndef FAST_MULTIPOLE_HPP
+#define FAST_MULTIPOLE_HPP
+
+#include "particle_system.hpp"
+#include "linear_quadtree.hpp"
+
+/**
+ * Finds the forces on every particle of a LinearQuadtree with the fast
+ * multipole method, in time linear in the number of particles.
+ *
+ * Each cell gets a Taylor expansion of the potential of everything in it
+ * (its multipole) and of everything far from it (its local expansion), both
+ * in Cartesian powers about the cell's center up to a given order. Cells are
+ * built up from their children, and pairs of cells far enough apart for tau
+ * are turned from one into the other. Local expansions are then passed down
+ * to the leaves, where the particles read their far forces off them and add
+ * the forces of nearby leaves directly.
+ *
+ * The pull here falls off as 1/d^2, from a 1/d potential, so the complex
+ * expansions of the 2D logarithmic potential do not apply; Cartesian ones
+ * work for any order and stay exact in the plane.
+ *
+ * The work is split over the shared ThreadPool by subtrees, each of which
+ * only writes to its own cells and particles.
+ */
+class FastMultipole
+{
+	public:
+		/**
+		 * Create a solver for a tree.
+		 * @param iLQT : tree whose particles to find forces for
+		 * @param iOrder : highest order of the expansions
+		 */
+		FastMultipole( LinearQuadtree* iLQT = NULL, unsigned int iOrder = 6 );
+
+		/**
+		 * Proper deconstructor that deletes all associated memory.
+		 */
+		~FastMultipole();
+
+		/**
+		 * Adds the force on every particle of the tree's particle system,
+		 * recording the number of cells and particles each took as its cost.
+		 * Uses getNumberOfThreads() threads.
+		 */
+		void run();
+
+		/**
+		 * Finds the forces on the particles of a range of the subtrees run()
+		 * splits the work into.
+		 * @param first : first subtree
+		 * @param last : one past the last subtree
+		 */
+		void evaluate( unsigned int first, unsigned int last );
+
+		/**
+		 * Returns the tree this works on.
+		 * @return : associated tree
+		 */
+		LinearQuadtree* getLinearQuadTree();
+
+		/**
+		 * Returns the highest order of the expansions.
+		 * @return : order
+		 */
+		unsigned int getOrder() const;
+
+		/**
+		 * Returns the tau two cells are tested against; they are far enough
+		 * apart when the sum of their widths is less than tau times the
+		 * distance between their centers.
+		 * @return : this's tau
+		 */
+		Real getTau() const;
+
+		/**
+		 * Return the most threads from the shared pool used by run().
+		 * @return : number of threads
+		 */
+		unsigned int getNumberOfThreads() const;
+
+		/**
+		 * Associate a new tree with this.
+		 * @param nLQT : new tree
+		 */
+		void setLinearQuadTree( LinearQuadtree* nLQT );
+
+		/**
+		 * Sets the highest order of the expansions. Higher orders are more
+		 * accurate and take longer for each pair of cells.
+		 * @param nOrder : new order, from 1 to getMaxOrder()
+		 */
+		void setOrder( unsigned int nOrder );
+
+		/**
+		 * Sets the tau two cells are tested against.
+		 * @param nTau : new value for tau
+		 */
+		void setTau( Real nTau );
+
+		/**
+		 * Set the most threads from the shared pool run() may use.
+		 * @param num : number of threads, 0 or 1 to run serially
+		 */
+		void setNumberOfThreads( unsigned int num );
+
+		/**
+		 * Returns the highest order setOrder() accepts.
+		 * @return : highest order
+		 */
+		static unsigned int getMaxOrder();
+
+	private:
+		/**
+		 * Calculates the multipole of every cell, children before parents.
+		 */
+		void upward();
+
+		/**
+		 * Adds what the contents of one cell do to the contents of another,
+		 * splitting them until they are far enough apart or both leaves.
+		 * @param a : indice of the cell acted upon
+		 * @param b : indice of the cell acting
+		 * @param scratch : room for the derivatives of one pair
+		 */
+		void interact( unsigned int a, unsigned int b, Real* scratch );
+
+		/**
+		 * Adds the forces of the particles in one leaf on those in another,
+		 * one pair at a time.
+		 * @param a : indice of the leaf acted upon
+		 * @param b : indice of the leaf acting, which may be a
+		 */
+		void direct( unsigned int a, unsigned int b );
+
+		/**
+		 * Passes local expansions down a subtree and evaluates them and the
+		 * direct forces for its particles.
+		 * @param n : indice of the subtree's root
+		 * @param far : cells turned into local expansions above n
+		 */
+		void downward( unsigned int n, unsigned int far );
+
+		/**
+		 * Lists subtrees to hand out to threads.
+		 * @param most : most particles in a subtree unless it is a leaf
+		 */
+		void findSubtrees( unsigned int most );
+
+		LinearQuadtree* mLQT;
+		unsigned int order;
+		Real tau;
+		unsigned int numThreads;
+
+		/// Number of coefficients in one expansion.
+		unsigned int mCoefficients;
+		/// Multipole and local expansion of each cell, mCoefficients apiece.
+		Real* mMultipoles;
+		Real* mLocals;
+		/// Cells turned into each cell's local expansion.
+		unsigned int* mFar;
+		/// Force per unit mass on each particle in tree order, and the
+		/// particles it was found directly from.
+		Accumulator* mFX;
+		Accumulator* mFY;
+		unsigned int* mNear;
+		/// Roots of the subtrees the work is split into.
+		unsigned int* mSubtrees;
+		unsigned int mSubtreeCount;
+
+		FastMultipole( const FastMultipole& rhs );
+		FastMultipole& operator=( const FastMultipole& rhs );
+};
+
+#endif // FAST_MULTIPOLE_HPP
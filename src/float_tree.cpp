@@ -0,0 +1,226 @@
+/** {{{
+ * Copyright 2010 Jeff Chapman.
+ *
+ * This file is a part of Barnes-Hut
+ *
+ * Barnes-Hut is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Barnes-Hut is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Barnes-Hut.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */// }}}
+
+#include "float_tree.hpp"
+
+#include <limits>
+using std::numeric_limits;
+
+static const Real ZERO_MASS = 2.0 * numeric_limits<Real>::epsilon();
+
+FloatTree::FloatTree() :
+	mNodes( NULL ), //{{{
+	mNodeCount( 0 ),
+	mSize( 0 ),
+	mData( NULL ),
+	mX( NULL ),
+	mY( NULL ),
+	mM( NULL ),
+	mOrder( NULL )
+{
+} //}}}
+
+FloatTree::~FloatTree()
+{ //{{{
+	this->clear();
+} //}}}
+
+void FloatTree::allocate( unsigned int nNodeCount, unsigned int nSize,
+		const unsigned int* nOrder )
+{ //{{{
+	this->clear();
+	this->mNodes = new Node[ nNodeCount ];
+	this->mNodeCount = nNodeCount;
+
+	this->mData = new float[ 3 * nSize ];
+	this->mX = this->mData;
+	this->mY = this->mX + nSize;
+	this->mM = this->mY + nSize;
+	this->mSize = nSize;
+	this->mOrder = nOrder;
+} //}}}
+
+void FloatTree::clear()
+{ //{{{
+	delete[] this->mNodes;
+	this->mNodes = NULL;
+	this->mNodeCount = 0;
+
+	delete[] this->mData;
+	this->mData = NULL;
+	this->mX = this->mY = this->mM = NULL;
+	this->mSize = 0;
+	this->mOrder = NULL;
+} //}}}
+
+void FloatTree::computeMoments()
+{ //{{{
+	// Children always come after their parent, so walking backwards visits
+	// every child before its parent
+	for( unsigned int n = this->mNodeCount; n-- > 0; )
+	{
+		Node& node = this->mNodes[ n ];
+		double pm = 0, px = 0, py = 0;
+		double nm = 0, nx = 0, ny = 0;
+		if( node.childCount == 0 )
+		{
+			for( unsigned int j = node.first; j < node.first + node.count; j++ )
+			{
+				double jm = this->mM[ j ];
+				if( jm < 0 )
+				{
+					nm += jm;
+					nx += this->mX[ j ] * jm;
+					ny += this->mY[ j ] * jm;
+				}
+				else
+				{
+					pm += jm;
+					px += this->mX[ j ] * jm;
+					py += this->mY[ j ] * jm;
+				}
+			}
+		}
+		else
+		{
+			for( unsigned int c = 0; c < node.childCount; c++ )
+			{
+				const Node& child = this->mNodes[ node.firstChild + c ];
+				pm += child.pos.m;
+				px += (double)child.pos.x * child.pos.m;
+				py += (double)child.pos.y * child.pos.m;
+				nm += child.neg.m;
+				nx += (double)child.neg.x * child.neg.m;
+				ny += (double)child.neg.y * child.neg.m;
+			}
+		}
+
+		// A part with no mass is never used, so its center is only kept
+		// somewhere sensible
+		float cx = node.left + node.size / 2.0f;
+		float cy = node.bottom + node.size / 2.0f;
+		node.pos.m = pm;
+		node.pos.x = ( fabs( pm ) < ZERO_MASS ) ? cx : px / pm;
+		node.pos.y = ( fabs( pm ) < ZERO_MASS ) ? cy : py / pm;
+		node.neg.m = nm;
+		node.neg.x = ( fabs( nm ) < ZERO_MASS ) ? cx : nx / nm;
+		node.neg.y = ( fabs( nm ) < ZERO_MASS ) ? cy : ny / nm;
+	}
+} //}}}
+
+void FloatTree::walk( unsigned int n, double x, double y, unsigned int self,
+		double tau, CompensatedSum& fx, CompensatedSum& fy,
+		unsigned int& interactions ) const
+{ //{{{
+	const Node& node = this->mNodes[ n ];
+
+	// Only what is read is float; the arithmetic is done in double. A leaf
+	// of one particle is just that particle, so only bigger cells are worth
+	// testing
+	if(( node.childCount > 0 ) || ( node.count > 1 ))
+	{
+		bool inside = ( x >= node.left ) && ( x < node.left + node.size ) &&
+			( y >= node.bottom ) && ( y < node.bottom + node.size );
+
+		// The node is used whole if it is far enough from the centers of
+		// both its positive and negative masses; one with no mass of either
+		// sign is opened, as there is nothing to measure the distance to
+		double dx[ 2 ], dy[ 2 ], d3[ 2 ];
+		const Part* parts[ 2 ] = { &node.pos, &node.neg };
+		bool far = !inside, any = false;
+		for( unsigned int i = 0; far && ( i < 2 ); i++ )
+		{
+			if( fabs( parts[ i ]->m ) < ZERO_MASS )
+				continue;
+			dx[ i ] = (double)parts[ i ]->x - x;
+			dy[ i ] = (double)parts[ i ]->y - y;
+			double d2 = dx[ i ] * dx[ i ] + dy[ i ] * dy[ i ];
+			double d = sqrt( d2 );
+			far = ( node.size < tau * d );
+			d3[ i ] = d * d2;
+			any = true;
+		}
+
+		if( far && any )
+		{
+			for( unsigned int i = 0; i < 2; i++ )
+			{
+				if( fabs( parts[ i ]->m ) < ZERO_MASS )
+					continue;
+				double s = parts[ i ]->m / d3[ i ];
+				fx.add( dx[ i ] * s );
+				fy.add( dy[ i ] * s );
+				interactions++;
+			}
+			return;
+		}
+
+		if( node.childCount > 0 )
+		{
+			for( unsigned int c = 0; c < node.childCount; c++ )
+				this->walk( node.firstChild + c, x, y, self, tau,
+						fx, fy, interactions );
+			return;
+		}
+	}
+
+	for( unsigned int j = node.first; j < node.first + node.count; j++ )
+	{
+		if(( this->mOrder[ j ] == self ) || ( fabs( this->mM[ j ] ) < ZERO_MASS ))
+			continue;
+		double dx = (double)this->mX[ j ] - x;
+		double dy = (double)this->mY[ j ] - y;
+		double d2 = dx * dx + dy * dy;
+		double s = this->mM[ j ] / ( sqrt( d2 ) * d2 );
+		fx.add( dx * s );
+		fy.add( dy * s );
+		interactions++;
+	}
+} //}}}
+
+FloatTree::Node* FloatTree::getNodes() const
+{ //{{{
+	return this->mNodes;
+} //}}}
+
+unsigned int FloatTree::getNodeCount() const
+{ //{{{
+	return this->mNodeCount;
+} //}}}
+
+unsigned int FloatTree::getSize() const
+{ //{{{
+	return this->mSize;
+} //}}}
+
+float* FloatTree::getX() const
+{ //{{{
+	return this->mX;
+} //}}}
+
+float* FloatTree::getY() const
+{ //{{{
+	return this->mY;
+} //}}}
+
+float* FloatTree::getM() const
+{ //{{{
+	return this->mM;
+} //}}}
@@ -0,0 +1,205 @@
+/** {{{
+ * Copyright 2010 Jeff Chapman.
+ *
+ * This file is a part of Barnes-Hut
+ *
+ * Barnes-Hut is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Barnes-Hut is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Barnes-Hut.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */// }}}
+#ifndef FLOAT_TREE_HPP
+#define FLOAT_TREE_HPP
+
+#include "real.hpp"
+
+#include <cmath>
+
+/**
+ * A flat tree of float nodes and particles, walked with the arithmetic done
+ * in double. It is what LinearQuadtree walks in mixed precision, and what
+ * OutOfCore keeps as its summary of a file.
+ *
+ * Nodes are stored with the root first and every node's children after it,
+ * and particles in tree order, so each node holds a contiguous run of them.
+ * As in Quadtree, each node keeps its positive and negative masses apart, so
+ * a cell whose net mass is near zero can still be used whole.
+ */
+class FloatTree
+{
+	public:
+		/**
+		 * Center and total of the masses of one sign in a cell.
+		 */
+		struct Part
+		{
+			float x, y, m;
+		};
+
+		/**
+		 * One cell of the tree.
+		 */
+		struct Node
+		{
+			Part pos;
+			Part neg;
+			float left, bottom, size;
+			unsigned int firstChild;
+			unsigned int childCount;
+			unsigned int first;
+			unsigned int count;
+		};
+
+		/**
+		 * Neumaier's variant of Kahan summation: the low order bits lost by
+		 * each addition are gathered separately and added back at the end,
+		 * so the sum of many terms that largely cancel stays accurate to
+		 * about one rounding.
+		 */
+		struct CompensatedSum
+		{
+			CompensatedSum() :
+				sum( 0 ), //{{{
+				compensation( 0 )
+			{
+			} //}}}
+
+			/**
+			 * Adds a term to this.
+			 * @param term : value to add
+			 */
+			void add( double term )
+			{ //{{{
+				double t = this->sum + term;
+				if( fabs( this->sum ) >= fabs( term ))
+					this->compensation += ( this->sum - t ) + term;
+				else
+					this->compensation += ( term - t ) + this->sum;
+				this->sum = t;
+			} //}}}
+
+			/**
+			 * Returns everything added so far.
+			 * @return : compensated sum
+			 */
+			double total() const
+			{ //{{{
+				return this->sum + this->compensation;
+			} //}}}
+
+			double sum;
+			double compensation;
+		};
+
+		/**
+		 * Create an empty tree.
+		 */
+		FloatTree();
+
+		/**
+		 * Proper deconstructor that deletes all associated memory.
+		 */
+		~FloatTree();
+
+		/**
+		 * Makes room for the nodes and particles of a tree, deleting any
+		 * there were. The nodes and particles are then filled in through
+		 * getNodes() and getX(), getY() and getM().
+		 * @param nNodeCount : number of nodes
+		 * @param nSize : number of particles
+		 * @param nOrder : where each particle in tree order came from, used
+		 * to leave a particle out of its own force; kept, not deleted
+		 */
+		void allocate( unsigned int nNodeCount, unsigned int nSize,
+				const unsigned int* nOrder );
+
+		/**
+		 * Deletes the nodes and particles.
+		 */
+		void clear();
+
+		/**
+		 * Works out the positive and negative masses of every node, and their
+		 * centers, from its particles or its children, in double.
+		 */
+		void computeMoments();
+
+		/**
+		 * Accumulates the pull per unit mass on a point from everything in
+		 * a node. A node is used whole when it is tau times its width from
+		 * the centers of both its positive and its negative masses, and the
+		 * point is not inside it.
+		 * @param n : indice of node
+		 * @param x : x coordinate of point
+		 * @param y : y coordinate of point
+		 * @param self : where the point came from, skipped if found
+		 * @param tau : largest ratio of width to distance a node is used at
+		 * @param fx : x accumulator, to be multiplied by the point's mass
+		 * @param fy : y accumulator, to be multiplied by the point's mass
+		 * @param interactions : incremented for each mass used
+		 */
+		void walk( unsigned int n, double x, double y, unsigned int self,
+				double tau, CompensatedSum& fx, CompensatedSum& fy,
+				unsigned int& interactions ) const;
+
+		/**
+		 * Returns the nodes, with the root first.
+		 * @return : array of getNodeCount() nodes
+		 */
+		Node* getNodes() const;
+
+		/**
+		 * Returns the number of nodes.
+		 * @return : node count
+		 */
+		unsigned int getNodeCount() const;
+
+		/**
+		 * Returns the number of particles.
+		 * @return : particle count
+		 */
+		unsigned int getSize() const;
+
+		/**
+		 * Returns the x coordinates of the particles in tree order.
+		 * @return : array of getSize() x's
+		 */
+		float* getX() const;
+
+		/**
+		 * Returns the y coordinates of the particles in tree order.
+		 * @return : array of getSize() y's
+		 */
+		float* getY() const;
+
+		/**
+		 * Returns the masses of the particles in tree order.
+		 * @return : array of getSize() masses
+		 */
+		float* getM() const;
+
+	private:
+		Node* mNodes;
+		unsigned int mNodeCount;
+		/// Particle positions and masses in tree order, in one allocation.
+		unsigned int mSize;
+		float* mData;
+		float* mX;
+		float* mY;
+		float* mM;
+		const unsigned int* mOrder;
+
+		FloatTree( const FloatTree& rhs );
+		FloatTree& operator=( const FloatTree& rhs );
+};
+
+#endif // FLOAT_TREE_HPP
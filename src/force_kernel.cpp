@@ -0,0 +1,246 @@
+/** {{{
+ * Copyright 2010 Jeff Chapman.
+ *
+ * This file is a part of Barnes-Hut
+ *
+ * Barnes-Hut is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Barnes-Hut is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Barnes-Hut.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */// }}}
+#include "force_kernel.hpp"
+
+#include <cmath>
+
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ))
+#define FORCE_KERNEL_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*DoubleKernel)( const double* x, const double* y,
+		const double* m, unsigned int count, double tx, double ty,
+		double& ax, double& ay );
+typedef void (*FloatKernel)( const float* x, const float* y,
+		const float* m, unsigned int count, float tx, float ty,
+		double& ax, double& ay );
+
+/**
+ * Plain scalar kernel, used when there is nothing wider and for the few
+ * sources left over after the last full vector. Sums in T, then adds the sum
+ * to accumulators of type A.
+ */
+template< typename T, typename A >
+static void accumulateScalar( const T* x, const T* y, const T* m,
+		unsigned int count, T tx, T ty, A& ax, A& ay )
+{ //{{{
+	T sx = 0, sy = 0;
+	for( unsigned int i = 0; i < count; i++ )
+	{
+		T dx = x[ i ] - tx;
+		T dy = y[ i ] - ty;
+		T d2 = dx * dx + dy * dy;
+		if( !( d2 > 0 ))
+			continue;
+		T s = m[ i ] / ( sqrt( d2 ) * d2 );
+		sx += dx * s;
+		sy += dy * s;
+	}
+	ax += sx;
+	ay += sy;
+} //}}}
+
+#ifdef FORCE_KERNEL_X86
+//{{{
+__attribute__(( target( "avx2,fma" ) ))
+static void accumulateAVX2( const double* x, const double* y,
+		const double* m, unsigned int count, double tx, double ty,
+		double& ax, double& ay )
+{ //{{{
+	__m256d vtx = _mm256_set1_pd( tx ), vty = _mm256_set1_pd( ty );
+	__m256d sx = _mm256_setzero_pd(), sy = _mm256_setzero_pd();
+	__m256d zero = _mm256_setzero_pd();
+	unsigned int i = 0;
+	for( ; i + 4 <= count; i += 4 )
+	{
+		__m256d dx = _mm256_sub_pd( _mm256_loadu_pd( x + i ), vtx );
+		__m256d dy = _mm256_sub_pd( _mm256_loadu_pd( y + i ), vty );
+		__m256d d2 = _mm256_fmadd_pd( dx, dx, _mm256_mul_pd( dy, dy ));
+		__m256d d3 = _mm256_mul_pd( _mm256_sqrt_pd( d2 ), d2 );
+		__m256d s = _mm256_and_pd( _mm256_cmp_pd( d2, zero, _CMP_GT_OQ ),
+				_mm256_div_pd( _mm256_loadu_pd( m + i ), d3 ));
+		sx = _mm256_fmadd_pd( dx, s, sx );
+		sy = _mm256_fmadd_pd( dy, s, sy );
+	}
+
+	double lanes[ 4 ];
+	_mm256_storeu_pd( lanes, sx );
+	ax += ( lanes[ 0 ] + lanes[ 1 ] ) + ( lanes[ 2 ] + lanes[ 3 ] );
+	_mm256_storeu_pd( lanes, sy );
+	ay += ( lanes[ 0 ] + lanes[ 1 ] ) + ( lanes[ 2 ] + lanes[ 3 ] );
+	accumulateScalar( x + i, y + i, m + i, count - i, tx, ty, ax, ay );
+} //}}}
+
+__attribute__(( target( "avx2,fma" ) ))
+static void accumulateAVX2( const float* x, const float* y,
+		const float* m, unsigned int count, float tx, float ty,
+		double& ax, double& ay )
+{ //{{{
+	__m256 vtx = _mm256_set1_ps( tx ), vty = _mm256_set1_ps( ty );
+	__m256 sx = _mm256_setzero_ps(), sy = _mm256_setzero_ps();
+	__m256 zero = _mm256_setzero_ps();
+	unsigned int i = 0;
+	for( ; i + 8 <= count; i += 8 )
+	{
+		__m256 dx = _mm256_sub_ps( _mm256_loadu_ps( x + i ), vtx );
+		__m256 dy = _mm256_sub_ps( _mm256_loadu_ps( y + i ), vty );
+		__m256 d2 = _mm256_fmadd_ps( dx, dx, _mm256_mul_ps( dy, dy ));
+		__m256 d3 = _mm256_mul_ps( _mm256_sqrt_ps( d2 ), d2 );
+		__m256 s = _mm256_and_ps( _mm256_cmp_ps( d2, zero, _CMP_GT_OQ ),
+				_mm256_div_ps( _mm256_loadu_ps( m + i ), d3 ));
+		sx = _mm256_fmadd_ps( dx, s, sx );
+		sy = _mm256_fmadd_ps( dy, s, sy );
+	}
+
+	float lanes[ 8 ];
+	_mm256_storeu_ps( lanes, sx );
+	for( unsigned int l = 0; l < 8; l++ )
+		ax += lanes[ l ];
+	_mm256_storeu_ps( lanes, sy );
+	for( unsigned int l = 0; l < 8; l++ )
+		ay += lanes[ l ];
+	accumulateScalar( x + i, y + i, m + i, count - i, tx, ty, ax, ay );
+} //}}}
+
+__attribute__(( target( "avx512f" ) ))
+static void accumulateAVX512( const double* x, const double* y,
+		const double* m, unsigned int count, double tx, double ty,
+		double& ax, double& ay )
+{ //{{{
+	__m512d vtx = _mm512_set1_pd( tx ), vty = _mm512_set1_pd( ty );
+	__m512d sx = _mm512_setzero_pd(), sy = _mm512_setzero_pd();
+	__m512d zero = _mm512_setzero_pd();
+	for( unsigned int i = 0; i < count; i += 8 )
+	{
+		// The last few sources are loaded with the unused lanes masked off
+		__mmask8 valid = ( count - i >= 8 ) ?
+			(__mmask8)0xFF : (__mmask8)(( 1U << ( count - i )) - 1 );
+		__m512d dx = _mm512_sub_pd( _mm512_maskz_loadu_pd( valid, x + i ), vtx );
+		__m512d dy = _mm512_sub_pd( _mm512_maskz_loadu_pd( valid, y + i ), vty );
+		__m512d d2 = _mm512_fmadd_pd( dx, dx, _mm512_mul_pd( dy, dy ));
+		__m512d d3 = _mm512_mul_pd( _mm512_maskz_sqrt_pd( valid, d2 ), d2 );
+		__mmask8 use = _mm512_mask_cmp_pd_mask( valid, d2, zero, _CMP_GT_OQ );
+		__m512d s = _mm512_maskz_div_pd( use,
+				_mm512_maskz_loadu_pd( valid, m + i ), d3 );
+		sx = _mm512_fmadd_pd( dx, s, sx );
+		sy = _mm512_fmadd_pd( dy, s, sy );
+	}
+	double lanes[ 8 ];
+	_mm512_storeu_pd( lanes, sx );
+	for( unsigned int l = 0; l < 8; l++ )
+		ax += lanes[ l ];
+	_mm512_storeu_pd( lanes, sy );
+	for( unsigned int l = 0; l < 8; l++ )
+		ay += lanes[ l ];
+} //}}}
+
+__attribute__(( target( "avx512f" ) ))
+static void accumulateAVX512( const float* x, const float* y,
+		const float* m, unsigned int count, float tx, float ty,
+		double& ax, double& ay )
+{ //{{{
+	__m512 vtx = _mm512_set1_ps( tx ), vty = _mm512_set1_ps( ty );
+	__m512 sx = _mm512_setzero_ps(), sy = _mm512_setzero_ps();
+	__m512 zero = _mm512_setzero_ps();
+	for( unsigned int i = 0; i < count; i += 16 )
+	{
+		__mmask16 valid = ( count - i >= 16 ) ?
+			(__mmask16)0xFFFF : (__mmask16)(( 1U << ( count - i )) - 1 );
+		__m512 dx = _mm512_sub_ps( _mm512_maskz_loadu_ps( valid, x + i ), vtx );
+		__m512 dy = _mm512_sub_ps( _mm512_maskz_loadu_ps( valid, y + i ), vty );
+		__m512 d2 = _mm512_fmadd_ps( dx, dx, _mm512_mul_ps( dy, dy ));
+		__m512 d3 = _mm512_mul_ps( _mm512_maskz_sqrt_ps( valid, d2 ), d2 );
+		__mmask16 use = _mm512_mask_cmp_ps_mask( valid, d2, zero, _CMP_GT_OQ );
+		__m512 s = _mm512_maskz_div_ps( use,
+				_mm512_maskz_loadu_ps( valid, m + i ), d3 );
+		sx = _mm512_fmadd_ps( dx, s, sx );
+		sy = _mm512_fmadd_ps( dy, s, sy );
+	}
+	float lanes[ 16 ];
+	_mm512_storeu_ps( lanes, sx );
+	for( unsigned int l = 0; l < 16; l++ )
+		ax += lanes[ l ];
+	_mm512_storeu_ps( lanes, sy );
+	for( unsigned int l = 0; l < 16; l++ )
+		ay += lanes[ l ];
+} //}}}
+//}}}
+#endif
+
+/**
+ * Picks the widest double kernel the CPU running this supports.
+ * @return : chosen kernel
+ */
+static DoubleKernel pickDoubleKernel()
+{ //{{{
+#ifdef FORCE_KERNEL_X86
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports( "avx512f" ))
+		return &accumulateAVX512;
+	if( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ))
+		return &accumulateAVX2;
+#endif
+	return &accumulateScalar< double, double >;
+} //}}}
+
+/**
+ * Picks the widest float kernel the CPU running this supports.
+ * @return : chosen kernel
+ */
+static FloatKernel pickFloatKernel()
+{ //{{{
+#ifdef FORCE_KERNEL_X86
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports( "avx512f" ))
+		return &accumulateAVX512;
+	if( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ))
+		return &accumulateAVX2;
+#endif
+	return &accumulateScalar< float, double >;
+} //}}}
+
+/// Chosen before main() runs, so before any thread can use them.
+static const DoubleKernel doubleKernel = pickDoubleKernel();
+static const FloatKernel floatKernel = pickFloatKernel();
+
+void accumulateForce( const double* x, const double* y, const double* m,
+		unsigned int count, double tx, double ty, double& ax, double& ay )
+{ //{{{
+	doubleKernel( x, y, m, count, tx, ty, ax, ay );
+} //}}}
+
+void accumulateForce( const float* x, const float* y, const float* m,
+		unsigned int count, float tx, float ty, double& ax, double& ay )
+{ //{{{
+	floatKernel( x, y, m, count, tx, ty, ax, ay );
+} //}}}
+
+const char* getForceKernelName()
+{ //{{{
+#ifdef FORCE_KERNEL_X86
+	if( doubleKernel == static_cast< DoubleKernel >( &accumulateAVX512 ))
+		return "avx512";
+	if( doubleKernel == static_cast< DoubleKernel >( &accumulateAVX2 ))
+		return "avx2";
+#endif
+	return "scalar";
+} //}}}
+
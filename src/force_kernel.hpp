@@ -0,0 +1,66 @@
+/** {{{
+ * Copyright 2010 Jeff Chapman.
+ *
+ * This file is a part of Barnes-Hut
+ *
+ * Barnes-Hut is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Barnes-Hut is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Barnes-Hut.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */// }}}
+#ifndef FORCE_KERNEL_HPP
+#define FORCE_KERNEL_HPP
+
+/**
+ * Adds up the pull of a batch of point masses on a target, as
+ * sum of m * (source - target) / d^3, leaving out sources that sit exactly on
+ * the target (including the target itself). Multiply the result by the
+ * target's mass to get the force on it.
+ *
+ * Sources are given as separate x, y and m arrays so they can be loaded into
+ * SIMD lanes. The widest kernel the CPU supports (AVX-512, AVX2 or plain
+ * scalar code) is picked once at start up.
+ * @param x : x coordinates of sources
+ * @param y : y coordinates of sources
+ * @param m : masses of sources
+ * @param count : number of sources
+ * @param tx : x coordinate of target
+ * @param ty : y coordinate of target
+ * @param ax : x accumulator
+ * @param ay : y accumulator
+ */
+void accumulateForce( const double* x, const double* y, const double* m,
+		unsigned int count, double tx, double ty, double& ax, double& ay );
+
+/**
+ * Adds up the pull of a batch of point masses on a target in single
+ * precision, the same way as the double version, with twice as many lanes.
+ * Each lane sums in float, and the lanes are added into double accumulators.
+ * @param x : x coordinates of sources
+ * @param y : y coordinates of sources
+ * @param m : masses of sources
+ * @param count : number of sources
+ * @param tx : x coordinate of target
+ * @param ty : y coordinate of target
+ * @param ax : x accumulator
+ * @param ay : y accumulator
+ */
+void accumulateForce( const float* x, const float* y, const float* m,
+		unsigned int count, float tx, float ty, double& ax, double& ay );
+
+/**
+ * Returns the name of the instruction set accumulateForce() is using.
+ * @return : "avx512", "avx2" or "scalar"
+ */
+const char* getForceKernelName();
+
+#endif // FORCE_KERNEL_HPP
@@ -0,0 +1,280 @@
+/** {{{
+ * Copyright 2010 Jeff Chapman.
+ *
+ * This file is a part of Barnes-Hut
+ *
+ * Barnes-Hut is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Barnes-Hut is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Barnes-Hut.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */// }}}
+#include "integrator.hpp"
+
+#include <iostream>
+using std::cerr;
+using std::cout;
+
+Integrator::Integrator( ParticleSystem* iPS, Real iTau,
+		bool iUseLinear ) :
+	QThread(), //{{{
+	ps( iPS ),
+	tau( iTau ),
+	dt( 0.01 ),
+	steps( 1 ),
+	taken( 0 ),
+	useLinear( iUseLinear ),
+	maxMigration( 0.1 ),
+	groupSize( 0 ),
+	mixed( false ),
+	leafCapacity( 1 ),
+	order( 1 ),
+	fmmOrder( 0 ),
+	refits( 0 ),
+	rebuilds( 0 ),
+	builtBytes( 0 ),
+	arena(),
+	qt( NULL ),
+	lqt( NULL ),
+	mBH( iPS )
+{
+} //}}}
+
+Integrator::~Integrator()
+{ //{{{
+	this->clearTree();
+} //}}}
+
+void Integrator::run()
+{ //{{{
+	if(( this->ps == NULL ) || ( this->ps->getSize() < 1 ))
+	{
+		cerr << "Tried to integrate an empty or null ps\n";
+		return;
+	}
+
+	this->taken = 0;
+	this->refits = this->rebuilds = 0;
+	this->clearTree();
+	this->mBH.setParticleSystem( this->ps );
+	this->calculateForces();
+
+	for( ; this->taken < this->steps; this->taken++ )
+	{
+		cout << "Step " << this->taken + 1 << " of " << this->steps << "\n";
+
+		this->ps->kick( this->dt / 2.0 );
+		this->ps->drift( this->dt );
+		this->calculateForces();
+		this->ps->kick( this->dt / 2.0 );
+	}
+
+	cout << "Built the tree " << this->rebuilds << " times and refit it "
+		<< this->refits << " times\n";
+} //}}}
+
+void Integrator::calculateForces()
+{ //{{{
+	this->ps->zeroForces();
+	this->rebuildTree();
+
+	if(( this->fmmOrder > 0 ) && ( this->lqt != NULL ))
+	{
+		FastMultipole fmm( this->lqt, this->fmmOrder );
+		fmm.setTau( this->tau );
+		fmm.run();
+		return;
+	}
+
+	this->mBH.setFirst( 0 );
+	this->mBH.setLast( this->ps->getSize() );
+	this->mBH.run();
+} //}}}
+
+void Integrator::rebuildTree()
+{ //{{{
+	if( this->useLinear )
+	{
+		if( this->lqt == NULL )
+			this->lqt = new LinearQuadtree();
+		this->lqt->setTau( this->tau );
+		this->lqt->setGroupSize( this->groupSize );
+		this->lqt->setMixedPrecision( this->mixed );
+		this->lqt->setLeafCapacity( this->leafCapacity );
+		this->lqt->build( this->ps );
+		this->mBH.setLinearQuadTree( this->lqt );
+		this->rebuilds++;
+		return;
+	}
+
+	if(( this->qt != NULL ) &&
+		( this->arena.getBytesUsed() < 2 * this->builtBytes ) &&
+		( this->qt->refit( this->maxMigration ) ))
+	{
+		this->refits++;
+		return;
+	}
+
+	this->clearTree();
+	this->qt = new Quadtree( this->ps, &this->arena, this->leafCapacity );
+	this->qt->setTau( this->tau );
+	if( this->order > 1 )
+		this->qt->setOrder( this->order );
+	this->mBH.setQuadTree( this->qt );
+	this->builtBytes = this->arena.getBytesUsed();
+	this->rebuilds++;
+} //}}}
+
+void Integrator::clearTree()
+{ //{{{
+	// The nodes live in the arena, so the tree has to go before the arena is
+	// reset underneath it
+	delete this->qt;
+	this->qt = NULL;
+	this->arena.reset();
+
+	delete this->lqt;
+	this->lqt = NULL;
+
+	this->mBH.setQuadTree( NULL );
+	this->mBH.setLinearQuadTree( NULL );
+} //}}}
+
+ParticleSystem* Integrator::getParticleSystem()
+{ //{{{
+	return this->ps;
+} //}}}
+
+Real Integrator::getTau() const
+{ //{{{
+	return this->tau;
+} //}}}
+
+Real Integrator::getTimeStep() const
+{ //{{{
+	return this->dt;
+} //}}}
+
+unsigned int Integrator::getSteps() const
+{ //{{{
+	return this->steps;
+} //}}}
+
+unsigned int Integrator::getStepsTaken() const
+{ //{{{
+	return this->taken;
+} //}}}
+
+Real Integrator::getMaxMigration() const
+{ //{{{
+	return this->maxMigration;
+} //}}}
+
+unsigned int Integrator::getGroupSize() const
+{ //{{{
+	return this->groupSize;
+} //}}}
+
+bool Integrator::getMixedPrecision() const
+{ //{{{
+	return this->mixed;
+} //}}}
+
+unsigned int Integrator::getLeafCapacity() const
+{ //{{{
+	return this->leafCapacity;
+} //}}}
+
+unsigned int Integrator::getOrder() const
+{ //{{{
+	return this->order;
+} //}}}
+
+unsigned int Integrator::getFmmOrder() const
+{ //{{{
+	return this->fmmOrder;
+} //}}}
+
+bool Integrator::getDualTree() const
+{ //{{{
+	return this->mBH.getDualTree();
+} //}}}
+
+unsigned int Integrator::getRefits() const
+{ //{{{
+	return this->refits;
+} //}}}
+
+unsigned int Integrator::getRebuilds() const
+{ //{{{
+	return this->rebuilds;
+} //}}}
+
+void Integrator::setParticleSystem( ParticleSystem* nPS )
+{ //{{{
+	this->clearTree();
+	this->ps = nPS;
+} //}}}
+
+void Integrator::setTau( Real nTau )
+{ //{{{
+	this->tau = nTau;
+} //}}}
+
+void Integrator::setTimeStep( Real nDT )
+{ //{{{
+	this->dt = nDT;
+} //}}}
+
+void Integrator::setSteps( unsigned int nSteps )
+{ //{{{
+	this->steps = nSteps;
+} //}}}
+
+void Integrator::setMaxMigration( Real nMaxMigration )
+{ //{{{
+	this->maxMigration = nMaxMigration;
+} //}}}
+
+void Integrator::setGroupSize( unsigned int nGroupSize )
+{ //{{{
+	this->groupSize = nGroupSize;
+} //}}}
+
+void Integrator::setMixedPrecision( bool nMixed )
+{ //{{{
+	this->mixed = nMixed;
+} //}}}
+
+void Integrator::setLeafCapacity( unsigned int nLeafCapacity )
+{ //{{{
+	this->leafCapacity = nLeafCapacity;
+} //}}}
+
+void Integrator::setOrder( unsigned int nOrder )
+{ //{{{
+	this->order = nOrder;
+} //}}}
+
+void Integrator::setFmmOrder( unsigned int nFmmOrder )
+{ //{{{
+	this->fmmOrder = nFmmOrder;
+} //}}}
+
+void Integrator::setDualTree( bool nDualTree )
+{ //{{{
+	this->mBH.setDualTree( nDualTree );
+} //}}}
+
+void Integrator::setHugePages( bool nHugePages )
+{ //{{{
+	this->arena.setHugePages( nHugePages );
+} //}}}
@@ -0,0 +1,273 @@
+/** {{{
+ * Copyright 2010 Jeff Chapman.
+ *
+ * This file is a part of Barnes-Hut
+ *
+ * Barnes-Hut is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Barnes-Hut is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Barnes-Hut.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */// }}}
+#ifndef INTEGRATOR_HPP
+#define INTEGRATOR_HPP
+
+#include <QtCore/QThread>
+
+#include "particle_system.hpp"
+#include "quadtree.hpp"
+#include "linear_quadtree.hpp"
+#include "node_arena.hpp"
+#include "barnes_hut.hpp"
+#include "fast_multipole.hpp"
+
+/**
+ * Integrator represents a thread responsible for stepping a particle system
+ * through time with kick-drift-kick leapfrog. Each step gives every particle
+ * half a kick from its current force, drifts it a whole step along its new
+ * velocity, brings the tree up to date, runs the Barnes-Hut algorithm and
+ * gives the second half kick. A pointer based tree is refit in place while
+ * few particles change cells, and only built again when too many do. The particles stay in memory the whole time, and after
+ * run() the system holds the final positions and the forces on them.
+ */
+class Integrator : public QThread
+{
+	public:
+		/**
+		 * Construct an Integrator to step a particle system.
+		 * @param iPS : particle system to step
+		 * @param iTau : tau to use when running the Barnes-Hut algorithm
+		 * @param iUseLinear : true to use a linear quad tree instead of a
+		 * pointer based quad tree
+		 */
+		Integrator( ParticleSystem* iPS = NULL, Real iTau = 0.5,
+				bool iUseLinear = false );
+
+		/**
+		 * Proper deconstructor that deallocates memory.
+		 */
+		~Integrator();
+
+		/**
+		 * Step the particle system through time.
+		 */
+		void run();
+
+		/**
+		 * Returns the particle system associated with this.
+		 * @return : particle system being stepped
+		 */
+		ParticleSystem* getParticleSystem();
+
+		/**
+		 * Returns the tau used for the Barnes-Hut algorithm.
+		 * @return : tau
+		 */
+		Real getTau() const;
+
+		/**
+		 * Returns the length of a single step.
+		 * @return : time step
+		 */
+		Real getTimeStep() const;
+
+		/**
+		 * Returns the number of steps run() takes.
+		 * @return : number of steps
+		 */
+		unsigned int getSteps() const;
+
+		/**
+		 * Returns the number of steps taken so far.
+		 * @return : steps taken
+		 */
+		unsigned int getStepsTaken() const;
+
+		/**
+		 * Returns the fraction of particles that may change cells before the
+		 * tree is built again instead of being refit.
+		 * @return : largest fraction of migrating particles for a refit
+		 */
+		Real getMaxMigration() const;
+
+		/**
+		 * Returns the most particles the linear quad tree walks together.
+		 * @return : group size, 0 if particles are walked one at a time
+		 */
+		unsigned int getGroupSize() const;
+
+		/**
+		 * Returns true if the linear quad tree is walked in mixed precision.
+		 * @return : true if in mixed precision
+		 */
+		bool getMixedPrecision() const;
+
+		/**
+		 * Returns the most particles a leaf of the tree holds.
+		 * @return : leaf capacity
+		 */
+		unsigned int getLeafCapacity() const;
+
+		/**
+		 * Returns the order of the moments the pointer based tree uses.
+		 * @return : order of moments
+		 */
+		unsigned int getOrder() const;
+
+		/**
+		 * Returns the order of the fast multipole method's expansions.
+		 * @return : order, 0 if Barnes-Hut is used instead
+		 */
+		unsigned int getFmmOrder() const;
+
+		/**
+		 * Returns true if the pointer based tree is walked by a dual tree
+		 * walk.
+		 * @return : true for a dual tree walk
+		 */
+		bool getDualTree() const;
+
+		/**
+		 * Returns how many steps the tree was refit in the last run().
+		 * @return : number of refits
+		 */
+		unsigned int getRefits() const;
+
+		/**
+		 * Returns how many times the tree was built in the last run().
+		 * @return : number of builds
+		 */
+		unsigned int getRebuilds() const;
+
+		/**
+		 * Associate a new particle system with this.
+		 * @param nPS : new particle system
+		 */
+		void setParticleSystem( ParticleSystem* nPS );
+
+		/**
+		 * Sets the tau used for the Barnes-Hut algorithm.
+		 * @param nTau : new tau
+		 */
+		void setTau( Real nTau = 0.5 );
+
+		/**
+		 * Sets the length of a single step.
+		 * @param nDT : new time step
+		 */
+		void setTimeStep( Real nDT = 0.01 );
+
+		/**
+		 * Sets the number of steps run() takes.
+		 * @param nSteps : new number of steps
+		 */
+		void setSteps( unsigned int nSteps = 1 );
+
+		/**
+		 * Sets the fraction of particles that may change cells before the
+		 * tree is built again instead of being refit.
+		 * @param nMaxMigration : new fraction, 0 to build the tree every step
+		 */
+		void setMaxMigration( Real nMaxMigration = 0.1 );
+
+		/**
+		 * Sets the most particles the linear quad tree walks together.
+		 * @param nGroupSize : new group size, 0 to walk particles one at a time
+		 */
+		void setGroupSize( unsigned int nGroupSize = 0 );
+
+		/**
+		 * Sets whether the linear quad tree is walked in mixed precision.
+		 * @param nMixed : true for mixed precision
+		 */
+		void setMixedPrecision( bool nMixed = false );
+
+		/**
+		 * Sets the most particles a leaf of the tree holds, used from the
+		 * next time the tree is built.
+		 * @param nLeafCapacity : new leaf capacity
+		 */
+		void setLeafCapacity( unsigned int nLeafCapacity = 1 );
+
+		/**
+		 * Sets the order of the moments the pointer based tree uses.
+		 * @param nOrder : 1 for the monopole alone, 2 to add the quadrupole
+		 */
+		void setOrder( unsigned int nOrder = 1 );
+
+		/**
+		 * Finds forces with the fast multipole method on the linear quad
+		 * tree instead of with Barnes-Hut.
+		 * @param nFmmOrder : order of the expansions, 0 for Barnes-Hut
+		 */
+		void setFmmOrder( unsigned int nFmmOrder = 0 );
+
+		/**
+		 * Sets whether the pointer based tree is walked by a dual tree walk,
+		 * with pairs of cells far enough apart interacting as a whole.
+		 * @param nDualTree : true for a dual tree walk
+		 */
+		void setDualTree( bool nDualTree = false );
+
+		/**
+		 * Sets whether the nodes of the pointer based tree are kept in huge
+		 * pages.
+		 * @param nHugePages : true to try to use huge pages
+		 */
+		void setHugePages( bool nHugePages = false );
+
+	private:
+		/**
+		 * Puts the particles into a fresh tree and replaces every force with
+		 * the one the Barnes-Hut algorithm gives.
+		 */
+		void calculateForces();
+
+		/**
+		 * Brings the tree up to date with the current positions of the
+		 * particles, refitting it if it can and building it otherwise.
+		 */
+		void rebuildTree();
+
+		/**
+		 * Frees the tree.
+		 */
+		void clearTree();
+
+		ParticleSystem* ps;
+		Real tau;
+		Real dt;
+		unsigned int steps;
+		unsigned int taken;
+		bool useLinear;
+		Real maxMigration;
+		unsigned int groupSize;
+		bool mixed;
+		unsigned int leafCapacity;
+		unsigned int order;
+		unsigned int fmmOrder;
+		unsigned int refits;
+		unsigned int rebuilds;
+		/// Arena bytes the last full build used; refits that have grown the
+		/// arena well past this build the tree again to reclaim the space.
+		size_t builtBytes;
+
+		/// Holds the nodes of the pointer based tree, reset every step.
+		NodeArena arena;
+		Quadtree* qt;
+		LinearQuadtree* lqt;
+		BarnesHut mBH;
+
+		Integrator( const Integrator& rhs );
+		Integrator& operator=( const Integrator& rhs );
+};
+
+#endif // INTEGRATOR_HPP
@@ -0,0 +1,1079 @@
+/** {{{
+ * Copyright 2010 Jeff Chapman.
+ *
+ * This file is a part of Barnes-Hut
+ *
+ * Barnes-Hut is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Barnes-Hut is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Barnes-Hut.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */// }}}
+
+#include "linear_quadtree.hpp"
+
+#include "thread_pool.hpp"
+#include "force_kernel.hpp"
+#include "morton.hpp"
+
+#include <iostream>
+using std::cout;
+
+#include <algorithm>
+using std::copy;
+
+#include <limits>
+using std::numeric_limits;
+
+#include <cmath>
+
+static const Real ZERO_MASS = 2.0 * numeric_limits<Real>::epsilon();
+/// Pieces the work is cut into per thread, so idle threads can steal.
+static const unsigned int PIECES_PER_THREAD = 4;
+/// Subtrees to hand each piece once the top of the tree is built.
+static const unsigned int SUBTREES_PER_PIECE = 2;
+
+typedef LinearQuadtree::Node Node;
+typedef LinearQuadtree::Part Part;
+
+/**
+ * Growable array of nodes used while building.
+ */
+struct NodeList
+{
+	Node* nodes;
+	unsigned int count;
+	unsigned int capacity;
+};
+
+/**
+ * Makes room for at least a certain number of nodes in a list.
+ * @param list : list to grow
+ * @param nCapacity : number of nodes needed
+ */
+static void reserveNodes( NodeList& list, unsigned int nCapacity )
+{ //{{{
+	if( nCapacity <= list.capacity )
+		return;
+
+	if( nCapacity < 2 * list.capacity )
+		nCapacity = 2 * list.capacity;
+
+	Node* nNodes = new Node[ nCapacity ];
+	copy( list.nodes, list.nodes + list.count, nNodes );
+	delete[] list.nodes;
+	list.nodes = nNodes;
+	list.capacity = nCapacity;
+} //}}}
+
+/**
+ * Growable list of the cells and particles a group interacts with, all kept
+ * as point masses in separate arrays of T for the SIMD force kernel.
+ */
+template< typename T >
+struct LinearQuadtree::InteractionList
+{
+	InteractionList() :
+		data( NULL ), //{{{
+		x( NULL ),
+		y( NULL ),
+		m( NULL ),
+		count( 0 ),
+		capacity( 0 )
+	{
+	} //}}}
+
+	~InteractionList()
+	{ //{{{
+		delete[] this->data;
+	} //}}}
+
+	/**
+	 * Makes room for at least a certain number of point masses.
+	 * @param nCapacity : number of point masses needed
+	 */
+	void reserve( unsigned int nCapacity )
+	{ //{{{
+		if( nCapacity <= this->capacity )
+			return;
+
+		if( nCapacity < 2 * this->capacity )
+			nCapacity = 2 * this->capacity;
+
+		T* nData = new T[ 3 * nCapacity ];
+		copy( this->x, this->x + this->count, nData );
+		copy( this->y, this->y + this->count, nData + nCapacity );
+		copy( this->m, this->m + this->count, nData + 2 * nCapacity );
+		delete[] this->data;
+		this->data = nData;
+		this->x = nData;
+		this->y = nData + nCapacity;
+		this->m = nData + 2 * nCapacity;
+		this->capacity = nCapacity;
+	} //}}}
+
+	/**
+	 * Adds a point mass to the end of this.
+	 * @param nX : x coordinate
+	 * @param nY : y coordinate
+	 * @param nM : mass
+	 */
+	void add( T nX, T nY, T nM )
+	{ //{{{
+		this->x[ this->count ] = nX;
+		this->y[ this->count ] = nY;
+		this->m[ this->count ] = nM;
+		this->count++;
+	} //}}}
+
+	/// One block holding the x, y and m arrays back to back.
+	T* data;
+	T* x;
+	T* y;
+	T* m;
+	unsigned int count;
+	unsigned int capacity;
+
+	private:
+		InteractionList( const InteractionList& rhs );
+		InteractionList& operator=( const InteractionList& rhs );
+};
+
+/**
+ * Everything the threads building a LinearQuadtree share.
+ */
+struct BuildState
+{
+	ParticleSystem* ps;
+	unsigned int size;
+	/// Most threads to use, and how many pieces the work is cut into.
+	unsigned int threads;
+	unsigned int pieces;
+	Real left, bottom, rootSize;
+	/// Most particles a leaf may hold before it is split.
+	unsigned int leafCapacity;
+
+	/// Morton keys and their particle indices.
+	unsigned long long* keys;
+	unsigned int* order;
+
+	/// Particle data in tree order.
+	Real* x;
+	Real* y;
+	Real* m;
+
+	/// Top of the tree and the nodes in it that still need their subtrees.
+	Node* nodes;
+	unsigned int frontierBegin;
+	unsigned int* frontierSplit;
+	NodeList* subtrees;
+};
+
+/**
+ * One parallel step of a build, run once for each piece of the work.
+ */
+typedef void (*BuildStep)( BuildState* state, unsigned int piece );
+
+/**
+ * Runs a build step for a range of pieces on behalf of the thread pool.
+ */
+class BuildTask : public ThreadPool::Task
+{
+	public:
+		BuildTask( BuildStep iStep, BuildState* iState ) :
+			ThreadPool::Task(), //{{{
+			step( iStep ),
+			state( iState )
+		{
+		} //}}}
+
+		void process( unsigned int first, unsigned int last )
+		{ //{{{
+			for( unsigned int piece = first; piece < last; piece++ )
+				this->step( this->state, piece );
+		} //}}}
+
+	private:
+		BuildStep step;
+		BuildState* state;
+
+		BuildTask( const BuildTask& rhs );
+		BuildTask& operator=( const BuildTask& rhs );
+};
+
+/**
+ * Runs a build step for every piece and waits for them all to finish.
+ * @param step : step to run
+ * @param state : shared build state
+ */
+static void runInParallel( BuildStep step, BuildState* state )
+{ //{{{
+	BuildTask task( step, state );
+	ThreadPool::instance()->run( &task, 0, state->pieces, state->threads, 1 );
+} //}}}
+
+/**
+ * Returns the first particle of a piece of the work.
+ * @param state : shared build state
+ * @param piece : which piece
+ * @return : first particle indice for that piece
+ */
+static unsigned int chunkBegin( BuildState* state, unsigned int piece )
+{ //{{{
+	return (unsigned int)(( (unsigned long long)state->size * piece ) /
+			state->pieces );
+} //}}}
+
+static void computeKeys( BuildState* state, unsigned int piece )
+{ //{{{
+	for( unsigned int i = chunkBegin( state, piece );
+			i < chunkBegin( state, piece + 1 ); i++ )
+	{
+		state->order[ i ] = i;
+		state->keys[ i ] = mortonKey( state->ps->getX( i ),
+				state->ps->getY( i ), state->left, state->bottom,
+				state->rootSize );
+	}
+} //}}}
+
+static void gatherParticles( BuildState* state, unsigned int piece )
+{ //{{{
+	for( unsigned int i = chunkBegin( state, piece );
+			i < chunkBegin( state, piece + 1 ); i++ )
+	{
+		state->x[ i ] = state->ps->getX( state->order[ i ] );
+		state->y[ i ] = state->ps->getY( state->order[ i ] );
+		state->m[ i ] = state->ps->getMass( state->order[ i ] );
+	}
+} //}}}
+
+/**
+ * Splits a node into children if it holds too many particles, appending the
+ * children to a list.
+ * @param node : node to split, must not move if out grows by 4
+ * @param out : list children are appended to
+ * @param keys : sorted Morton keys of all particles
+ * @param rootSize : width of the root node
+ * @param leafCapacity : most particles a leaf may hold
+ */
+static void splitNode( Node& node, NodeList& out,
+		const unsigned long long* keys, Real rootSize,
+		unsigned int leafCapacity )
+{ //{{{
+	node.firstChild = out.count;
+	node.childCount = 0;
+	unsigned int bounds[ 5 ];
+	if(( node.count <= leafCapacity ) || !findMortonQuadrants( keys,
+				node.first, node.count, rootSize, node.size, bounds ))
+		return;
+
+	Real half = node.size / 2.0;
+	for( unsigned int q = 0; q < 4; q++ )
+	{
+		if( bounds[ q ] == bounds[ q + 1 ] )
+			continue;
+
+		Node& child = out.nodes[ out.count++ ];
+		child.pos.x = child.pos.y = child.pos.m = 0;
+		child.neg = child.pos;
+		child.left = node.left + ((q & 1) ? half : 0);
+		child.bottom = node.bottom + ((q & 2) ? half : 0);
+		child.size = half;
+		child.firstChild = child.childCount = 0;
+		child.first = bounds[ q ];
+		child.count = bounds[ q + 1 ] - bounds[ q ];
+		node.childCount++;
+	}
+} //}}}
+
+/**
+ * Sets a mass and its center from their sums. A center with no mass is
+ * never used, so it is only put somewhere sensible, the middle of the node.
+ * @param x : set to x of center
+ * @param y : set to y of center
+ * @param m : set to mass
+ * @param node : node the mass is in
+ * @param tm : total mass
+ * @param mx : mass weighted sum of x
+ * @param my : mass weighted sum of y
+ */
+static void setMoment( Real& x, Real& y, Real& m, const Node& node,
+		Accumulator tm, Accumulator mx, Accumulator my )
+{ //{{{
+	m = tm;
+	if( fabs( tm ) < ZERO_MASS )
+	{
+		x = node.left + node.size / 2.0;
+		y = node.bottom + node.size / 2.0;
+		return;
+	}
+	x = mx / tm;
+	y = my / tm;
+} //}}}
+
+/**
+ * Calculates the positive and negative masses of one node and their centers
+ * from its children or, for leaves, its particles.
+ * @param node : node to calculate
+ * @param children : array the node's firstChild indexes into
+ * @param x : particle x coordinates in tree order
+ * @param y : particle y coordinates in tree order
+ * @param m : particle masses in tree order
+ */
+static void computeMoment( Node& node, const Node* children,
+		const Real* x, const Real* y, const Real* m )
+{ //{{{
+	Accumulator pm = 0, px = 0, py = 0;
+	Accumulator nm = 0, nx = 0, ny = 0;
+	if( node.childCount == 0 )
+	{
+		for( unsigned int j = node.first; j < node.first + node.count; j++ )
+		{
+			if( m[ j ] < 0 )
+			{
+				nm += m[ j ];
+				nx += x[ j ] * m[ j ];
+				ny += y[ j ] * m[ j ];
+			}
+			else
+			{
+				pm += m[ j ];
+				px += x[ j ] * m[ j ];
+				py += y[ j ] * m[ j ];
+			}
+		}
+	}
+	else
+	{
+		for( unsigned int c = 0; c < node.childCount; c++ )
+		{
+			const Node& child = children[ node.firstChild + c ];
+			pm += child.pos.m;
+			px += child.pos.x * child.pos.m;
+			py += child.pos.y * child.pos.m;
+			nm += child.neg.m;
+			nx += child.neg.x * child.neg.m;
+			ny += child.neg.y * child.neg.m;
+		}
+	}
+
+	setMoment( node.pos.x, node.pos.y, node.pos.m, node, pm, px, py );
+	setMoment( node.neg.x, node.neg.y, node.neg.m, node, nm, nx, ny );
+} //}}}
+
+/**
+ * Accumulates the force on a point from the masses of one sign in a cell.
+ * @param part : masses to add the force of
+ * @param x : x coordinate of point
+ * @param y : y coordinate of point
+ * @param m : mass of point
+ * @param fx : x force accumulator
+ * @param fy : y force accumulator
+ * @param interactions : incremented
+ */
+static void addForce( const Part& part, Real x, Real y, Real m,
+		Accumulator& fx, Accumulator& fy, unsigned int& interactions )
+{ //{{{
+	Real dx = part.x - x;
+	Real dy = part.y - y;
+	Real d2 = dx * dx + dy * dy;
+	Real d3 = sqrt( d2 ) * d2;
+	Real gm = m * part.m;
+	fx += dx * gm / d3;
+	fy += dy * gm / d3;
+	interactions++;
+} //}}}
+
+static void buildSubtrees( BuildState* state, unsigned int piece )
+{ //{{{
+	NodeList& local = state->subtrees[ piece ];
+	for( unsigned int r = state->frontierSplit[ piece ];
+			r < state->frontierSplit[ piece + 1 ]; r++ )
+	{
+		Node& root = state->nodes[ r ];
+		unsigned int begin = local.count;
+		reserveNodes( local, local.count + 4 );
+		splitNode( root, local, state->keys, state->rootSize,
+				state->leafCapacity );
+
+		// Children are appended as they are made, so this visits every node
+		for( unsigned int n = begin; n < local.count; n++ )
+		{
+			reserveNodes( local, local.count + 4 );
+			splitNode( local.nodes[ n ], local, state->keys, state->rootSize,
+				state->leafCapacity );
+		}
+
+		// Children always come after their parent, so walking backwards
+		// visits every child before its parent
+		for( unsigned int n = local.count; n-- > begin; )
+			computeMoment( local.nodes[ n ], local.nodes,
+					state->x, state->y, state->m );
+		computeMoment( root, local.nodes, state->x, state->y, state->m );
+	}
+} //}}}
+
+LinearQuadtree::LinearQuadtree() :
+	mNodes( NULL ), //{{{
+	mNodeCount( 0 ),
+	mSize( 0 ),
+	mOrder( NULL ),
+	mData( NULL ),
+	mX( NULL ),
+	mY( NULL ),
+	mM( NULL ),
+	mPS( NULL ),
+	tau( 0.5 ),
+	numThreads( ThreadPool::instance()->getSize() ),
+	leafCapacity( 1 ),
+	groupSize( 0 ),
+	mGroups( NULL ),
+	mGroupCount( 0 ),
+	mixed( false ),
+	mFloat()
+{
+} //}}}
+
+LinearQuadtree::LinearQuadtree( ParticleSystem* ps ) :
+	mNodes( NULL ), //{{{
+	mNodeCount( 0 ),
+	mSize( 0 ),
+	mOrder( NULL ),
+	mData( NULL ),
+	mX( NULL ),
+	mY( NULL ),
+	mM( NULL ),
+	mPS( NULL ),
+	tau( 0.5 ),
+	numThreads( ThreadPool::instance()->getSize() ),
+	leafCapacity( 1 ),
+	groupSize( 0 ),
+	mGroups( NULL ),
+	mGroupCount( 0 ),
+	mixed( false ),
+	mFloat()
+{
+	this->build( ps );
+} //}}}
+
+LinearQuadtree::~LinearQuadtree()
+{ //{{{
+	this->clear();
+} //}}}
+
+void LinearQuadtree::build( ParticleSystem* ps )
+{ //{{{
+	this->clear();
+	this->mPS = ps;
+	if(( ps == NULL ) || ( ps->getSize() < 1 ))
+		return;
+
+	BuildState state;
+	state.ps = ps;
+	state.size = this->mSize = ps->getSize();
+	state.threads = (this->numThreads > 0) ? this->numThreads : 1;
+	state.pieces = PIECES_PER_THREAD * state.threads;
+	state.leafCapacity = this->leafCapacity;
+
+	findMortonRoot( ps->getLeft(), ps->getRight(), ps->getBottom(),
+			ps->getTop(), ps->getLargestBound(), state.left, state.bottom,
+			state.rootSize );
+
+	// Sort particles along a Z-order curve {{{
+	state.keys = new unsigned long long[ state.size ];
+	state.order = new unsigned int[ state.size ];
+	unsigned long long* tmpKeys = new unsigned long long[ state.size ];
+	unsigned int* tmpOrder = new unsigned int[ state.size ];
+	runInParallel( computeKeys, &state );
+	sortMortonKeys( state.keys, state.order, tmpKeys, tmpOrder, state.size,
+			state.threads );
+	delete[] tmpKeys;
+	delete[] tmpOrder;
+	this->mOrder = state.order; //}}}
+
+	this->mData = new Real[ 3 * this->mSize ];
+	this->mX = state.x = this->mData;
+	this->mY = state.y = this->mX + this->mSize;
+	this->mM = state.m = this->mY + this->mSize;
+	runInParallel( gatherParticles, &state );
+
+	// Build the upper levels of the tree breadth first until there are enough
+	// subtrees for every piece to have a few {{{
+	NodeList upper;
+	upper.nodes = NULL;
+	upper.count = upper.capacity = 0;
+	reserveNodes( upper, 4 * SUBTREES_PER_PIECE * state.pieces + 1 );
+	Node& root = upper.nodes[ upper.count++ ];
+	root.pos.x = root.pos.y = root.pos.m = 0;
+	root.neg = root.pos;
+	root.left = state.left;
+	root.bottom = state.bottom;
+	root.size = state.rootSize;
+	root.firstChild = root.childCount = 0;
+	root.first = 0;
+	root.count = this->mSize;
+
+	unsigned int n = 0;
+	while(( n < upper.count ) &&
+			( upper.count - n < SUBTREES_PER_PIECE * state.pieces ))
+	{
+		reserveNodes( upper, upper.count + 4 );
+		splitNode( upper.nodes[ n++ ], upper, state.keys, state.rootSize,
+				state.leafCapacity );
+	}
+	state.nodes = upper.nodes;
+	state.frontierBegin = n; //}}}
+
+	// Hand out the rest of the subtrees, balanced by particle count {{{
+	state.frontierSplit = new unsigned int[ state.pieces + 1 ];
+	state.subtrees = new NodeList[ state.pieces ];
+	unsigned int r = state.frontierBegin;
+	unsigned long long assigned = 0, remaining = 0;
+	for( unsigned int i = state.frontierBegin; i < upper.count; i++ )
+		remaining += upper.nodes[ i ].count;
+	for( unsigned int t = 0; t < state.pieces; t++ )
+	{
+		state.frontierSplit[ t ] = r;
+		unsigned long long target = remaining * (t + 1) / state.pieces;
+		while(( r < upper.count ) && ( assigned < target ))
+			assigned += upper.nodes[ r++ ].count;
+
+		state.subtrees[ t ].nodes = NULL;
+		state.subtrees[ t ].count = state.subtrees[ t ].capacity = 0;
+	}
+	state.frontierSplit[ state.pieces ] = upper.count; //}}}
+
+	runInParallel( buildSubtrees, &state );
+	delete[] state.keys;
+
+	// Glue the subtrees onto the end of the upper levels, fixing up child indices {{{
+	unsigned int total = upper.count;
+	for( unsigned int t = 0; t < state.pieces; t++ )
+		total += state.subtrees[ t ].count;
+	this->mNodes = new Node[ total ];
+	copy( upper.nodes, upper.nodes + upper.count, this->mNodes );
+	this->mNodeCount = upper.count;
+	for( unsigned int t = 0; t < state.pieces; t++ )
+	{
+		NodeList& local = state.subtrees[ t ];
+		unsigned int offset = this->mNodeCount;
+		for( unsigned int i = state.frontierSplit[ t ];
+				i < state.frontierSplit[ t + 1 ]; i++ )
+			this->mNodes[ i ].firstChild += offset;
+		for( unsigned int i = 0; i < local.count; i++ )
+		{
+			this->mNodes[ offset + i ] = local.nodes[ i ];
+			this->mNodes[ offset + i ].firstChild += offset;
+		}
+		this->mNodeCount += local.count;
+		delete[] local.nodes;
+	}
+	delete[] state.subtrees;
+	delete[] state.frontierSplit;
+	delete[] upper.nodes; //}}}
+
+	// The subtrees already have their moments, so only the upper levels are left
+	for( unsigned int i = state.frontierBegin; i-- > 0; )
+		computeMoment( this->mNodes[ i ], this->mNodes,
+				this->mX, this->mY, this->mM );
+
+	if( this->groupSize > 0 )
+		this->findGroups();
+	if( this->mixed )
+		this->buildFloatCopies();
+} //}}}
+
+void LinearQuadtree::clear()
+{ //{{{
+	delete[] this->mNodes;
+	this->mNodes = NULL;
+	this->mNodeCount = 0;
+
+	delete[] this->mOrder;
+	this->mOrder = NULL;
+	delete[] this->mData;
+	this->mData = NULL;
+	this->mX = this->mY = this->mM = NULL;
+	this->mSize = 0;
+
+	delete[] this->mGroups;
+	this->mGroups = NULL;
+	this->mGroupCount = 0;
+
+	this->mFloat.clear();
+} //}}}
+
+void LinearQuadtree::update( unsigned int indice ) const
+{ //{{{
+	if(( this->mPS == NULL ) || ( this->mNodeCount == 0 ) ||
+			( indice >= this->mPS->getSize() ))
+		return;
+
+	unsigned int interactions = 0;
+	if( this->mFloat.getNodes() != NULL )
+	{
+		FloatTree::CompensatedSum fx, fy;
+		this->mFloat.walk( 0, this->mPS->getX( indice ),
+				this->mPS->getY( indice ), indice, this->tau, fx, fy,
+				interactions );
+		this->mPS->addForce( indice, this->mPS->getMass( indice ) * fx.total(),
+				this->mPS->getMass( indice ) * fy.total() );
+		this->mPS->setCost( indice, interactions );
+		return;
+	}
+
+	Accumulator fx = 0, fy = 0;
+	this->update( 0, this->mPS->getX( indice ), this->mPS->getY( indice ),
+			this->mPS->getMass( indice ), indice, fx, fy, interactions );
+	this->mPS->addForce( indice, fx, fy );
+	this->mPS->setCost( indice, interactions );
+} //}}}
+
+void LinearQuadtree::update() const
+{ //{{{
+	if( this->mPS == NULL )
+		return;
+
+	for( unsigned int i = 0; i < this->mPS->getSize(); i++ )
+		this->update( i );
+} //}}}
+
+bool LinearQuadtree::isFarFrom( const Part& part, Real size, Real x,
+		Real y ) const
+{ //{{{
+	Real dx = part.x - x;
+	Real dy = part.y - y;
+	return ( size * size < this->tau * this->tau * ( dx * dx + dy * dy ));
+} //}}}
+
+void LinearQuadtree::update( unsigned int n, Real x, Real y,
+		Real m, unsigned int self,
+		Accumulator& fx, Accumulator& fy, unsigned int& interactions ) const
+{ //{{{
+	const Node& node = this->mNodes[ n ];
+
+	// A leaf of one particle is just that particle, so only bigger cells
+	// are worth testing
+	if(( node.childCount > 0 ) || ( node.count > 1 ))
+	{
+		bool inside = ( x >= node.left ) && ( x < node.left + node.size ) &&
+			( y >= node.bottom ) && ( y < node.bottom + node.size );
+
+		// The node is used whole if it is far enough from the centers of
+		// both its positive and negative masses; one with no mass of either
+		// sign is opened, as there is nothing to measure the distance to
+		bool hasPos = !inside && ( fabs( node.pos.m ) >= ZERO_MASS );
+		if( !inside && ( !hasPos ||
+					this->isFarFrom( node.pos, node.size, x, y )))
+		{
+			bool hasNeg = ( fabs( node.neg.m ) >= ZERO_MASS );
+			if(( hasPos || hasNeg ) && ( !hasNeg ||
+						this->isFarFrom( node.neg, node.size, x, y )))
+			{
+				if( hasPos )
+					addForce( node.pos, x, y, m, fx, fy, interactions );
+				if( hasNeg )
+					addForce( node.neg, x, y, m, fx, fy, interactions );
+				return;
+			}
+		}
+
+		if( node.childCount > 0 )
+		{
+			for( unsigned int c = 0; c < node.childCount; c++ )
+				this->update( node.firstChild + c, x, y, m, self,
+						fx, fy, interactions );
+			return;
+		}
+	}
+
+	for( unsigned int j = node.first; j < node.first + node.count; j++ )
+	{
+		if(( this->mOrder[ j ] == self ) || ( fabs( this->mM[ j ] ) < ZERO_MASS ))
+			continue;
+		Real dx = this->mX[ j ] - x;
+		Real dy = this->mY[ j ] - y;
+		Real d2 = dx * dx + dy * dy;
+		Real d3 = sqrt( d2 ) * d2;
+		Real gm = m * this->mM[ j ];
+		fx += dx * gm / d3;
+		fy += dy * gm / d3;
+		interactions++;
+	}
+} //}}}
+
+void LinearQuadtree::buildFloatCopies()
+{ //{{{
+	this->mFloat.allocate( this->mNodeCount, this->mSize, this->mOrder );
+	FloatTree::Node* small = this->mFloat.getNodes();
+	for( unsigned int n = 0; n < this->mNodeCount; n++ )
+	{
+		const Node& node = this->mNodes[ n ];
+		small[ n ].left = node.left;
+		small[ n ].bottom = node.bottom;
+		small[ n ].size = node.size;
+		small[ n ].firstChild = node.firstChild;
+		small[ n ].childCount = node.childCount;
+		small[ n ].first = node.first;
+		small[ n ].count = node.count;
+	}
+
+	float* x = this->mFloat.getX();
+	float* y = this->mFloat.getY();
+	float* m = this->mFloat.getM();
+	for( unsigned int i = 0; i < this->mSize; i++ )
+	{
+		x[ i ] = this->mX[ i ];
+		y[ i ] = this->mY[ i ];
+		m[ i ] = this->mM[ i ];
+	}
+	this->mFloat.computeMoments();
+} //}}}
+
+void LinearQuadtree::updateGroups( unsigned int first, unsigned int last ) const
+{ //{{{
+	if(( this->mPS == NULL ) || ( last > this->mGroupCount ))
+		return;
+
+	InteractionList< Lane > list;
+	InteractionList< float > floatList;
+	for( unsigned int g = first; g < last; g++ )
+	{
+		const Node& group = this->mNodes[ this->mGroups[ g ] ];
+		unsigned int end = group.first + group.count;
+
+		// Walk once for the box around every particle in the group {{{
+		Real left = this->mX[ group.first ], right = left;
+		Real bottom = this->mY[ group.first ], top = bottom;
+		for( unsigned int i = group.first + 1; i < end; i++ )
+		{
+			if( this->mX[ i ] < left )
+				left = this->mX[ i ];
+			if( this->mX[ i ] > right )
+				right = this->mX[ i ];
+			if( this->mY[ i ] < bottom )
+				bottom = this->mY[ i ];
+			if( this->mY[ i ] > top )
+				top = this->mY[ i ];
+		}
+		// Rounding to float keeps the order, so this box is still the
+		// smallest around the float copies
+		unsigned int count = 0;
+		if( this->mFloat.getNodes() != NULL )
+		{
+			floatList.count = 0;
+			this->gatherMixed( 0, left, right, bottom, top, floatList );
+			count = floatList.count;
+		}
+		else
+		{
+			list.count = 0;
+			this->gather( 0, left, right, bottom, top, list );
+			count = list.count;
+		} //}}}
+
+		// Evaluate the same list for every particle in the group; each one
+		// is in the list itself unless massless, and the kernel skips it {{{
+		for( unsigned int i = group.first; i < end; i++ )
+		{
+			double ax = 0, ay = 0;
+			if( this->mFloat.getNodes() != NULL )
+				accumulateForce( floatList.x, floatList.y, floatList.m, count,
+						this->mFloat.getX()[ i ], this->mFloat.getY()[ i ],
+						ax, ay );
+			else
+				accumulateForce( list.x, list.y, list.m, count,
+						this->mX[ i ], this->mY[ i ], ax, ay );
+			unsigned int interactions = count;
+			if(( interactions > 0 ) && ( fabs( this->mM[ i ] ) >= ZERO_MASS ))
+				interactions--;
+			this->mPS->addForce( this->mOrder[ i ],
+					this->mM[ i ] * ax, this->mM[ i ] * ay );
+			this->mPS->setCost( this->mOrder[ i ], interactions );
+		} //}}}
+	}
+} //}}}
+
+void LinearQuadtree::gather( unsigned int n, Real left,
+		Real right, Real bottom, Real top,
+		InteractionList< Lane >& list ) const
+{ //{{{
+	const Node& node = this->mNodes[ n ];
+
+	if(( node.childCount > 0 ) || ( node.count > 1 ))
+	{
+		// The closest any point of the box gets to each center of mass, so a
+		// cell far enough from the whole box is far enough from each particle
+		// in it
+		bool overlaps = ( right >= node.left ) &&
+			( left < node.left + node.size ) &&
+			( top >= node.bottom ) && ( bottom < node.bottom + node.size );
+		const Part* parts[ 2 ] = { &node.pos, &node.neg };
+		bool far = !overlaps, any = false;
+		for( unsigned int i = 0; far && ( i < 2 ); i++ )
+		{
+			const Part& part = *parts[ i ];
+			if( fabs( part.m ) < ZERO_MASS )
+				continue;
+			Real dx = 0, dy = 0;
+			if( part.x < left )
+				dx = left - part.x;
+			else if( part.x > right )
+				dx = part.x - right;
+			if( part.y < bottom )
+				dy = bottom - part.y;
+			else if( part.y > top )
+				dy = part.y - top;
+			far = ( node.size < this->tau * sqrt( dx * dx + dy * dy ));
+			any = true;
+		}
+
+		if( far && any )
+		{
+			list.reserve( list.count + 2 );
+			for( unsigned int i = 0; i < 2; i++ )
+			{
+				if( fabs( parts[ i ]->m ) >= ZERO_MASS )
+					list.add( parts[ i ]->x, parts[ i ]->y, parts[ i ]->m );
+			}
+			return;
+		}
+
+		if( node.childCount > 0 )
+		{
+			for( unsigned int c = 0; c < node.childCount; c++ )
+				this->gather( node.firstChild + c, left, right, bottom, top,
+						list );
+			return;
+		}
+	}
+
+	list.reserve( list.count + node.count );
+	for( unsigned int j = node.first; j < node.first + node.count; j++ )
+	{
+		if( fabs( this->mM[ j ] ) >= ZERO_MASS )
+			list.add( this->mX[ j ], this->mY[ j ], this->mM[ j ] );
+	}
+} //}}}
+
+void LinearQuadtree::gatherMixed( unsigned int n, float left,
+		float right, float bottom, float top,
+		InteractionList< float >& list ) const
+{ //{{{
+	const FloatTree::Node& node = this->mFloat.getNodes()[ n ];
+
+	// The same test as gather(), done in double as the mixed walk does
+	if(( node.childCount > 0 ) || ( node.count > 1 ))
+	{
+		bool overlaps = ( right >= node.left ) &&
+			( left < node.left + node.size ) &&
+			( top >= node.bottom ) && ( bottom < node.bottom + node.size );
+		const FloatTree::Part* parts[ 2 ] = { &node.pos, &node.neg };
+		bool far = !overlaps, any = false;
+		for( unsigned int i = 0; far && ( i < 2 ); i++ )
+		{
+			const FloatTree::Part& part = *parts[ i ];
+			if( fabs( part.m ) < ZERO_MASS )
+				continue;
+			double dx = 0, dy = 0;
+			if( part.x < left )
+				dx = (double)left - part.x;
+			else if( part.x > right )
+				dx = (double)part.x - right;
+			if( part.y < bottom )
+				dy = (double)bottom - part.y;
+			else if( part.y > top )
+				dy = (double)part.y - top;
+			far = ( node.size < this->tau * sqrt( dx * dx + dy * dy ));
+			any = true;
+		}
+
+		if( far && any )
+		{
+			list.reserve( list.count + 2 );
+			for( unsigned int i = 0; i < 2; i++ )
+			{
+				if( fabs( parts[ i ]->m ) >= ZERO_MASS )
+					list.add( parts[ i ]->x, parts[ i ]->y, parts[ i ]->m );
+			}
+			return;
+		}
+
+		if( node.childCount > 0 )
+		{
+			for( unsigned int c = 0; c < node.childCount; c++ )
+				this->gatherMixed( node.firstChild + c, left, right, bottom,
+						top, list );
+			return;
+		}
+	}
+
+	const float* x = this->mFloat.getX();
+	const float* y = this->mFloat.getY();
+	const float* m = this->mFloat.getM();
+	list.reserve( list.count + node.count );
+	for( unsigned int j = node.first; j < node.first + node.count; j++ )
+	{
+		if( fabs( m[ j ] ) >= ZERO_MASS )
+			list.add( x[ j ], y[ j ], m[ j ] );
+	}
+} //}}}
+
+bool LinearQuadtree::getMixedPrecision() const
+{ //{{{
+	return this->mixed;
+} //}}}
+
+void LinearQuadtree::setMixedPrecision( bool nMixed )
+{ //{{{
+	this->mixed = nMixed;
+} //}}}
+
+unsigned int LinearQuadtree::getGroupCount() const
+{ //{{{
+	return this->mGroupCount;
+} //}}}
+
+unsigned int LinearQuadtree::getGroup( unsigned int indice ) const
+{ //{{{
+	return this->mGroups[ indice ];
+} //}}}
+
+unsigned int LinearQuadtree::getLeafCapacity() const
+{ //{{{
+	return this->leafCapacity;
+} //}}}
+
+void LinearQuadtree::setLeafCapacity( unsigned int nLeafCapacity )
+{ //{{{
+	this->leafCapacity = (nLeafCapacity > 0) ? nLeafCapacity : 1;
+} //}}}
+
+unsigned int LinearQuadtree::getGroupSize() const
+{ //{{{
+	return this->groupSize;
+} //}}}
+
+void LinearQuadtree::setGroupSize( unsigned int nGroupSize )
+{ //{{{
+	this->groupSize = nGroupSize;
+} //}}}
+
+void LinearQuadtree::findGroups()
+{ //{{{
+	delete[] this->mGroups;
+	this->mGroups = new unsigned int[ this->mSize ];
+	this->mGroupCount = 0;
+	if( this->mNodeCount == 0 )
+		return;
+
+	// Depth first so groups come out in tree order, every particle in
+	// exactly one of them
+	unsigned int* stack = new unsigned int[ 3 * MORTON_MAX_DEPTH + 4 ];
+	unsigned int depth = 0;
+	stack[ depth++ ] = 0;
+	while( depth > 0 )
+	{
+		const Node& node = this->mNodes[ stack[ --depth ] ];
+		if(( node.childCount == 0 ) || ( node.count <= this->groupSize ))
+		{
+			this->mGroups[ this->mGroupCount++ ] = stack[ depth ];
+			continue;
+		}
+		for( unsigned int c = node.childCount; c-- > 0; )
+			stack[ depth++ ] = node.firstChild + c;
+	}
+	delete[] stack;
+} //}}}
+
+unsigned int LinearQuadtree::getNodeCount() const
+{ //{{{
+	return this->mNodeCount;
+} //}}}
+
+const LinearQuadtree::Node& LinearQuadtree::getNode( unsigned int indice ) const
+{ //{{{
+	return this->mNodes[ indice ];
+} //}}}
+
+unsigned int LinearQuadtree::getOrder( unsigned int indice ) const
+{ //{{{
+	return this->mOrder[ indice ];
+} //}}}
+
+const Real* LinearQuadtree::getXs() const
+{ //{{{
+	return this->mX;
+} //}}}
+
+const Real* LinearQuadtree::getYs() const
+{ //{{{
+	return this->mY;
+} //}}}
+
+const Real* LinearQuadtree::getMasses() const
+{ //{{{
+	return this->mM;
+} //}}}
+
+ParticleSystem* LinearQuadtree::getParticleSystem()
+{ //{{{
+	return this->mPS;
+} //}}}
+
+Real LinearQuadtree::getLeft() const
+{ //{{{
+	return (this->mNodeCount > 0) ? this->mNodes[ 0 ].left : 0;
+} //}}}
+
+Real LinearQuadtree::getRight() const
+{ //{{{
+	return (this->mNodeCount > 0) ?
+		this->mNodes[ 0 ].left + this->mNodes[ 0 ].size : 0;
+} //}}}
+
+Real LinearQuadtree::getTop() const
+{ //{{{
+	return (this->mNodeCount > 0) ?
+		this->mNodes[ 0 ].bottom + this->mNodes[ 0 ].size : 0;
+} //}}}
+
+Real LinearQuadtree::getBottom() const
+{ //{{{
+	return (this->mNodeCount > 0) ? this->mNodes[ 0 ].bottom : 0;
+} //}}}
+
+Real LinearQuadtree::getTau() const
+{ //{{{
+	return this->tau;
+} //}}}
+
+void LinearQuadtree::setTau( Real nTau )
+{ //{{{
+	this->tau = nTau;
+} //}}}
+
+unsigned int LinearQuadtree::getNumberOfThreads() const
+{ //{{{
+	return this->numThreads;
+} //}}}
+
+void LinearQuadtree::setNumberOfThreads( unsigned int num )
+{ //{{{
+	this->numThreads = num;
+} //}}}
+
+void LinearQuadtree::printDimensions() const
+{ //{{{
+	cout << "\t[" << this->getLeft() << ", " << this->getRight() << "] ["
+		<< this->getBottom() << ", " << this->getTop() << "] ("
+		<< this->mNodeCount << " nodes)\n";
+} //}}}
@@ -0,0 +1,384 @@
+/** {{{
+ * Copyright 2010 Jeff Chapman.
+ *
+ * This file is a part of Barnes-Hut
+ *
+ * Barnes-Hut is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Barnes-Hut is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Barnes-Hut.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */// }}}
+#ifndef LINEAR_QUADTREE_HPP
+#define LINEAR_QUADTREE_HPP
+
+#include "particle_system.hpp"
+#include "float_tree.hpp"
+
+/**
+ * Quadtree stored as a single flat array of nodes instead of a web of
+ * separately allocated Quadtree objects.
+ *
+ * The children of a node are stored next to each other, so a node only needs
+ * the indice of its first child and how many children it has. Particles are
+ * copied into tree order when the tree is built, which means every node owns
+ * a contiguous range of them and a leaf can be evaluated by walking straight
+ * through memory. Building and destroying the tree are each a handful of
+ * allocations no matter how many particles are in it.
+ *
+ * Particles can also be walked in groups. A group is a cell holding a few
+ * particles; it walks the tree once for all of them with an opening test that
+ * holds for every point in their bounding box, and each of them is then
+ * evaluated against the same list of cells and particles with the SIMD force
+ * kernel.
+ *
+ * As in Quadtree, each node keeps its positive and negative masses apart, and
+ * is only used whole when it is far from the centers of both, so a cell whose
+ * masses nearly cancel is not opened all the way down.
+ *
+ * In mixed precision, the per particle walk reads float copies of the nodes
+ * and particles, kept in a FloatTree a fraction of the size, and adds up
+ * forces in double with compensated summation. It opens nodes the same way.
+ */
+class LinearQuadtree
+{
+	public:
+		/**
+		 * Center and total of the masses of one sign in a cell.
+		 */
+		struct Part
+		{
+			Real x, y, m;
+		};
+
+		/**
+		 * One cell of the tree.
+		 */
+		struct Node
+		{
+			/// Center and total of only the positive and only the negative
+			/// masses in this cell.
+			Part pos, neg;
+			/// Lower left corner and width of this cell.
+			Real left, bottom, size;
+			/// Indice of the first child, only meaningful when childCount > 0.
+			unsigned int firstChild;
+			/// Number of non-empty children, 0 for leaves.
+			unsigned int childCount;
+			/// First particle (in tree order) contained in this cell.
+			unsigned int first;
+			/// Number of particles contained in this cell.
+			unsigned int count;
+		};
+
+		/**
+		 * Create an empty tree.
+		 */
+		LinearQuadtree();
+
+		/**
+		 * Create a tree based on a particle system.
+		 * @param ps : ParticleSystem to base this off of
+		 */
+		LinearQuadtree( ParticleSystem* ps );
+
+		/**
+		 * Proper deconstructor that deletes all associated memory.
+		 */
+		~LinearQuadtree();
+
+		/**
+		 * Rebuild this tree from a particle system, trashing the old tree.
+		 * Uses getNumberOfThreads() threads.
+		 * @param ps : ParticleSystem to build from
+		 */
+		void build( ParticleSystem* ps );
+
+		/**
+		 * Delete all contents of this.
+		 */
+		void clear();
+
+		/**
+		 * Updates a particle's acceleration by using the Barnes-Hut algorithm,
+		 * recording the number of interactions it took as its cost.
+		 * @param indice : indice of particle in the associated system to update
+		 */
+		void update( unsigned int indice ) const;
+
+		/**
+		 * Updates all of the associated system's particles with new forces.
+		 */
+		void update() const;
+
+		/**
+		 * Updates the particles of a range of groups with new forces,
+		 * recording the number of interactions each took as its cost.
+		 * @param first : first group to update
+		 * @param last : one past the last group to update
+		 */
+		void updateGroups( unsigned int first, unsigned int last ) const;
+
+		/**
+		 * Returns the number of groups particles are walked in, which is 0
+		 * unless a group size was set before building.
+		 * @return : number of groups
+		 */
+		unsigned int getGroupCount() const;
+
+		/**
+		 * Returns the node a group is made of.
+		 * @param indice : which group
+		 * @return : indice of the group's node
+		 */
+		unsigned int getGroup( unsigned int indice ) const;
+
+		/**
+		 * Returns the most particles a leaf holds before it is split.
+		 * @return : leaf capacity
+		 */
+		unsigned int getLeafCapacity() const;
+
+		/**
+		 * Sets the most particles a leaf holds for the next build. A leaf
+		 * that is opened is summed directly, particle by particle.
+		 * @param nLeafCapacity : new leaf capacity, at least 1
+		 */
+		void setLeafCapacity( unsigned int nLeafCapacity );
+
+		/**
+		 * Returns the most particles in a group.
+		 * @return : group size, 0 if particles are walked one at a time
+		 */
+		unsigned int getGroupSize() const;
+
+		/**
+		 * Sets the most particles in a group for the next build.
+		 * @param nGroupSize : new group size, 0 to walk particles one at a time
+		 */
+		void setGroupSize( unsigned int nGroupSize );
+
+		/**
+		 * Returns true if the per particle walk uses float copies of the tree.
+		 * @return : true if in mixed precision
+		 */
+		bool getMixedPrecision() const;
+
+		/**
+		 * Sets whether the per particle walk uses float copies of the tree,
+		 * made by the next build.
+		 * @param nMixed : true for mixed precision
+		 */
+		void setMixedPrecision( bool nMixed );
+
+		/**
+		 * Returns the number of nodes in this tree.
+		 * @return : number of nodes
+		 */
+		unsigned int getNodeCount() const;
+
+		/**
+		 * Returns a node of this tree, the root being node 0.
+		 * @param indice : which node to return
+		 * @return : that node
+		 */
+		const Node& getNode( unsigned int indice ) const;
+
+		/**
+		 * Returns the system indice of a particle given its tree order.
+		 * @param indice : position of particle in tree order
+		 * @return : indice of particle in the associated system
+		 */
+		unsigned int getOrder( unsigned int indice ) const;
+
+		/**
+		 * Returns the x coordinates of the particles in tree order.
+		 * @return : array of getNode( 0 ).count coordinates
+		 */
+		const Real* getXs() const;
+
+		/**
+		 * Returns the y coordinates of the particles in tree order.
+		 * @return : array of getNode( 0 ).count coordinates
+		 */
+		const Real* getYs() const;
+
+		/**
+		 * Returns the masses of the particles in tree order.
+		 * @return : array of getNode( 0 ).count masses
+		 */
+		const Real* getMasses() const;
+
+		/**
+		 * Returns the particle system this tree was built from.
+		 * @return : associated particle system
+		 */
+		ParticleSystem* getParticleSystem();
+
+		/**
+		 * Returns left side.
+		 * @return : left side
+		 */
+		Real getLeft() const;
+
+		/**
+		 * Returns right side.
+		 * @return : right side
+		 */
+		Real getRight() const;
+
+		/**
+		 * Returns top side.
+		 * @return : top side
+		 */
+		Real getTop() const;
+
+		/**
+		 * Returns bottom side.
+		 * @return : bottom side
+		 */
+		Real getBottom() const;
+
+		/**
+		 * Returns the tau of this tree.
+		 * @return : this's tau
+		 */
+		Real getTau() const;
+
+		/**
+		 * Sets this tau of this tree.
+		 * @param nTau : new value for tau
+		 */
+		void setTau( Real nTau );
+
+		/**
+		 * Return the most threads from the shared pool used to build this.
+		 * @return : number of threads
+		 */
+		unsigned int getNumberOfThreads() const;
+
+		/**
+		 * Set the most threads from the shared pool the next build may use.
+		 * @param num : number of threads, 0 or 1 to build serially
+		 */
+		void setNumberOfThreads( unsigned int num );
+
+		/**
+		 * Prints the dimensions of this to cout.
+		 */
+		void printDimensions() const;
+
+	private:
+		/**
+		 * Cells and particles a group interacts with.
+		 */
+		template< typename T >
+		struct InteractionList;
+
+		/**
+		 * Makes the float copies of the nodes and particles, and works out
+		 * the positive and negative moments of the float nodes.
+		 */
+		void buildFloatCopies();
+
+		/**
+		 * Divides the tree into groups of at most groupSize particles.
+		 */
+		void findGroups();
+
+		/**
+		 * Lists what the particles in a box interact with inside a node.
+		 * @param n : indice of node
+		 * @param left : left side of box
+		 * @param right : right side of box
+		 * @param bottom : bottom side of box
+		 * @param top : top side of box
+		 * @param list : list to add cells and particles to
+		 */
+		void gather( unsigned int n, Real left, Real right,
+				Real bottom, Real top,
+				InteractionList< Lane >& list ) const;
+
+		/**
+		 * Lists what the particles in a box interact with inside a node,
+		 * using the float copies of the tree.
+		 * @param n : indice of node
+		 * @param left : left side of box
+		 * @param right : right side of box
+		 * @param bottom : bottom side of box
+		 * @param top : top side of box
+		 * @param list : list to add cells and particles to
+		 */
+		void gatherMixed( unsigned int n, float left, float right,
+				float bottom, float top,
+				InteractionList< float >& list ) const;
+
+		/**
+		 * Returns true if a point is far enough from the center of some of
+		 * the masses in a cell for them to be used whole.
+		 * @param part : masses to test
+		 * @param size : width of the cell
+		 * @param x : x coordinate of point
+		 * @param y : y coordinate of point
+		 * @return : true if they may be used whole
+		 */
+		bool isFarFrom( const Part& part, Real size, Real x, Real y ) const;
+
+		/**
+		 * Accumulates the force on a point from everything in a node.
+		 * @param n : indice of node
+		 * @param x : x coordinate of point
+		 * @param y : y coordinate of point
+		 * @param m : mass of point
+		 * @param self : indice of the point in the system, skipped if found
+		 * @param fx : x force accumulator
+		 * @param fy : y force accumulator
+		 * @param interactions : incremented for each mass used
+		 */
+		void update( unsigned int n, Real x, Real y,
+				Real m, unsigned int self,
+				Accumulator& fx, Accumulator& fy, unsigned int& interactions ) const;
+
+		Node* mNodes;
+		unsigned int mNodeCount;
+
+		/// Number of particles in this tree.
+		unsigned int mSize;
+		/// Maps tree order to system indices.
+		unsigned int* mOrder;
+		/// Particle positions and masses in tree order, in one allocation.
+		Real* mData;
+		Real* mX;
+		Real* mY;
+		Real* mM;
+
+		ParticleSystem* mPS;
+		Real tau;
+		unsigned int numThreads;
+		/// Most particles a leaf holds before it is split.
+		unsigned int leafCapacity;
+
+		/// Most particles in a group, 0 to walk particles one at a time.
+		unsigned int groupSize;
+		/// Node of each group, in tree order.
+		unsigned int* mGroups;
+		unsigned int mGroupCount;
+
+		/// True to walk the float copies of the tree.
+		bool mixed;
+		/// Float copies of the nodes, and of the particles in tree order.
+		FloatTree mFloat;
+
+		LinearQuadtree( const LinearQuadtree& rhs );
+		LinearQuadtree& operator=( const LinearQuadtree& rhs );
+};
+
+#endif // LINEAR_QUADTREE_HPP
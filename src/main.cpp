@@ -30,9 +30,15 @@ using std::stringstream;
 
 #include "particle_system.hpp"
 #include "quadtree.hpp"
+#include "linear_quadtree.hpp"
+#include "node_arena.hpp"
+#include "force_kernel.hpp"
 
 #include "error_tester.hpp"
 #include "barnes_hut.hpp"
+#include "fast_multipole.hpp"
+#include "integrator.hpp"
+#include "out_of_core.hpp"
 
 #ifdef GUI
 //{{{
@@ -58,15 +64,13 @@ void drawParticleSystem( ParticleSystem* toDraw, RenderWindow& target )
 	if( toDraw == NULL )
 		return;
 
-	long double r = toDraw->getRight(), l = toDraw->getLeft();
+	Real r = toDraw->getRight(), l = toDraw->getLeft();
 	float radius = (r - l) / target.GetWidth() * 3.0;
 
-	Particle* tp;
 	for( unsigned int i = 0; i < toDraw->getSize(); i++ )
 	{
-		tp = toDraw->getParticle( i );
-		target.Draw( Shape::Circle( tp->x, tp->y, radius,
-			((tp->m < 0) ? Color::Red : Color::Blue )
+		target.Draw( Shape::Circle( toDraw->getX( i ), toDraw->getY( i ), radius,
+			((toDraw->getMass( i ) < 0) ? Color::Red : Color::Blue )
 					) );
 	}
 } //}}}
@@ -80,7 +84,7 @@ void drawQuadtree( Quadtree* toDraw, RenderWindow& target, unsigned int depth )
 	Color color( Color::Black );
 	float thickness = 0.005;
 
-	long double l = toDraw->getLeft(), r = toDraw->getRight(),
+	Real l = toDraw->getLeft(), r = toDraw->getRight(),
 		  b = toDraw->getBottom(), t = toDraw->getTop();
 
 	// if this is the root node, draw a border around everything
@@ -89,10 +93,10 @@ void drawQuadtree( Quadtree* toDraw, RenderWindow& target, unsigned int depth )
 
 	float zthick = 0.005; // if this is zero-sum cell, draw a magenta border
 	if(( toDraw->getMe() != NULL ) &&
-		( fabs( toDraw->getMe()->m ) < numeric_limits<long double>::epsilon() ))
+		( fabs( toDraw->getMe()->m ) < numeric_limits<Real>::epsilon() ))
 		drawRectangle( target, l, b, r, t, zthick );
 
-	long double mX = (l + r)/2.0, mY = (b + t)/2.0;
+	Real mX = (l + r)/2.0, mY = (b + t)/2.0;
 	target.Draw( Shape::Line( l, mY, r, mY, thickness, color ) );
 	target.Draw( Shape::Line( mX, b, mX, t, thickness, color ) );
 
@@ -102,86 +106,279 @@ void drawQuadtree( Quadtree* toDraw, RenderWindow& target, unsigned int depth )
 	for( unsigned int i = 0; i < 4; i++ )
 		drawQuadtree( toDraw->getChild( i ), target, depth + 1 );
 } //}}}
+
+void drawLinearQuadtree( LinearQuadtree* toDraw, RenderWindow& target );
+void drawLinearQuadtree( LinearQuadtree* toDraw, RenderWindow& target )
+{ //{{{
+	if(( toDraw == NULL ) || ( toDraw->getNodeCount() == 0 ))
+		return;
+
+	Color color( Color::Black );
+	float thickness = 0.005;
+
+	drawRectangle( target, toDraw->getLeft(), toDraw->getBottom(),
+			toDraw->getRight(), toDraw->getTop(), thickness, color );
+
+	for( unsigned int n = 0; n < toDraw->getNodeCount(); n++ )
+	{
+		const LinearQuadtree::Node& node = toDraw->getNode( n );
+		Real l = node.left, r = node.left + node.size,
+			  b = node.bottom, t = node.bottom + node.size;
+
+		// if this is zero-sum cell, draw a magenta border
+		if( fabs( node.pos.m + node.neg.m ) <
+				numeric_limits<Real>::epsilon() )
+			drawRectangle( target, l, b, r, t );
+
+		if( node.childCount == 0 )
+			continue;
+
+		Real mX = (l + r)/2.0, mY = (b + t)/2.0;
+		target.Draw( Shape::Line( l, mY, r, mY, thickness, color ) );
+		target.Draw( Shape::Line( mX, b, mX, t, thickness, color ) );
+	}
+} //}}}
 //}}}
 #endif
 
-void simulate( string fileName, string outName, long double tau, int argc );
+/// Most particles walked together when grouping is asked for.
+static const unsigned int GROUP_SIZE = 64;
+
+void simulate( string fileName, string outName, Real tau, int argc,
+		bool useLinear, unsigned int groupSize, bool mixed,
+		unsigned int leafCapacity, unsigned int order, unsigned int fmmOrder,
+		bool dualTree, bool hugePages, unsigned int precision,
+		bool binaryOut );
+void integrate( string fileName, string outName, Real tau,
+		unsigned int steps, Real dt, bool useLinear,
+		unsigned int groupSize, bool mixed, unsigned int leafCapacity,
+		unsigned int order, unsigned int fmmOrder, bool dualTree,
+		bool hugePages, unsigned int precision, bool binaryOut );
+void saveResults( ParticleSystem& ps, string outName,
+		unsigned int precision, bool binaryOut );
 
 int main( int argc, char** argv )
 {
-	// Print args, determine doTest {{{
+	// Print args, pick out flags from positional arguments {{{
 	bool doTest = false;
+	bool resume = false;
+	bool useLinear = false;
+	unsigned int groupSize = 0;
+	bool mixed = false;
+	unsigned int leafCapacity = 1;
+	unsigned int order = 1;
+	unsigned int fmmOrder = 0;
+	bool dualTree = false;
+	bool hugePages = false;
+	string convertName("");
+	unsigned int precision = 4;
+	bool binaryOut = false;
+	unsigned int budget = 0;
+	unsigned int steps = 0;
+	Real dt = 0.01;
+	int posc = 0;
+	char** posv = new char*[ argc ];
 	cout << "Arguments:\n";
 	for( int i = 0; i < argc; i++ )
 	{
 		cout << "   " << i << ": " << argv[i] << '\n';
 		if( (string)argv[i] == "-t" )
 			doTest = true;
+		else if( (string)argv[i] == "-k" )
+		{
+			doTest = true;
+			resume = true;
+		}
+		else if( (string)argv[i] == "-l" )
+			useLinear = true;
+		else if( (string)argv[i] == "-m" )
+		{
+			useLinear = true;
+			mixed = true;
+		}
+		else if( (string)argv[i] == "-g" )
+		{
+			useLinear = true;
+			groupSize = GROUP_SIZE;
+		}
+		else if( (string)argv[i] == "-q" )
+			order = 2;
+		else if( (string)argv[i] == "-d" )
+			dualTree = true;
+		else if( (string)argv[i] == "-h" )
+			hugePages = true;
+		else if(( (string)argv[i] == "-f" ) && ( i + 1 < argc ))
+		{
+			cout << "   " << i + 1 << ": " << argv[i + 1] << '\n';
+			stringstream tmp( argv[i + 1] );
+			tmp >> fmmOrder;
+			useLinear = true;
+			i += 1;
+		}
+		else if(( (string)argv[i] == "-c" ) && ( i + 1 < argc ))
+		{
+			cout << "   " << i + 1 << ": " << argv[i + 1] << '\n';
+			convertName = argv[i + 1];
+			i += 1;
+		}
+		else if(( (string)argv[i] == "-p" ) && ( i + 1 < argc ))
+		{
+			cout << "   " << i + 1 << ": " << argv[i + 1] << '\n';
+			stringstream tmp( argv[i + 1] );
+			tmp >> precision;
+			i += 1;
+		}
+		else if( (string)argv[i] == "-r" )
+			binaryOut = true;
+		else if(( (string)argv[i] == "-o" ) && ( i + 1 < argc ))
+		{
+			cout << "   " << i + 1 << ": " << argv[i + 1] << '\n';
+			stringstream tmp( argv[i + 1] );
+			tmp >> budget;
+			i += 1;
+		}
+		else if(( (string)argv[i] == "-b" ) && ( i + 1 < argc ))
+		{
+			cout << "   " << i + 1 << ": " << argv[i + 1] << '\n';
+			stringstream tmp( argv[i + 1] );
+			tmp >> leafCapacity;
+			i += 1;
+		}
+		else if(( (string)argv[i] == "-s" ) && ( i + 2 < argc ))
+		{
+			cout << "   " << i + 1 << ": " << argv[i + 1] << '\n';
+			cout << "   " << i + 2 << ": " << argv[i + 2] << '\n';
+			stringstream tmp( string( argv[i + 1] ) + " " + argv[i + 2] );
+			tmp >> steps >> dt;
+			i += 2;
+		}
+		else
+			posv[ posc++ ] = argv[ i ];
 	}
 	//}}}
 
+	if(( budget > 0 ) && binaryOut )
+	{
+		cout << "Streamed results are only written as text\n";
+		binaryOut = false;
+	}
+
 	// Determine input/output file names {{{
 	string fileName("");
 	string outputName("");
-	if( argc < 2 )
+	if( posc < 2 )
 	{
 		cout << "Please input the initial particle descriptor file name: ";
 		cin >> fileName; cout << '\n';
 	}
 	else
 	{
-		fileName = (string)(argv[ 1 ]);
+		fileName = (string)(posv[ 1 ]);
 	}
-	outputName = fileName.substr( 0, fileName.find(".txt") ) + "_output.txt";
+	outputName = fileName.substr( 0, fileName.find(".txt") ) +
+		( binaryOut ? "_output.bin" : "_output.txt" );
+	// Results of a compressed file are compressed the same way
+	if( !binaryOut &&
+		( CompressedReader::detect( fileName ) == COMPRESSION_GZIP ))
+		outputName += ".gz";
+	if( !binaryOut &&
+		( CompressedReader::detect( fileName ) == COMPRESSION_ZSTD ))
+		outputName += ".zst";
 	cout << "Selected file: " << fileName
 		<< " (output to: " << outputName << ")\n";
 	// }}}
 
+	if( !convertName.empty() )
+	{
+		ParticleSystem mPS( fileName );
+		if(( mPS.getSize() > 0 ) && mPS.saveBinary( convertName ))
+			cout << "Saved " << mPS.getSize() << " particles to "
+				<< convertName << "\n";
+		delete[] posv;
+		return 0;
+	}
+
 	// Determin tau {{{
-	long double tau = 0.5;
-	if( argc > 2 )
+	Real tau = 0.5;
+	if( posc > 2 )
 	{
-		stringstream tmp( argv[ 2 ] );
+		stringstream tmp( posv[ 2 ] );
 		tmp >> tau;
 	}
 	cout << "Tau is: " << tau << "\n";
 	//}}}
 
-	if( doTest )
+	if(( order > 1 ) && useLinear )
+		cout << "Quadrupole moments are only used by the pointer based Quadtree\n";
+	if( dualTree && useLinear )
+		cout << "The dual tree walk is only done on the pointer based Quadtree\n";
+
+	if( budget > 0 )
+	{
+		cout << "Streaming particles past a summary of them in "
+			<< budget << "MB\n";
+		OutOfCore mOOC( (size_t)budget << 20 );
+		mOOC.setTau( tau );
+		if( mOOC.run( fileName, outputName, precision ))
+			cout << "Saved results\n";
+	}
+	else if( doTest && mixed )
+	{
+		delete[] ErrorTester::compareMixedPrecision( fileName, tau );
+	}
+	else if( doTest && dualTree && !useLinear )
+	{
+		delete[] ErrorTester::compareDualTree( fileName, tau, leafCapacity,
+				order );
+	}
+	else if( doTest )
 	{
-		ParticleSystem* bruteForce = ErrorTester::generateBruteForce( fileName );
 		ErrorTester mET( fileName, tau );
-		mET.setBruteForce( bruteForce );
-
+		mET.setOrder( order );
+		mET.setLeafCapacity( leafCapacity );
+		mET.setFmmOrder( fmmOrder );
 		mET.setMinTau( 0.0001 );
-		mET.setMaxTau( tau / 8.0 );
-		mET.start();
-		mET.wait();
-
-		mET.setMinTau( tau / 8.0 );
-		mET.setMaxTau( tau / 4.0 );
-		mET.start();
-		mET.wait();
-
-		mET.setMinTau( tau / 4.0 );
-		mET.setMaxTau( tau / 2.0 );
-		mET.start();
-		mET.wait();
-
-		mET.setMinTau( tau / 2.0 );
 		mET.setMaxTau( tau );
-		mET.setBruteForce( bruteForce );
-		mET.start();
-		mET.wait();
+
+		// A resumed test already has its brute-force forces {{{
+		bool ready = resume && mET.resume();
+		if( !ready )
+		{
+			ParticleSystem* bruteForce =
+				ErrorTester::generateBruteForce( fileName );
+			if( bruteForce != NULL )
+			{
+				mET.setBruteForce( bruteForce );
+				delete bruteForce;
+				ready = true;
+			}
+		} //}}}
+
+		if( ready )
+		{
+			mET.start();
+			mET.wait();
+		}
 	}
+	else if( steps > 0 )
+		integrate( fileName, outputName, tau, steps, dt, useLinear, groupSize,
+				mixed, leafCapacity, order, fmmOrder, dualTree, hugePages,
+				precision, binaryOut );
 	else
-		simulate( fileName, outputName, tau, argc );
+		simulate( fileName, outputName, tau, posc, useLinear, groupSize, mixed,
+				leafCapacity, order, fmmOrder, dualTree, hugePages, precision,
+				binaryOut );
 
+	delete[] posv;
 	cout << "Exiting cleanly\n";
 	return 0;
 }
 
-void simulate( string fileName, string outName, long double tau, int argc )
+void simulate( string fileName, string outName, Real tau, int argc,
+		bool useLinear, unsigned int groupSize, bool mixed,
+		unsigned int leafCapacity, unsigned int order, unsigned int fmmOrder,
+		bool dualTree, bool hugePages, unsigned int precision,
+		bool binaryOut )
 { //{{{
 	ParticleSystem mPS( fileName );
 	if( mPS.getSize() < 1 )
@@ -191,55 +388,140 @@ void simulate( string fileName, string outName, long double tau, int argc )
 	}
 	mPS.printDimensions();
 
-	cout << "Putting all particles into Quadtree, let's see if we SIGSEGV\n";
-	Quadtree mQT( &mPS );
-	mQT.setTau( tau );
-	mQT.printDimensions();
+	BarnesHut mBH( &mPS );
+	NodeArena arena( hugePages );
+	Quadtree* mQT = NULL;
+	LinearQuadtree* mLQT = NULL;
+	if( useLinear )
+	{
+		cout << "Putting all particles into a linear Quadtree\n";
+		mLQT = new LinearQuadtree();
+		mLQT->setGroupSize( groupSize );
+		mLQT->setMixedPrecision( mixed );
+		mLQT->setLeafCapacity( leafCapacity );
+		mLQT->build( &mPS );
+		mLQT->setTau( tau );
+		mLQT->printDimensions();
+		if( groupSize > 0 )
+			cout << "Walking groups with the " << getForceKernelName()
+				<< " force kernel\n";
+		mBH.setLinearQuadTree( mLQT );
+	}
+	else
+	{
+		cout << "Putting all particles into Quadtree, let's see if we SIGSEGV\n";
+		mQT = new Quadtree( &mPS, &arena, leafCapacity );
+		mQT->setTau( tau );
+		if( order > 1 )
+			mQT->setOrder( order );
+		mQT->printDimensions();
+		arena.printStatistics();
+		mBH.setQuadTree( mQT );
+		mBH.setDualTree( dualTree );
+	}
 
-	cout << "Runnnig Barnes-Hut on all particles\n";
-	BarnesHut mBH( &mPS, &mQT );
-	mBH.setLast( mPS.getSize() );
-	mBH.start();
-	mBH.wait();
+	if( fmmOrder > 0 )
+	{
+		cout << "Running the fast multipole method on all particles\n";
+		FastMultipole mFMM( mLQT, fmmOrder );
+		mFMM.setTau( tau );
+		mFMM.run();
+	}
+	else
+	{
+		cout << "Runnnig Barnes-Hut on all particles\n";
+		mBH.setLast( mPS.getSize() );
+		mBH.start();
+		mBH.wait();
+	}
 
 	if( argc > 3 )
 		cout << mPS << '\n';
 
 	cout << "Saving results\n";
-	mPS.save( outName );
+	saveResults( mPS, outName, precision, binaryOut );
 
 #ifdef GUI
 	//{{{
-	if( argc < 5 )
-		return;
-
-	RenderWindow window( VideoMode( 1000, 1000 ), "B-H", Style::Close );
-	View view( FloatRect( mQT.getLeft(), mQT.getBottom(),
-				mQT.getRight(), mQT.getTop() ) );
-	window.SetView( view );
-	window.SetFramerateLimit( 30 );
-	window.Clear( Color::White );
-
-	drawQuadtree( &mQT, window );
-	drawParticleSystem( &mPS, window );
-
-	// Display the image until it's closed {{{
-	Event event;
-	while( window.IsOpened() )
+	if( argc >= 5 )
 	{
-		while( window.GetEvent( event ) )
+		RenderWindow window( VideoMode( 1000, 1000 ), "B-H", Style::Close );
+		View view = (mQT != NULL) ?
+			View( FloatRect( mQT->getLeft(), mQT->getBottom(),
+					mQT->getRight(), mQT->getTop() ) ) :
+			View( FloatRect( mLQT->getLeft(), mLQT->getBottom(),
+					mLQT->getRight(), mLQT->getTop() ) );
+		window.SetView( view );
+		window.SetFramerateLimit( 30 );
+		window.Clear( Color::White );
+
+		if( mQT != NULL )
+			drawQuadtree( mQT, window );
+		else
+			drawLinearQuadtree( mLQT, window );
+		drawParticleSystem( &mPS, window );
+
+		// Display the image until it's closed {{{
+		Event event;
+		while( window.IsOpened() )
 		{
-			if( event.Type == Event::Closed )
+			while( window.GetEvent( event ) )
+			{
+				if( event.Type == Event::Closed )
+					window.Close();
+			}
+			if( window.GetInput().IsKeyDown( Key::Escape ) )
 				window.Close();
-		}
-		if( window.GetInput().IsKeyDown( Key::Escape ) )
-			window.Close();
 
-		window.Display();
+			window.Display();
+		}
+		// }}}
 	}
-	// }}}
 	//}}}
 #endif
 
+	delete mQT;
+	delete mLQT;
+} //}}}
+
+void integrate( string fileName, string outName, Real tau,
+		unsigned int steps, Real dt, bool useLinear,
+		unsigned int groupSize, bool mixed, unsigned int leafCapacity,
+		unsigned int order, unsigned int fmmOrder, bool dualTree,
+		bool hugePages, unsigned int precision, bool binaryOut )
+{ //{{{
+	ParticleSystem mPS( fileName );
+	if( mPS.getSize() < 1 )
+	{
+		cout << "No particles in file\n";
+		return;
+	}
+	mPS.printDimensions();
+
+	cout << "Stepping particles " << steps << " times by " << dt << "\n";
+	Integrator mInt( &mPS, tau, useLinear );
+	mInt.setSteps( steps );
+	mInt.setTimeStep( dt );
+	mInt.setGroupSize( groupSize );
+	mInt.setMixedPrecision( mixed );
+	mInt.setLeafCapacity( leafCapacity );
+	mInt.setOrder( order );
+	mInt.setFmmOrder( fmmOrder );
+	mInt.setDualTree( dualTree );
+	mInt.setHugePages( hugePages );
+	mInt.start();
+	mInt.wait();
+	mPS.printDimensions();
+
+	cout << "Saving results\n";
+	saveResults( mPS, outName, precision, binaryOut );
 } //}}}
 
+void saveResults( ParticleSystem& ps, string outName,
+		unsigned int precision, bool binaryOut )
+{ //{{{
+	if( binaryOut )
+		ps.saveBinary( outName, true );
+	else
+		ps.save( outName, precision );
+} //}}}
@@ -0,0 +1,250 @@
+/** {{{
+ * Copyright 2010 Jeff Chapman.
+ *
+ * This file is a part of Barnes-Hut
+ *
+ * Barnes-Hut is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Barnes-Hut is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Barnes-Hut.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */// }}}
+
+#include "morton.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+using std::lower_bound;
+using std::swap;
+
+#include <limits>
+using std::numeric_limits;
+
+#include <cmath>
+
+static const Real QUAD_LEEWAY = 8.0 * numeric_limits<Real>::epsilon();
+/// Pieces a sort is cut into per thread, so idle threads can steal.
+static const unsigned int PIECES_PER_THREAD = 4;
+
+/**
+ * Everything the threads of a radix sort share.
+ */
+struct SortState
+{
+	unsigned int size;
+	unsigned int pieces;
+	unsigned long long* keys;
+	unsigned long long* tmpKeys;
+	unsigned int* order;
+	unsigned int* tmpOrder;
+	/// Digit being sorted on and per piece histograms of it.
+	unsigned int shift;
+	unsigned int* counts;
+};
+
+/**
+ * Returns the first key of a piece of a sort.
+ * @param state : shared sort state
+ * @param piece : which piece
+ * @return : first key indice for that piece
+ */
+static unsigned int pieceBegin( const SortState* state, unsigned int piece )
+{ //{{{
+	return (unsigned int)(( (unsigned long long)state->size * piece ) /
+			state->pieces );
+} //}}}
+
+/**
+ * Counts or scatters the digits of a range of pieces on behalf of the thread
+ * pool.
+ */
+class SortTask : public ThreadPool::Task
+{
+	public:
+		SortTask( SortState* iState, bool iScatter ) :
+			ThreadPool::Task(), //{{{
+			state( iState ),
+			scatter( iScatter )
+		{
+		} //}}}
+
+		void process( unsigned int first, unsigned int last )
+		{ //{{{
+			for( unsigned int piece = first; piece < last; piece++ )
+			{
+				if( this->scatter )
+					this->scatterDigits( piece );
+				else
+					this->countDigits( piece );
+			}
+		} //}}}
+
+	private:
+		void countDigits( unsigned int piece ) const
+		{ //{{{
+			unsigned int* counts = this->state->counts + 256 * piece;
+			for( unsigned int d = 0; d < 256; d++ )
+				counts[ d ] = 0;
+			for( unsigned int i = pieceBegin( this->state, piece );
+					i < pieceBegin( this->state, piece + 1 ); i++ )
+				counts[ (this->state->keys[ i ] >> this->state->shift) & 0xFF ]++;
+		} //}}}
+
+		void scatterDigits( unsigned int piece ) const
+		{ //{{{
+			unsigned int* offsets = this->state->counts + 256 * piece;
+			for( unsigned int i = pieceBegin( this->state, piece );
+					i < pieceBegin( this->state, piece + 1 ); i++ )
+			{
+				unsigned int dst =
+					offsets[ (this->state->keys[ i ] >> this->state->shift) & 0xFF ]++;
+				this->state->tmpKeys[ dst ] = this->state->keys[ i ];
+				this->state->tmpOrder[ dst ] = this->state->order[ i ];
+			}
+		} //}}}
+
+		SortState* state;
+		/// True to scatter, false to count.
+		bool scatter;
+
+		SortTask( const SortTask& rhs );
+		SortTask& operator=( const SortTask& rhs );
+};
+
+/**
+ * Spreads the bits of a 32 bit number out into the even bits of a 64 bit one.
+ * @param v : number to spread
+ * @return : spread out number
+ */
+static unsigned long long spreadBits( unsigned long long v )
+{ //{{{
+	v = (v | (v << 16)) & 0x0000FFFF0000FFFFULL;
+	v = (v | (v << 8)) & 0x00FF00FF00FF00FFULL;
+	v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	v = (v | (v << 2)) & 0x3333333333333333ULL;
+	v = (v | (v << 1)) & 0x5555555555555555ULL;
+	return v;
+} //}}}
+
+/**
+ * Turns a coordinate into a fixed point fraction of the root's width.
+ * @param v : coordinate
+ * @param low : lowest coordinate of the root
+ * @param size : width of the root
+ * @return : coordinate scaled to [0, 2^32)
+ */
+static unsigned long long quantize( Real v, Real low, Real size )
+{ //{{{
+	long double t = (v - low) / size * 4294967296.0L;
+	if( t < 0 )
+		return 0;
+	if( t >= 4294967295.0L )
+		return 4294967295ULL;
+	return (unsigned long long)t;
+} //}}}
+
+void findMortonRoot( Real left, Real right, Real bottom, Real top,
+		Real largest, Real& rootLeft, Real& rootBottom, Real& rootSize )
+{ //{{{
+	Real leeway = QUAD_LEEWAY * largest;
+	left -= leeway;
+	right += leeway;
+	bottom -= leeway;
+	top += leeway;
+
+	Real w = right - left;
+	Real h = top - bottom;
+	if( w > h )
+		bottom -= (w - h)/2.0;
+	else if( h > w )
+		left -= (h - w)/2.0;
+	rootLeft = left;
+	rootBottom = bottom;
+	rootSize = (w > h) ? w : h;
+} //}}}
+
+unsigned long long mortonKey( Real x, Real y, Real left, Real bottom,
+		Real size )
+{ //{{{
+	return spreadBits( quantize( x, left, size )) |
+		(spreadBits( quantize( y, bottom, size )) << 1);
+} //}}}
+
+void sortMortonKeys( unsigned long long*& keys, unsigned int*& order,
+		unsigned long long*& tmpKeys, unsigned int*& tmpOrder,
+		unsigned int size, unsigned int threads )
+{ //{{{
+	SortState state;
+	state.size = size;
+	state.pieces = PIECES_PER_THREAD * (( threads > 0 ) ? threads : 1);
+	state.keys = keys;
+	state.tmpKeys = tmpKeys;
+	state.order = order;
+	state.tmpOrder = tmpOrder;
+	state.counts = new unsigned int[ 256 * state.pieces ];
+
+	SortTask count( &state, false );
+	SortTask scatter( &state, true );
+	for( state.shift = 0; state.shift < 64; state.shift += 8 )
+	{
+		ThreadPool::instance()->run( &count, 0, state.pieces, threads, 1 );
+
+		// Turn the histograms into where each piece writes each digit {{{
+		unsigned int total = 0;
+		bool sorted = false;
+		for( unsigned int d = 0; d < 256; d++ )
+		{
+			unsigned int digitTotal = 0;
+			for( unsigned int t = 0; t < state.pieces; t++ )
+			{
+				unsigned int c = state.counts[ 256 * t + d ];
+				state.counts[ 256 * t + d ] = total;
+				total += c;
+				digitTotal += c;
+			}
+			if( digitTotal == state.size )
+				sorted = true;
+		} //}}}
+
+		// Every key has the same digit, so this pass would not move anything
+		if( sorted )
+			continue;
+
+		ThreadPool::instance()->run( &scatter, 0, state.pieces, threads, 1 );
+		swap( state.keys, state.tmpKeys );
+		swap( state.order, state.tmpOrder );
+	}
+	delete[] state.counts;
+
+	keys = state.keys;
+	tmpKeys = state.tmpKeys;
+	order = state.order;
+	tmpOrder = state.tmpOrder;
+} //}}}
+
+bool findMortonQuadrants( const unsigned long long* keys, unsigned int first,
+		unsigned int count, Real rootSize, Real size, unsigned int* bounds )
+{ //{{{
+	// Sizes are exact halvings of the root, so this is exact
+	int level = ilogb( rootSize ) - ilogb( size );
+	if( level >= MORTON_MAX_DEPTH )
+		return false;
+
+	// Particles are sorted by key, so each quadrant is a contiguous run
+	unsigned int shift = 2 * (MORTON_MAX_DEPTH - 1 - level);
+	unsigned long long prefix = keys[ first ] & ~((4ULL << shift) - 1);
+	bounds[ 0 ] = first;
+	bounds[ 4 ] = first + count;
+	for( unsigned long long q = 1; q < 4; q++ )
+		bounds[ q ] = lower_bound( keys + bounds[ q - 1 ], keys + bounds[ 4 ],
+				prefix | (q << shift) ) - keys;
+	return true;
+} //}}}
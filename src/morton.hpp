@@ -0,0 +1,95 @@
+/** {{{
+ * Copyright 2010 Jeff Chapman.
+ *
+ * This file is a part of Barnes-Hut
+ *
+ * Barnes-Hut is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Barnes-Hut is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Barnes-Hut.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */// }}}
+#ifndef MORTON_HPP
+#define MORTON_HPP
+
+#include "real.hpp"
+
+/**
+ * Helpers for trees built by sorting particles along a Z-order curve, as
+ * LinearQuadtree and the summary of OutOfCore are.
+ *
+ * Each particle gets a 64 bit Morton key, its quantized x and y with their
+ * bits interleaved. Once sorted by key, the particles of every cell of the
+ * tree are a contiguous run, and each cell splits into its four quadrants by
+ * binary searches of that run.
+ */
+
+/// Deepest a node may be, limited by the 32 bits per axis in a Morton key.
+const int MORTON_MAX_DEPTH = 32;
+
+/**
+ * Finds the square root cell around a bounding box, pushed out a little so
+ * the particles at its edges are still inside.
+ * @param left : lowest x of any particle
+ * @param right : highest x of any particle
+ * @param bottom : lowest y of any particle
+ * @param top : highest y of any particle
+ * @param largest : largest magnitude of any bound, as
+ * ParticleSystem::getLargestBound() gives
+ * @param rootLeft : set to the left side of the root
+ * @param rootBottom : set to the bottom side of the root
+ * @param rootSize : set to the width of the root
+ */
+void findMortonRoot( Real left, Real right, Real bottom, Real top,
+		Real largest, Real& rootLeft, Real& rootBottom, Real& rootSize );
+
+/**
+ * Returns the Morton key of a point.
+ * @param x : x coordinate of the point
+ * @param y : y coordinate of the point
+ * @param left : left side of the root
+ * @param bottom : bottom side of the root
+ * @param size : width of the root
+ * @return : key of the point
+ */
+unsigned long long mortonKey( Real x, Real y, Real left, Real bottom,
+		Real size );
+
+/**
+ * Sorts Morton keys, and the indices that go with them, with a parallel LSD
+ * radix sort. Each pass moves the keys between the arrays given, so the
+ * pointers are swapped to leave keys and order pointing at the sorted ones.
+ * @param keys : keys to sort
+ * @param order : indice to carry along with each key
+ * @param tmpKeys : room for as many keys
+ * @param tmpOrder : room for as many indices
+ * @param size : number of keys
+ * @param threads : most threads to use
+ */
+void sortMortonKeys( unsigned long long*& keys, unsigned int*& order,
+		unsigned long long*& tmpKeys, unsigned int*& tmpOrder,
+		unsigned int size, unsigned int threads );
+
+/**
+ * Finds where the particles of a cell split between its four quadrants.
+ * @param keys : sorted Morton keys of all particles
+ * @param first : first particle of the cell
+ * @param count : number of particles in the cell
+ * @param rootSize : width of the root
+ * @param size : width of the cell
+ * @param bounds : set to the first particle of each quadrant and one past
+ * the last of the cell, so quadrant q holds bounds[q] to bounds[q + 1]
+ * @return : false if the cell is as deep as a cell can be
+ */
+bool findMortonQuadrants( const unsigned long long* keys, unsigned int first,
+		unsigned int count, Real rootSize, Real size, unsigned int* bounds );
+
+#endif // MORTON_HPP
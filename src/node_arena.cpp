@@ -0,0 +1,197 @@
+/** {{{
+ * Copyright 2010 Jeff Chapman.
+ *
+ * This file is a part of Barnes-Hut
+ *
+ * Barnes-Hut is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Barnes-Hut is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Barnes-Hut.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */// }}}
+
+#include "node_arena.hpp"
+
+#include <iostream>
+using std::cout;
+using std::cerr;
+
+#include <new>
+using std::bad_alloc;
+
+#include <sys/mman.h>
+
+/// Alignment of everything handed out, enough for long double.
+static const size_t ARENA_ALIGN = 16;
+/// Size of a huge page, which huge page backed blocks are rounded up to.
+static const size_t HUGE_PAGE = 2 * 1024 * 1024;
+
+/**
+ * Round a size up to a multiple of some alignment.
+ * @param bytes : size to round
+ * @param align : power of two to round to
+ * @return : rounded size
+ */
+static size_t roundUp( size_t bytes, size_t align )
+{ //{{{
+	return (bytes + align - 1) & ~(align - 1);
+} //}}}
+
+NodeArena::NodeArena( bool iHugePages, size_t iBlockSize ) :
+	hugePages( iHugePages ), //{{{
+	gotHugePages( false ),
+	blockSize( iBlockSize ),
+	mFirst( NULL ),
+	mLast( NULL ),
+	mCurrent( NULL ),
+	mOffset( 0 ),
+	mUsed( 0 ),
+	mReserved( 0 ),
+	mBlocks( 0 )
+{
+} //}}}
+
+NodeArena::~NodeArena()
+{ //{{{
+	this->release();
+} //}}}
+
+void* NodeArena::allocate( size_t bytes )
+{ //{{{
+	bytes = roundUp( bytes, ARENA_ALIGN );
+
+	// Move on to the next kept block, or make one, until this fits {{{
+	while(( this->mCurrent == NULL ) ||
+			( this->mOffset + bytes > this->mCurrent->size ))
+	{
+		if(( this->mCurrent != NULL ) && ( this->mCurrent->next != NULL ))
+			this->mCurrent = this->mCurrent->next;
+		else if(( this->mCurrent == NULL ) && ( this->mFirst != NULL ))
+			this->mCurrent = this->mFirst;
+		else
+		{
+			// Stay on the last block, so what is in use is never handed out
+			// again
+			Block* b = this->newBlock( bytes );
+			if( b == NULL )
+				throw bad_alloc();
+			this->mCurrent = b;
+		}
+		this->mOffset = roundUp( sizeof( Block ), ARENA_ALIGN );
+	} //}}}
+
+	void* result = reinterpret_cast<char*>( this->mCurrent ) + this->mOffset;
+	this->mOffset += bytes;
+	this->mUsed += bytes;
+	return result;
+} //}}}
+
+void NodeArena::reset()
+{ //{{{
+	this->mCurrent = NULL;
+	this->mOffset = 0;
+	this->mUsed = 0;
+} //}}}
+
+void NodeArena::release()
+{ //{{{
+	Block* b = this->mFirst;
+	while( b != NULL )
+	{
+		Block* next = b->next;
+		munmap( b, b->size );
+		b = next;
+	}
+	this->mFirst = this->mLast = this->mCurrent = NULL;
+	this->mOffset = 0;
+	this->mUsed = this->mReserved = 0;
+	this->mBlocks = 0;
+	this->gotHugePages = false;
+} //}}}
+
+size_t NodeArena::getBytesUsed() const
+{ //{{{
+	return this->mUsed;
+} //}}}
+
+size_t NodeArena::getBytesReserved() const
+{ //{{{
+	return this->mReserved;
+} //}}}
+
+unsigned int NodeArena::getBlockCount() const
+{ //{{{
+	return this->mBlocks;
+} //}}}
+
+void NodeArena::setHugePages( bool nHugePages )
+{ //{{{
+	this->hugePages = nHugePages;
+} //}}}
+
+bool NodeArena::usesHugePages() const
+{ //{{{
+	return this->gotHugePages;
+} //}}}
+
+void NodeArena::printStatistics() const
+{ //{{{
+	cout << "\t" << this->mUsed << " of " << this->mReserved
+		<< " bytes used in " << this->mBlocks << " blocks"
+		<< (this->gotHugePages ? " (huge pages)" : "") << "\n";
+} //}}}
+
+NodeArena::Block* NodeArena::newBlock( size_t minimum )
+{ //{{{
+	size_t size = minimum + roundUp( sizeof( Block ), ARENA_ALIGN );
+	if( size < this->blockSize )
+		size = this->blockSize;
+
+	void* data = MAP_FAILED;
+	bool huge = false;
+	if( this->hugePages )
+	{
+		size = roundUp( size, HUGE_PAGE );
+#ifdef MAP_HUGETLB
+		// Ask for reserved huge pages first, then fall back to asking for
+		// transparent ones
+		data = mmap( NULL, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+		huge = ( data != MAP_FAILED );
+#endif
+	}
+	if( data == MAP_FAILED )
+		data = mmap( NULL, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	if( data == MAP_FAILED )
+	{
+		cerr << "NodeArena could not reserve " << size << " bytes\n";
+		return NULL;
+	}
+#ifdef MADV_HUGEPAGE
+	if(( this->hugePages ) && ( !huge ))
+		huge = ( madvise( data, size, MADV_HUGEPAGE ) == 0 );
+#endif
+
+	Block* b = static_cast<Block*>( data );
+	b->next = NULL;
+	b->size = size;
+	if( this->mLast != NULL )
+		this->mLast->next = b;
+	else
+		this->mFirst = b;
+	this->mLast = b;
+
+	this->mReserved += size;
+	this->mBlocks++;
+	this->gotHugePages = this->gotHugePages || huge;
+	return b;
+} //}}}
@@ -0,0 +1,140 @@
+/** {{{
+ * Copyright 2010 Jeff Chapman.
+ *
+ * This file is a part of Barnes-Hut
+ *
+ * Barnes-Hut is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Barnes-Hut is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Barnes-Hut.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */// }}}
+#ifndef NODE_ARENA_HPP
+#define NODE_ARENA_HPP
+
+#include <cstddef>
+
+/**
+ * Bump allocator for tree nodes.
+ *
+ * Memory is handed out from large blocks which are never returned to the
+ * system until the arena is destroyed. reset() makes all of it available
+ * again in constant time, so a tree that is rebuilt over and over stops
+ * going through the global allocator once the arena has grown big enough.
+ * Nothing allocated from an arena has its destructor called.
+ */
+class NodeArena
+{
+	public:
+		/**
+		 * Create an empty arena.
+		 * @param iHugePages : true to try to back blocks with huge pages
+		 * @param iBlockSize : bytes to reserve each time the arena runs out
+		 */
+		NodeArena( bool iHugePages = false, size_t iBlockSize = 2 * 1024 * 1024 );
+
+		/**
+		 * Proper deconstructor that gives all blocks back to the system.
+		 */
+		~NodeArena();
+
+		/**
+		 * Allocate memory suitably aligned for any tree node.
+		 * @param bytes : number of bytes needed
+		 * @return : pointer to the memory
+		 * @throw std::bad_alloc : if the system is out, leaving this as it
+		 * was
+		 */
+		void* allocate( size_t bytes );
+
+		/**
+		 * Mark everything allocated from this as free, keeping the blocks.
+		 * @note : anything still pointing into this is left dangling
+		 */
+		void reset();
+
+		/**
+		 * Give all blocks back to the system.
+		 */
+		void release();
+
+		/**
+		 * Returns the number of bytes handed out since the last reset.
+		 * @return : bytes in use
+		 */
+		size_t getBytesUsed() const;
+
+		/**
+		 * Returns the number of bytes reserved from the system.
+		 * @return : bytes reserved
+		 */
+		size_t getBytesReserved() const;
+
+		/**
+		 * Returns the number of blocks reserved from the system.
+		 * @return : number of blocks
+		 */
+		unsigned int getBlockCount() const;
+
+		/**
+		 * Sets whether blocks reserved from now on are backed by huge pages.
+		 * @param nHugePages : true to try to back them with huge pages
+		 */
+		void setHugePages( bool nHugePages );
+
+		/**
+		 * Returns true if at least one block is backed by huge pages.
+		 * @return : true if huge pages are in use
+		 */
+		bool usesHugePages() const;
+
+		/**
+		 * Prints how much memory this is using to cout.
+		 */
+		void printStatistics() const;
+
+	private:
+		/**
+		 * Header at the start of every block.
+		 */
+		struct Block
+		{
+			Block* next;
+			size_t size;
+		};
+
+		/**
+		 * Reserves a new block from the system and appends it to the list.
+		 * @param minimum : bytes the block must have room for
+		 * @return : the new block, or NULL if the system is out
+		 */
+		Block* newBlock( size_t minimum );
+
+		bool hugePages;
+		bool gotHugePages;
+		size_t blockSize;
+
+		Block* mFirst;
+		Block* mLast;
+		/// Block currently being handed out from.
+		Block* mCurrent;
+		/// Bytes of mCurrent already handed out, including its header.
+		size_t mOffset;
+
+		size_t mUsed;
+		size_t mReserved;
+		unsigned int mBlocks;
+
+		NodeArena( const NodeArena& rhs );
+		NodeArena& operator=( const NodeArena& rhs );
+};
+
+#endif // NODE_ARENA_HPP
@@ -0,0 +1,370 @@
+/** {{{
+ * Copyright 2010 Jeff Chapman.
+ *
+ * This file is a part of Barnes-Hut
+ *
+ * Barnes-Hut is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Barnes-Hut is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Barnes-Hut.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */// }}}
+
+#include "out_of_core.hpp"
+#include "thread_pool.hpp"
+#include "morton.hpp"
+using std::string;
+
+#include <iostream>
+using std::cout;
+using std::cerr;
+
+#include <vector>
+using std::vector;
+
+#include <algorithm>
+using std::copy;
+
+/// Particles read at a time while building the summary.
+static const unsigned int SUMMARY_CHUNK_PARTICLES = 1 << 16;
+/// Bytes of the budget the summary takes per particle while it is built: the
+/// floats read in, the keys and indices being sorted and the floats in tree
+/// order, with room for the nodes.
+static const size_t SUMMARY_BUILD_BYTES = 52;
+/// Bytes a line of text is taken to be, for how much text a chunk holds.
+static const size_t TEXT_LINE_BYTES = 64;
+/// Bytes of the budget each particle of a chunk takes: its ParticleSystem
+/// fields and cost, and its text as read, carried over and written.
+static const size_t CHUNK_PARTICLE_BYTES = 7 * sizeof( Real ) +
+	sizeof( unsigned int ) + 4 * TEXT_LINE_BYTES;
+/// Bytes of each block read or written.
+static const size_t OUT_OF_CORE_BLOCK_BYTES = 4 << 20;
+/// Bytes of the budget taken no matter how many particles there are: the
+/// rings of blocks read and written, and a round of formatted text.
+static const size_t OUT_OF_CORE_FIXED_BYTES = 32 << 20;
+/// Fewest particles in a chunk worth streaming.
+static const unsigned int MIN_CHUNK_PARTICLES = 1024;
+
+/**
+ * Walks the summary for a range of the particles of a chunk on behalf of the
+ * thread pool.
+ */
+class ChunkWalkTask : public ThreadPool::Task
+{
+	public:
+		ChunkWalkTask( const FloatTree* iSummary, Real iTau,
+				ParticleSystem* iChunk, unsigned int iOffset ) :
+			ThreadPool::Task(), //{{{
+			summary( iSummary ),
+			tau( iTau ),
+			chunk( iChunk ),
+			offset( iOffset )
+		{
+		} //}}}
+
+		void process( unsigned int first, unsigned int last )
+		{ //{{{
+			for( unsigned int i = first; i < last; i++ )
+			{
+				FloatTree::CompensatedSum fx, fy;
+				unsigned int interactions = 0;
+				this->summary->walk( 0, this->chunk->getX( i ),
+						this->chunk->getY( i ), this->offset + i, this->tau,
+						fx, fy, interactions );
+				this->chunk->addForce( i, this->chunk->getMass( i ) * fx.total(),
+						this->chunk->getMass( i ) * fy.total() );
+			}
+		} //}}}
+
+	private:
+		const FloatTree* summary;
+		Real tau;
+		ParticleSystem* chunk;
+		/// Indice in the file of the chunk's first particle.
+		unsigned int offset;
+
+		ChunkWalkTask( const ChunkWalkTask& rhs );
+		ChunkWalkTask& operator=( const ChunkWalkTask& rhs );
+};
+
+OutOfCore::OutOfCore( size_t iBudget ) :
+	budget( iBudget ), //{{{
+	tau( 0.5 ),
+	leafCapacity( 16 ),
+	mSummary(),
+	mSize( 0 ),
+	mOrder( NULL )
+{
+} //}}}
+
+OutOfCore::~OutOfCore()
+{ //{{{
+	this->clear();
+} //}}}
+
+bool OutOfCore::run( string fileName, string outName, unsigned int precision )
+{ //{{{
+	if( !this->summarize( fileName ))
+	{
+		this->clear();
+		return false;
+	}
+
+	// Give the chunks whatever the summary left of the budget {{{
+	size_t summaryBytes = this->mSummary.getNodeCount() *
+		sizeof( FloatTree::Node ) +
+		this->mSize * ( 3 * sizeof( float ) + sizeof( unsigned int ));
+	size_t chunkSize = 0;
+	if( OUT_OF_CORE_FIXED_BYTES + summaryBytes < this->budget )
+		chunkSize = ( this->budget - OUT_OF_CORE_FIXED_BYTES - summaryBytes ) /
+			CHUNK_PARTICLE_BYTES;
+	if( chunkSize > this->mSize )
+		chunkSize = this->mSize;
+	if( chunkSize < MIN_CHUNK_PARTICLES )
+	{
+		cerr << "A budget of " << ( this->budget >> 20 ) << "MB leaves too "
+			<< "little room beside the summary of " << fileName << "\n";
+		this->clear();
+		return false;
+	}
+	cout << "Summary of " << this->mSize << " particles takes "
+		<< ( summaryBytes >> 20 ) << "MB, streaming them in chunks of "
+		<< chunkSize << "\n"; //}}}
+
+	ParticleStream stream( fileName, chunkSize );
+	CompressedWriter file( outName, CompressedReader::fromName( outName ),
+			OUT_OF_CORE_BLOCK_BYTES );
+	ParticleSystem chunk;
+	unsigned int offset = 0;
+	while( stream.next( chunk ))
+	{
+		ChunkWalkTask task( &this->mSummary, this->tau, &chunk, offset );
+		ThreadPool::instance()->run( &task, 0, chunk.getSize(), 0, 0 );
+		chunk.write( file, precision );
+		offset += chunk.getSize();
+	}
+	bool good = file.close() && !stream.failed();
+
+	// The file can not have changed between the passes and still be right
+	if( good && ( offset != this->mSize ))
+	{
+		cerr << fileName << " changed while it was being read\n";
+		good = false;
+	}
+	this->clear();
+	return good;
+} //}}}
+
+bool OutOfCore::summarize( string fileName )
+{ //{{{
+	this->clear();
+	if( this->budget < OUT_OF_CORE_FIXED_BYTES )
+	{
+		cerr << "A budget of " << ( this->budget >> 20 ) << "MB is too "
+			<< "small to stream anything\n";
+		return false;
+	}
+
+	// Keep only float positions and masses, a chunk at a time {{{
+	ParticleStream stream( fileName, SUMMARY_CHUNK_PARTICLES );
+	ParticleSystem chunk;
+	vector< float* > chunks;
+	Real left = 0, right = 0, bottom = 0, top = 0, largest = 1.0;
+	bool fits = true;
+	while( stream.next( chunk ))
+	{
+		// Blank lines can leave a chunk short, so the floats are kept in
+		// blocks of their own, all full but the last
+		unsigned int size = chunk.getSize();
+		for( unsigned int i = 0; i < size; i++ )
+		{
+			unsigned int j = ( this->mSize + i ) % SUMMARY_CHUNK_PARTICLES;
+			if( j == 0 )
+				chunks.push_back( new float[ 3 * SUMMARY_CHUNK_PARTICLES ] );
+			float* data = chunks.back();
+			data[ j ] = chunk.getX( i );
+			data[ SUMMARY_CHUNK_PARTICLES + j ] = chunk.getY( i );
+			data[ 2 * SUMMARY_CHUNK_PARTICLES + j ] = chunk.getMass( i );
+		}
+
+		if(( this->mSize == 0 ) || ( chunk.getLeft() < left ))
+			left = chunk.getLeft();
+		if(( this->mSize == 0 ) || ( chunk.getRight() > right ))
+			right = chunk.getRight();
+		if(( this->mSize == 0 ) || ( chunk.getBottom() < bottom ))
+			bottom = chunk.getBottom();
+		if(( this->mSize == 0 ) || ( chunk.getTop() > top ))
+			top = chunk.getTop();
+		if( chunk.getLargestBound() > largest )
+			largest = chunk.getLargestBound();
+		this->mSize += size;
+
+		if( OUT_OF_CORE_FIXED_BYTES + (size_t)this->mSize * SUMMARY_BUILD_BYTES >
+			this->budget )
+		{
+			fits = false;
+			break;
+		}
+	}
+	chunk.clear(); //}}}
+
+	bool good = true;
+	if( !fits )
+	{
+		cerr << "A budget of " << ( this->budget >> 20 ) << "MB is too small "
+			<< "to summarize " << fileName << "\n";
+		good = false;
+	}
+	else if( stream.failed() )
+		good = false;
+	else if( this->mSize == 0 )
+	{
+		cout << "No particles in file\n";
+		good = false;
+	}
+
+	if( good )
+		this->build( &chunks[ 0 ], SUMMARY_CHUNK_PARTICLES,
+				left, right, bottom, top, largest );
+	else
+	{
+		for( unsigned int c = 0; c < chunks.size(); c++ )
+			delete[] chunks[ c ];
+	}
+	return good;
+} //}}}
+
+void OutOfCore::build( float** chunks, unsigned int chunkSize,
+		Real left, Real right, Real bottom, Real top, Real largest )
+{ //{{{
+	Real rootLeft = 0, rootBottom = 0, rootSize = 0;
+	findMortonRoot( left, right, bottom, top, largest,
+			rootLeft, rootBottom, rootSize );
+
+	// Sort particles along a Z-order curve {{{
+	unsigned long long* keys = new unsigned long long[ this->mSize ];
+	unsigned int* order = new unsigned int[ this->mSize ];
+	for( unsigned int i = 0; i < this->mSize; i++ )
+	{
+		const float* data = chunks[ i / chunkSize ];
+		unsigned int j = i % chunkSize;
+		order[ i ] = i;
+		keys[ i ] = mortonKey( data[ j ], data[ chunkSize + j ],
+				rootLeft, rootBottom, rootSize );
+	}
+	unsigned long long* tmpKeys = new unsigned long long[ this->mSize ];
+	unsigned int* tmpOrder = new unsigned int[ this->mSize ];
+	sortMortonKeys( keys, order, tmpKeys, tmpOrder, this->mSize,
+			ThreadPool::instance()->getSize() );
+	delete[] tmpKeys;
+	delete[] tmpOrder;
+	this->mOrder = order; //}}}
+
+	// Split nodes breadth first, so children always come after their parent {{{
+	vector< FloatTree::Node > nodes;
+	FloatTree::Node root;
+	root.left = rootLeft;
+	root.bottom = rootBottom;
+	root.size = rootSize;
+	root.first = 0;
+	root.count = this->mSize;
+	nodes.push_back( root );
+	for( unsigned int n = 0; n < nodes.size(); n++ )
+	{
+		FloatTree::Node node = nodes[ n ];
+		node.firstChild = nodes.size();
+		node.childCount = 0;
+
+		// Float sizes are exact halvings of the root's too
+		unsigned int bounds[ 5 ];
+		if(( node.count > this->leafCapacity ) && findMortonQuadrants( keys,
+					node.first, node.count, nodes[ 0 ].size, node.size, bounds ))
+		{
+			float half = node.size / 2.0f;
+			for( unsigned int q = 0; q < 4; q++ )
+			{
+				if( bounds[ q ] == bounds[ q + 1 ] )
+					continue;
+
+				FloatTree::Node child;
+				child.left = node.left + ((q & 1) ? half : 0);
+				child.bottom = node.bottom + ((q & 2) ? half : 0);
+				child.size = half;
+				child.first = bounds[ q ];
+				child.count = bounds[ q + 1 ] - bounds[ q ];
+				nodes.push_back( child );
+				node.childCount++;
+			}
+		}
+		nodes[ n ] = node;
+	}
+	delete[] keys; //}}}
+
+	// Put the particles in tree order, then let go of the chunks {{{
+	this->mSummary.allocate( nodes.size(), this->mSize, this->mOrder );
+	copy( nodes.begin(), nodes.end(), this->mSummary.getNodes() );
+	vector< FloatTree::Node >().swap( nodes );
+	float* x = this->mSummary.getX();
+	float* y = this->mSummary.getY();
+	float* m = this->mSummary.getM();
+	for( unsigned int i = 0; i < this->mSize; i++ )
+	{
+		unsigned int from = this->mOrder[ i ];
+		const float* data = chunks[ from / chunkSize ];
+		unsigned int j = from % chunkSize;
+		x[ i ] = data[ j ];
+		y[ i ] = data[ chunkSize + j ];
+		m[ i ] = data[ 2 * chunkSize + j ];
+	}
+	for( unsigned int c = 0; c <= ( this->mSize - 1 ) / chunkSize; c++ )
+		delete[] chunks[ c ]; //}}}
+
+	this->mSummary.computeMoments();
+} //}}}
+
+void OutOfCore::clear()
+{ //{{{
+	this->mSummary.clear();
+	delete[] this->mOrder;
+	this->mOrder = NULL;
+	this->mSize = 0;
+} //}}}
+
+size_t OutOfCore::getBudget() const
+{ //{{{
+	return this->budget;
+} //}}}
+
+Real OutOfCore::getTau() const
+{ //{{{
+	return this->tau;
+} //}}}
+
+unsigned int OutOfCore::getLeafCapacity() const
+{ //{{{
+	return this->leafCapacity;
+} //}}}
+
+void OutOfCore::setBudget( size_t nBudget )
+{ //{{{
+	this->budget = nBudget;
+} //}}}
+
+void OutOfCore::setTau( Real nTau )
+{ //{{{
+	this->tau = nTau;
+} //}}}
+
+void OutOfCore::setLeafCapacity( unsigned int nLeafCapacity )
+{ //{{{
+	this->leafCapacity = ( nLeafCapacity > 0 ) ? nLeafCapacity : 1;
+} //}}}
+
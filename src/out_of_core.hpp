@@ -0,0 +1,150 @@
+/** {{{
+ * Copyright 2010 Jeff Chapman.
+ *
+ * This file is a part of Barnes-Hut
+ *
+ * Barnes-Hut is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Barnes-Hut is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Barnes-Hut.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */// }}}
+#ifndef OUT_OF_CORE_HPP
+#define OUT_OF_CORE_HPP
+
+#include <string>
+
+#include "particle_system.hpp"
+#include "float_tree.hpp"
+
+/**
+ * Finds the Barnes-Hut force on every particle of a file too big to load,
+ * keeping under a budget of memory.
+ *
+ * The file is gone through twice as a ParticleStream. The first time, only
+ * the positions and masses are kept, as floats, and a FloatTree is built over
+ * them, sorted by Morton key as a LinearQuadtree is; this summary takes about
+ * a sixth of what a loaded ParticleSystem does. The second time, each chunk
+ * of particles walks the summary just as the mixed precision walk of a
+ * LinearQuadtree does, and is written out with its forces before the next
+ * is read. Chunks are as big as what is left of the budget allows.
+ */
+class OutOfCore
+{
+	public:
+		/**
+		 * Create an evaluator.
+		 * @param iBudget : most bytes of memory to use
+		 */
+		OutOfCore( size_t iBudget = 0 );
+
+		/**
+		 * Proper deconstructor that deletes all associated memory.
+		 */
+		~OutOfCore();
+
+		/**
+		 * Finds the force on every particle of a file and writes them out
+		 * in the text format, compressed if the name ends in .gz or .zst.
+		 * Uses every thread of the shared pool.
+		 * @param fileName : file to read particles from
+		 * @param outName : file to write particles and their forces to
+		 * @param precision : digits after the decimal point in the output
+		 * @return : false, with a message printed, if the file could not be
+		 * read or written or the budget is too small for it
+		 */
+		bool run( std::string fileName, std::string outName,
+				unsigned int precision = 4 );
+
+		/**
+		 * Returns the most bytes of memory run() may use.
+		 * @return : budget in bytes
+		 */
+		size_t getBudget() const;
+
+		/**
+		 * Returns the tau particles are tested against.
+		 * @return : this's tau
+		 */
+		Real getTau() const;
+
+		/**
+		 * Returns the most particles a leaf of the summary holds.
+		 * @return : leaf capacity
+		 */
+		unsigned int getLeafCapacity() const;
+
+		/**
+		 * Sets the most bytes of memory run() may use. This covers what
+		 * run() allocates, not the program around it.
+		 * @param nBudget : new budget in bytes
+		 */
+		void setBudget( size_t nBudget );
+
+		/**
+		 * Sets the tau particles are tested against.
+		 * @param nTau : new value for tau
+		 */
+		void setTau( Real nTau );
+
+		/**
+		 * Sets the most particles a leaf of the summary holds. Bigger leaves
+		 * make the summary smaller, and are summed directly when opened.
+		 * @param nLeafCapacity : new leaf capacity, at least 1
+		 */
+		void setLeafCapacity( unsigned int nLeafCapacity );
+
+	private:
+		/**
+		 * Reads the positions and masses of every particle in a file and
+		 * builds the summary over them.
+		 * @param fileName : file to read
+		 * @return : false, with a message printed, if it could not be
+		 */
+		bool summarize( std::string fileName );
+
+		/**
+		 * Sorts the summary's particles along a Z-order curve and builds its
+		 * nodes.
+		 * @param chunks : blocks of the float x, y and m of every particle,
+		 * each of chunkSize x's, then y's, then m's, all full but the last
+		 * @param chunkSize : particles in a block
+		 * @param left : lowest x of any particle
+		 * @param right : highest x of any particle
+		 * @param bottom : lowest y of any particle
+		 * @param top : highest y of any particle
+		 * @param largest : largest magnitude of any bound, as
+		 * ParticleSystem::getLargestBound() gives
+		 */
+		void build( float** chunks, unsigned int chunkSize,
+				Real left, Real right, Real bottom, Real top, Real largest );
+
+		/**
+		 * Deletes the summary.
+		 */
+		void clear();
+
+		size_t budget;
+		Real tau;
+		unsigned int leafCapacity;
+
+		/// Tree over every particle of the file.
+		FloatTree mSummary;
+		/// Particles in the summary, and where in the file each one in tree
+		/// order came from.
+		unsigned int mSize;
+		unsigned int* mOrder;
+
+		OutOfCore( const OutOfCore& rhs );
+		OutOfCore& operator=( const OutOfCore& rhs );
+};
+
+#endif // OUT_OF_CORE_HPP
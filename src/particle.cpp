@@ -26,15 +26,17 @@ using std::fixed;
 using std::setprecision;
 using std::setw;
 
+#include "real.hpp"
+
 /**
  * Class used to represent a point with an x, y and mass.
  */
 class Particle
 {
 	public:
-		long double x, y;
-		long double m;
-		long double fx, fy;
+		Real x, y;
+		Real m;
+		Real fx, fy;
 
 		Particle() :
 			x(0), //{{{
@@ -45,7 +47,7 @@ class Particle
 		{
 		} //}}}
 
-		Particle( long double iX, long double iY, long double iM ) :
+		Particle( Real iX, Real iY, Real iM ) :
 			x( iX ), //{{{
 			y( iY ),
 			m( iM ),
@@ -68,6 +70,7 @@ class Particle
 				<< fixed << setprecision( 4 ) << setw( 8 ) << toPrint.fx << ", "
 				<< fixed << setprecision( 4 ) << setw( 8 ) << toPrint.fy << "] "
 				<< fixed << setprecision( 4 ) << setw( 8 ) << toPrint.m;
+			return out;
 		} //}}}
 };
 
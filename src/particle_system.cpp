@@ -19,6 +19,7 @@
  */// }}}
 
 #include "particle_system.hpp"
+#include "thread_pool.hpp"
 using std::string;
 using std::ostream;
 
@@ -26,43 +27,689 @@ using std::ostream;
 using std::cerr;
 using std::cout;
 
-#include <iomanip>
-using std::fixed;
-using std::setprecision;
-using std::setw;
-
 #include <fstream>
 using std::ifstream;
 using std::ofstream;
 
+#include <vector>
+using std::vector;
+
+#include <deque>
+using std::deque;
+
+#include <algorithm>
+using std::copy;
+using std::fill;
+
+#include <limits>
+using std::numeric_limits;
+
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/// Number of arrays of Reals held in the block behind mData.
+static const unsigned int FIELDS = 7;
+/// Number of those arrays that are positions and masses, which come first.
+static const unsigned int POSITION_FIELDS = 3;
+
+/// Version of the binary format written, and the only one read.
+static const uint32_t BINARY_VERSION = 1;
+/// Written in the byte order of the machine saving, to catch files from
+/// machines of the other order.
+static const uint32_t BINARY_BYTE_ORDER = 0x01020304;
+/// Bits of BinaryHeader::fields, in the order the arrays follow the header.
+static const uint32_t FIELD_X = 1 << 0;
+static const uint32_t FIELD_Y = 1 << 1;
+static const uint32_t FIELD_M = 1 << 2;
+static const uint32_t FIELD_FX = 1 << 3;
+static const uint32_t FIELD_FY = 1 << 4;
+static const unsigned int BINARY_FIELDS = 5;
+/// Values of BinaryHeader::realType.
+static const uint32_t BINARY_FLOAT = 1;
+static const uint32_t BINARY_DOUBLE = 2;
+static const uint32_t BINARY_LONG_DOUBLE = 3;
+#if defined( PRECISION_FLOAT )
+static const uint32_t BINARY_REAL = BINARY_FLOAT;
+#elif defined( PRECISION_DOUBLE )
+static const uint32_t BINARY_REAL = BINARY_DOUBLE;
+#else
+static const uint32_t BINARY_REAL = BINARY_LONG_DOUBLE;
+#endif
+/// Every array starts on a multiple of this many bytes from the file's start.
+static const uint64_t BINARY_ALIGN = 64;
+
+/**
+ * Header at the start of a binary particle file. It is followed, from
+ * dataOffset on, by one array of count values for each bit set in fields,
+ * in the order of the bits, each padded to a multiple of BINARY_ALIGN bytes.
+ */
+struct BinaryHeader
+{
+	char magic[ 4 ];
+	uint32_t version;
+	uint32_t byteOrder;
+	/// Type of every value, one of BINARY_FLOAT, _DOUBLE or _LONG_DOUBLE.
+	uint32_t realType;
+	/// Bytes each value takes, as long double differs between platforms.
+	uint32_t realBytes;
+	/// Which of the FIELD_ arrays follow.
+	uint32_t fields;
+	uint64_t count;
+	uint64_t dataOffset;
+	uint64_t reserved[ 3 ];
+};
+
+static const char BINARY_MAGIC[ 4 ] = { 'B', 'H', 'P', 'S' };
+
+/**
+ * Returns the bytes one array of a binary file takes, padding included.
+ * @param header : header of the file
+ * @return : bytes between the starts of two arrays
+ */
+static uint64_t binaryStride( const BinaryHeader& header )
+{ //{{{
+	uint64_t bytes = header.count * header.realBytes;
+	return ( bytes + BINARY_ALIGN - 1 ) / BINARY_ALIGN * BINARY_ALIGN;
+} //}}}
+
+/**
+ * Checks the header of a binary file describes something this can read.
+ * @param header : header of the file
+ * @param length : bytes in the file
+ * @param hasForces : true if the forces are wanted too
+ * @return : what is wrong with the file, NULL if nothing
+ */
+static const char* checkBinary( const BinaryHeader& header, size_t length,
+		bool hasForces )
+{ //{{{
+	uint32_t needed = FIELD_X | FIELD_Y | FIELD_M;
+	if( hasForces )
+		needed |= FIELD_FX | FIELD_FY;
+	if( header.byteOrder != BINARY_BYTE_ORDER )
+		return "was saved with the other byte order";
+	if( header.version != BINARY_VERSION )
+		return "is of an unknown version";
+	if((( header.realType != BINARY_FLOAT ) || ( header.realBytes != sizeof( float ))) &&
+		(( header.realType != BINARY_DOUBLE ) || ( header.realBytes != sizeof( double ))) &&
+		(( header.realType != BINARY_LONG_DOUBLE ) || ( header.realBytes != sizeof( long double ))))
+		return "holds values of a precision this platform does not have";
+	if(( header.fields & needed ) != needed )
+		return "is missing positions, masses or forces";
+	if(( header.count < 1 ) ||
+		( header.count > numeric_limits<unsigned int>::max() ))
+		return "holds no particles or too many";
+
+	// Data that overlapped the header would read the header as particles
+	if( header.dataOffset < sizeof( header ))
+		return "says its data starts inside its header";
+
+	unsigned int present = 0;
+	for( unsigned int f = 0; f < BINARY_FIELDS; f++ )
+		present += ( header.fields >> f ) & 1;
+	if(( header.dataOffset % BINARY_ALIGN != 0 ) ||
+		( header.dataOffset > length ) ||
+		( present * binaryStride( header ) > length - header.dataOffset ))
+		return "is shorter than its header says";
+	return NULL;
+} //}}}
+
+/**
+ * Finds the array of each field in a binary file.
+ * @param header : header of the file, already checked
+ * @param file : start of the file in memory
+ * @param arrays : set to the start of each of the BINARY_FIELDS arrays, NULL
+ * for those not present
+ */
+static void findBinaryArrays( const BinaryHeader& header, const void* file,
+		const char** arrays )
+{ //{{{
+	const char* next = (const char*)file + header.dataOffset;
+	for( unsigned int f = 0; f < BINARY_FIELDS; f++ )
+	{
+		arrays[ f ] = NULL;
+		if( header.fields & ( 1U << f ))
+		{
+			arrays[ f ] = next;
+			next += binaryStride( header );
+		}
+	}
+} //}}}
+
+/**
+ * Converts values of a binary file to Real.
+ * @param from : first value in the file
+ * @param type : type of the values in the file
+ * @param bytes : bytes each value in the file takes
+ * @param count : number of values
+ * @param to : where to put them
+ */
+static void convertReals( const char* from, uint32_t type, uint32_t bytes,
+		unsigned int count, Real* to )
+{ //{{{
+	for( unsigned int i = 0; i < count; i++, from += bytes )
+	{
+		switch( type )
+		{
+			case BINARY_FLOAT:
+			{
+				float v;
+				memcpy( &v, from, sizeof( v ));
+				to[ i ] = v;
+				break;
+			}
+			case BINARY_DOUBLE:
+			{
+				double v;
+				memcpy( &v, from, sizeof( v ));
+				to[ i ] = v;
+				break;
+			}
+			default:
+			{
+				long double v;
+				memcpy( &v, from, sizeof( v ));
+				to[ i ] = v;
+				break;
+			}
+		}
+	}
+} //}}}
+
+/// Fewest bytes of text given to each thread parsing a file.
+static const size_t TEXT_PIECE_BYTES = 1 << 20;
+/// Particles in each chunk of a compressed file parsed while the next is
+/// inflated, around 16MB of text.
+static const unsigned int COMPRESSED_CHUNK_PARTICLES = 1 << 19;
+/// Bytes read at a time by a ParticleStream.
+static const size_t STREAM_BLOCK_BYTES = 4 << 20;
+
+/**
+ * Parses text into a Real the way the file's precision needs. Only plain
+ * decimal numbers are taken; the nan, inf and hex numbers the C library
+ * would also read, and numbers too big for a Real, count as no number.
+ * @param from : start of the text, leading spaces already skipped
+ * @param end : set to just past the number, or to from if there is none
+ * @return : the number
+ */
+static Real parseReal( const char* from, char** end )
+{ //{{{
+	*end = const_cast<char*>( from );
+
+	// A sign, then a digit or a point and a digit, but not 0x {{{
+	const char* digits = from;
+	if(( *digits == '+' ) || ( *digits == '-' ))
+		digits++;
+	if( *digits == '.' )
+		digits++;
+	if(( *digits < '0' ) || ( *digits > '9' ))
+		return 0;
+	if(( digits[ 0 ] == '0' ) && (( digits[ 1 ] == 'x' ) || ( digits[ 1 ] == 'X' )))
+		return 0; //}}}
+
+	char* after = NULL;
+#if defined( PRECISION_FLOAT )
+	Real value = strtof( from, &after );
+#elif defined( PRECISION_DOUBLE )
+	Real value = strtod( from, &after );
+#else
+	Real value = strtold( from, &after );
+#endif
+
+	// Too big a number comes back as infinity
+	if(( value <= numeric_limits<Real>::max() ) &&
+		( value >= -numeric_limits<Real>::max() ))
+		*end = after;
+	return value;
+} //}}}
+
+/**
+ * Part of a text particle file, made of whole lines, and what was found in
+ * it.
+ */
+struct TextPiece
+{
+	TextPiece() :
+		begin( NULL ), //{{{
+		end( NULL ),
+		lines( 0 ),
+		firstLine( 0 ),
+		values(),
+		badLine( 0 ),
+		problem( NULL ),
+		left( 0 ),
+		right( 0 ),
+		bottom( 0 ),
+		top( 0 )
+	{
+	} //}}}
+
+	const char* begin;
+	const char* end;
+	/// Lines in this piece, counting a last one without a newline.
+	unsigned int lines;
+	/// Lines in the pieces before this one.
+	unsigned int firstLine;
+	/// Values of each field of the particles found, one per line that is not
+	/// blank.
+	deque< Real > values[ 5 ];
+	/// Line of the first problem counted from the start of this piece, and
+	/// what it was, NULL if there was none.
+	unsigned int badLine;
+	const char* problem;
+	/// Bounds of the particles found.
+	Real left, right, bottom, top;
+
+	private:
+		TextPiece( const TextPiece& rhs );
+		TextPiece& operator=( const TextPiece& rhs );
+};
+
+/**
+ * Parses the particles in pieces of a text particle file, and counts their
+ * lines as it goes, on behalf of the thread pool. Each piece keeps its own
+ * particles, as no piece knows where its particles go until the lines before
+ * it are counted.
+ */
+class TextLoadTask : public ThreadPool::Task
+{
+	public:
+		TextLoadTask( TextPiece* iPieces, unsigned int iFields ) :
+			ThreadPool::Task(), //{{{
+			pieces( iPieces ),
+			fields( iFields )
+		{
+		} //}}}
+
+		void process( unsigned int first, unsigned int last )
+		{ //{{{
+			for( unsigned int p = first; p < last; p++ )
+				this->parse( this->pieces[ p ] );
+		} //}}}
+
+	private:
+		void parse( TextPiece& piece ) const
+		{ //{{{
+			piece.lines = 0;
+			piece.problem = NULL;
+			const char* at = piece.begin;
+			for( ; at < piece.end; piece.lines++ )
+			{
+				while(( *at == ' ' ) || ( *at == '\t' ) || ( *at == '\r' ))
+					at++;
+				if(( at == piece.end ) || ( *at == '\n' ))
+				{
+					at++;
+					continue;
+				}
+
+				for( unsigned int f = 0; f < this->fields; f++ )
+				{
+					while(( *at == ' ' ) || ( *at == '\t' ) || ( *at == '\r' ))
+						at++;
+					if(( *at == '\n' ) || ( *at == '\0' ))
+					{
+						piece.badLine = piece.lines;
+						piece.problem = "it has too few numbers";
+						return;
+					}
+
+					char* end = NULL;
+					Real value = parseReal( at, &end );
+					if(( end == at ) || (( *end != ' ' ) && ( *end != '\t' ) &&
+						( *end != '\r' ) && ( *end != '\n' ) && ( *end != '\0' )))
+					{
+						piece.badLine = piece.lines;
+						piece.problem = "it has something other than a number in it";
+						return;
+					}
+					piece.values[ f ].push_back( value );
+					at = end;
+				}
+
+				// Anything after the numbers wanted, like the forces of a
+				// saved file, is passed over
+				const char* newline = (const char*)memchr( at, '\n',
+						piece.end - at );
+				at = ( newline == NULL ) ? piece.end : newline + 1;
+
+				bool first = ( piece.values[ 0 ].size() == 1 );
+				Real x = piece.values[ 0 ].back(), y = piece.values[ 1 ].back();
+				if( first || ( x < piece.left ))
+					piece.left = x;
+				if( first || ( x > piece.right ))
+					piece.right = x;
+				if( first || ( y < piece.bottom ))
+					piece.bottom = y;
+				if( first || ( y > piece.top ))
+					piece.top = y;
+			}
+		} //}}}
+
+		TextPiece* pieces;
+		unsigned int fields;
+
+		TextLoadTask( const TextLoadTask& rhs );
+		TextLoadTask& operator=( const TextLoadTask& rhs );
+};
+
+/// Particles each thread formats at a time when saving text.
+static const unsigned int SAVE_PIECE_PARTICLES = 4096;
+/// Most digits after the point values are formatted with without snprintf,
+/// and the most characters they can take, sign and point included.
+static const unsigned int SAVE_FAST_DIGITS = 9;
+static const unsigned int SAVE_FAST_CHARS = 40;
+/// Values scaled past this are formatted by snprintf. Must be below 2^53, so
+/// every whole number under it is exact in a double.
+static const double SAVE_FAST_LIMIT = 1e15;
+/// Type values are scaled in when formatting; a float would round too soon.
+#ifdef PRECISION_FLOAT
+typedef double SaveReal;
+#else
+typedef Real SaveReal;
+#endif
+
+/**
+ * Formats pieces of a round of particles as lines of text on behalf of the
+ * thread pool, each piece into its own buffer.
+ */
+class TextSaveTask : public ThreadPool::Task
+{
+	public:
+		TextSaveTask( const Real* const* iFields, unsigned int iSize,
+				unsigned int iPrecision, unsigned int iPieces ) :
+			ThreadPool::Task(), //{{{
+			fields( iFields ),
+			size( iSize ),
+			precision( iPrecision ),
+			width( iPrecision + 4 ),
+			scale( 0 ),
+			pieces( iPieces ),
+			first( 0 ),
+			text( NULL ),
+			length( NULL ),
+			capacity( NULL )
+		{
+			if( iPrecision <= SAVE_FAST_DIGITS )
+			{
+				this->scale = 1;
+				for( unsigned int d = 0; d < iPrecision; d++ )
+					this->scale *= 10;
+			}
+
+			this->text = new char*[ this->pieces ];
+			this->length = new size_t[ this->pieces ];
+			this->capacity = new size_t[ this->pieces ];
+			for( unsigned int p = 0; p < this->pieces; p++ )
+			{
+				this->text[ p ] = NULL;
+				this->length[ p ] = this->capacity[ p ] = 0;
+			}
+		} //}}}
+
+		~TextSaveTask()
+		{ //{{{
+			for( unsigned int p = 0; p < this->pieces; p++ )
+				delete[] this->text[ p ];
+			delete[] this->text;
+			delete[] this->length;
+			delete[] this->capacity;
+		} //}}}
+
+		/**
+		 * Sets the first particle of the next round.
+		 * @param nFirst : first particle
+		 */
+		void setFirst( unsigned int nFirst )
+		{ //{{{
+			this->first = nFirst;
+		} //}}}
+
+		/**
+		 * Returns the text of a piece of the last round.
+		 * @param p : which piece
+		 * @return : its text, getLength( p ) characters long
+		 */
+		const char* getText( unsigned int p ) const
+		{ //{{{
+			return this->text[ p ];
+		} //}}}
+
+		size_t getLength( unsigned int p ) const
+		{ //{{{
+			return this->length[ p ];
+		} //}}}
+
+		void process( unsigned int firstPiece, unsigned int lastPiece )
+		{ //{{{
+			for( unsigned int p = firstPiece; p < lastPiece; p++ )
+			{
+				this->length[ p ] = 0;
+				unsigned int begin = this->first + p * SAVE_PIECE_PARTICLES;
+				unsigned int end = begin + SAVE_PIECE_PARTICLES;
+				if( end > this->size )
+					end = this->size;
+				for( unsigned int i = begin; i < end; i++ )
+				{
+					for( unsigned int f = 0; f < 5; f++ )
+						this->append( p, this->fields[ f ][ i ],
+								( f < 4 ) ? '\t' : '\n' );
+				}
+			}
+		} //}}}
+
+	private:
+		/**
+		 * Adds a value in fixed notation, then a separator, to a piece's
+		 * text. The format is the one iostream uses for fixed, so the
+		 * output is the same character for character.
+		 * @param p : which piece
+		 * @param value : value to add
+		 * @param separator : character to follow it
+		 */
+		void append( unsigned int p, Real value, char separator )
+		{ //{{{
+			this->reserve( p, SAVE_FAST_CHARS );
+			if( this->appendFixed( p, value ))
+			{
+				this->text[ p ][ this->length[ p ]++ ] = separator;
+				return;
+			}
+
+			while( true )
+			{
+				size_t room = this->capacity[ p ] - this->length[ p ];
+#if defined( PRECISION_FLOAT ) || defined( PRECISION_DOUBLE )
+				int n = snprintf( this->text[ p ] + this->length[ p ], room,
+						"%*.*f%c", this->width, this->precision,
+						(double)value, separator );
+#else
+				int n = snprintf( this->text[ p ] + this->length[ p ], room,
+						"%*.*Lf%c", this->width, this->precision,
+						value, separator );
+#endif
+				if(( n >= 0 ) && ( (size_t)n < room ))
+				{
+					this->length[ p ] += n;
+					return;
+				}
+				this->reserve( p, ( n >= 0 ) ? n + 1 : room + 256 );
+			}
+		} //}}}
+
+		/**
+		 * Adds a value in fixed notation to a piece's text by scaling it to
+		 * a whole number, which is much faster than snprintf. Gives up when
+		 * the value is too large or too precise for that, or lies so close
+		 * to halfway between two results that rounding the scaled value
+		 * could go the wrong way, leaving those to snprintf.
+		 * @param p : which piece, with SAVE_FAST_CHARS characters of room
+		 * @param value : value to add
+		 * @return : false if nothing was added
+		 */
+		bool appendFixed( unsigned int p, Real value )
+		{ //{{{
+			if( this->scale == 0 )
+				return false;
+
+			// Negative zero is printed with a sign, so it is left to snprintf
+			bool negative = ( value < 0 );
+			SaveReal scaled = (SaveReal)( negative ? -value : value ) *
+				(SaveReal)this->scale;
+			if( !negative && ( 1 / value < 0 ))
+				return false;
+			if( !( scaled < SAVE_FAST_LIMIT ))
+				return false;
+
+			// Going through double spares x87 its slow conversion; the double
+			// can round up to the next whole number, which is corrected for.
+			// The product is off by at most half a unit in its last place
+			unsigned long long digits = (unsigned long long)(double)scaled;
+			SaveReal fraction = scaled - (SaveReal)digits;
+			if( fraction < 0 )
+			{
+				digits--;
+				fraction += 1;
+			}
+			if( fabs( fraction - 0.5 ) <=
+					4 * numeric_limits<SaveReal>::epsilon() * scaled )
+				return false;
+			if( fraction > 0.5 )
+				digits++;
+
+			// Write the digits backwards, then pad and copy them in place
+			char buffer[ SAVE_FAST_CHARS ];
+			char* end = buffer + SAVE_FAST_CHARS;
+			char* c = end;
+			unsigned int decimals = (unsigned int)( digits % this->scale );
+			unsigned long long whole = digits / this->scale;
+			for( int d = 0; d < this->precision; d++ )
+			{
+				*--c = '0' + (char)( decimals % 10 );
+				decimals /= 10;
+			}
+			if( this->precision > 0 )
+				*--c = '.';
+			do
+			{
+				*--c = '0' + (char)( whole % 10 );
+				whole /= 10;
+			} while( whole > 0 );
+			if( negative )
+				*--c = '-';
+
+			char* out = this->text[ p ] + this->length[ p ];
+			for( int pad = this->width - (int)( end - c ); pad > 0; pad-- )
+				*out++ = ' ';
+			out = copy( c, end, out );
+			this->length[ p ] = out - this->text[ p ];
+			return true;
+		} //}}}
+
+		/**
+		 * Makes sure a piece has room for some more characters.
+		 * @param p : which piece
+		 * @param chars : characters that must fit after its text
+		 */
+		void reserve( unsigned int p, size_t chars )
+		{ //{{{
+			if( this->capacity[ p ] - this->length[ p ] >= chars )
+				return;
+
+			size_t nCapacity = 2 * this->capacity[ p ] + 256;
+			if( nCapacity < this->length[ p ] + chars )
+				nCapacity = this->length[ p ] + chars;
+			char* nText = new char[ nCapacity ];
+			copy( this->text[ p ], this->text[ p ] + this->length[ p ], nText );
+			delete[] this->text[ p ];
+			this->text[ p ] = nText;
+			this->capacity[ p ] = nCapacity;
+		} //}}}
+
+		/// Arrays of x, y, m, fx and fy to save.
+		const Real* const* fields;
+		unsigned int size;
+		int precision;
+		int width;
+		/// 10 to the precision, 0 if too many digits for appendFixed().
+		unsigned long long scale;
+		unsigned int pieces;
+		/// First particle of this round.
+		unsigned int first;
+		/// Text of each piece, its length and the room it has.
+		char** text;
+		size_t* length;
+		size_t* capacity;
+
+		TextSaveTask( const TextSaveTask& rhs );
+		TextSaveTask& operator=( const TextSaveTask& rhs );
+};
+
 ParticleSystem::ParticleSystem() :
 	mSize( 0 ), //{{{
-	mParticles( NULL ),
-	minXP( NULL ),
-	maxXP( NULL ),
-	minYP( NULL ),
-	maxYP( NULL )
+	mData( NULL ),
+	mX( NULL ),
+	mY( NULL ),
+	mM( NULL ),
+	mFX( NULL ),
+	mFY( NULL ),
+	mVX( NULL ),
+	mVY( NULL ),
+	mCost( NULL ),
+	mMap( NULL ),
+	mMapLength( 0 ),
+	mLeft( 0 ),
+	mRight( 0 ),
+	mBottom( 0 ),
+	mTop( 0 )
 {
 } //}}}
 
 ParticleSystem::ParticleSystem( string fileName, bool hasForces ) :
 	mSize( 0 ), //{{{
-	mParticles( NULL ),
-	minXP( NULL ),
-	maxXP( NULL ),
-	minYP( NULL ),
-	maxYP( NULL )
+	mData( NULL ),
+	mX( NULL ),
+	mY( NULL ),
+	mM( NULL ),
+	mFX( NULL ),
+	mFY( NULL ),
+	mVX( NULL ),
+	mVY( NULL ),
+	mCost( NULL ),
+	mMap( NULL ),
+	mMapLength( 0 ),
+	mLeft( 0 ),
+	mRight( 0 ),
+	mBottom( 0 ),
+	mTop( 0 )
 {
 	this->load( fileName, hasForces );
 } //}}}
 
 ParticleSystem::ParticleSystem( const ParticleSystem& rhs ) :
 	mSize( 0 ), //{{{
-	mParticles( NULL ),
-	minXP( NULL ),
-	maxXP( NULL ),
-	minYP( NULL ),
-	maxYP( NULL )
+	mData( NULL ),
+	mX( NULL ),
+	mY( NULL ),
+	mM( NULL ),
+	mFX( NULL ),
+	mFY( NULL ),
+	mVX( NULL ),
+	mVY( NULL ),
+	mCost( NULL ),
+	mMap( NULL ),
+	mMapLength( 0 ),
+	mLeft( 0 ),
+	mRight( 0 ),
+	mBottom( 0 ),
+	mTop( 0 )
 {
 	(*this) = rhs;
 } //}}}
@@ -77,152 +724,522 @@ ParticleSystem& ParticleSystem::operator=( const ParticleSystem& rhs )
 	if( this == &rhs )
 		return (*this);
 
-	if( this->mSize != rhs.mSize )
+	if(( this->mSize != rhs.mSize ) || ( this->mMap != NULL ))
+		this->allocate( rhs.mSize );
+
+	// Positions and masses may be mapped from a file, away from the rest
+	copy( rhs.mX, rhs.mX + rhs.mSize, this->mX );
+	copy( rhs.mY, rhs.mY + rhs.mSize, this->mY );
+	copy( rhs.mM, rhs.mM + rhs.mSize, this->mM );
+	copy( rhs.mFX, rhs.mFX + ( FIELDS - POSITION_FIELDS ) * rhs.mSize,
+			this->mFX );
+	copy( rhs.mCost, rhs.mCost + rhs.mSize, this->mCost );
+	this->mLeft = rhs.mLeft;
+	this->mRight = rhs.mRight;
+	this->mBottom = rhs.mBottom;
+	this->mTop = rhs.mTop;
+
+	return (*this);
+} //}}}
+
+void ParticleSystem::load( string fileName, bool hasForces )
+{ //{{{
+	if( CompressedReader::detect( fileName ) != COMPRESSION_NONE )
 	{
-		this->clear();
-		this->mSize = rhs.mSize;
-		this->mParticles = new Particle*[ this->mSize ];
-		for( unsigned int i = 0; i < this->mSize; i++ )
-			this->mParticles[ i ] = new Particle();
+		this->loadCompressed( fileName, hasForces );
+		return;
 	}
 
-	for( unsigned int i = 0; i < this->mSize; i++ )
+	if( ParticleSystem::isBinary( fileName ))
 	{
-		this->mParticles[ i ]->x = rhs.mParticles[ i ]->x;
-		this->mParticles[ i ]->y = rhs.mParticles[ i ]->y;
-		this->mParticles[ i ]->m = rhs.mParticles[ i ]->m;
-		this->mParticles[ i ]->fx = rhs.mParticles[ i ]->fx;
-		this->mParticles[ i ]->fy = rhs.mParticles[ i ]->fy;
-
-		if((this->minXP == NULL) || ( this->mParticles[ i ]->x < this->minXP->x ))
-			this->minXP = this->mParticles[ i ];
-		if((this->maxXP == NULL) || ( this->mParticles[ i ]->x > this->maxXP->x ))
-			this->maxXP = this->mParticles[ i ];
-		if((this->minYP == NULL) || ( this->mParticles[ i ]->y < this->minYP->y ))
-			this->minYP = this->mParticles[ i ];
-		if((this->maxYP == NULL) || ( this->mParticles[ i ]->y > this->maxYP->y ))
-			this->maxYP = this->mParticles[ i ];
+		this->loadBinary( fileName, hasForces );
+		return;
 	}
 
-	return (*this);
+	this->loadText( fileName, hasForces );
 } //}}}
 
-void ParticleSystem::load( string fileName, bool hasForces )
+void ParticleSystem::loadText( string fileName, bool hasForces )
 { //{{{
-	ifstream file( fileName.c_str() );
+	this->clear();
+
+	// Read the whole file in one go, ended with a 0 so parsing a number can
+	// never run off the end {{{
+	ifstream file( fileName.c_str(), ifstream::binary );
 	if( !file.good() )
 	{
 		cerr << "ParticleSystem was passed bad file\n";
 		return;
 	}
-
-	string line;
-	while( !file.eof() )
+	file.seekg( 0, ifstream::end );
+	size_t length = file.tellg();
+	file.seekg( 0, ifstream::beg );
+	char* text = new char[ length + 1 ];
+	file.read( text, length );
+	if( (size_t)file.gcount() != length )
 	{
-		getline( file, line );
-		this->mSize++;
+		cerr << "Could not read all of " << fileName << "\n";
+		delete[] text;
+		return;
 	}
-	this->mSize--;
+	text[ length ] = '\0';
+	file.close(); //}}}
 
-	file.close();
-	file.open( fileName.c_str() );
-	this->mParticles = new Particle*[ this->mSize ];
-	for( unsigned int i = 0; i < this->mSize; i++ )
+	unsigned int lines = 0;
+	this->parseText( text, length, fileName, hasForces, 0, lines );
+	delete[] text;
+} //}}}
+
+void ParticleSystem::loadCompressed( string fileName, bool hasForces )
+{ //{{{
+	this->clear();
+
+	vector< ParticleSystem* > parts;
+	ParticleStream stream( fileName, COMPRESSED_CHUNK_PARTICLES, hasForces );
+	parts.push_back( new ParticleSystem() );
+	while( stream.next( *( parts.back() )))
+		parts.push_back( new ParticleSystem() );
+	bool good = !stream.failed();
+
+	// Put the parts together, joining their bounds {{{
+	unsigned int particles = 0;
+	for( unsigned int p = 0; p < parts.size(); p++ )
+		particles += parts[ p ]->mSize;
+	if( good && ( particles > 0 ))
 	{
-		this->mParticles[ i ] = new Particle();
+		this->allocate( particles );
+		unsigned int next = 0;
+		for( unsigned int p = 0; p < parts.size(); p++ )
+		{
+			const ParticleSystem& part = *( parts[ p ] );
+			if( part.mSize == 0 )
+				continue;
+
+			copy( part.mX, part.mX + part.mSize, this->mX + next );
+			copy( part.mY, part.mY + part.mSize, this->mY + next );
+			copy( part.mM, part.mM + part.mSize, this->mM + next );
+			copy( part.mFX, part.mFX + part.mSize, this->mFX + next );
+			copy( part.mFY, part.mFY + part.mSize, this->mFY + next );
+			if(( next == 0 ) || ( part.mLeft < this->mLeft ))
+				this->mLeft = part.mLeft;
+			if(( next == 0 ) || ( part.mRight > this->mRight ))
+				this->mRight = part.mRight;
+			if(( next == 0 ) || ( part.mBottom < this->mBottom ))
+				this->mBottom = part.mBottom;
+			if(( next == 0 ) || ( part.mTop > this->mTop ))
+				this->mTop = part.mTop;
+			next += part.mSize;
+		}
 	}
+	for( unsigned int p = 0; p < parts.size(); p++ )
+		delete parts[ p ]; //}}}
+} //}}}
 
-	for( unsigned int l = 0; l < this->mSize; l++ )
+bool ParticleSystem::parseText( const char* text, size_t length,
+		string fileName, bool hasForces, unsigned int firstLine,
+		unsigned int& lines )
+{ //{{{
+	this->clear();
+
+	// Split it into pieces starting at the start of a line {{{
+	unsigned int pieces = 1;
+	if( length / TEXT_PIECE_BYTES > 1 )
+	{
+		pieces = 4 * ThreadPool::instance()->getSize();
+		if( pieces > length / TEXT_PIECE_BYTES )
+			pieces = length / TEXT_PIECE_BYTES;
+	}
+	TextPiece* piece = new TextPiece[ pieces ];
+	const char* start = text;
+	for( unsigned int p = 0; p < pieces; p++ )
 	{
-		file >> this->mParticles[ l ]->x;
-		file >> this->mParticles[ l ]->y;
-		file >> this->mParticles[ l ]->m;
-		if( hasForces )
+		const char* end = text + length;
+		if( p + 1 < pieces )
 		{
-			file >> this->mParticles[ l ]->fx;
-			file >> this->mParticles[ l ]->fy;
+			end = text + length / pieces * ( p + 1 );
+			if( end < start )
+				end = start;
+			const char* newline = (const char*)memchr( end, '\n',
+					text + length - end );
+			end = ( newline == NULL ) ? text + length : newline + 1;
 		}
+		piece[ p ].begin = start;
+		piece[ p ].end = end;
+		start = end;
+	} //}}}
 
-		if( !file.good() )
+	// Parse every piece in one go, then put the pieces together
+	unsigned int fields = hasForces ? 5 : 3;
+	TextLoadTask task( piece, fields );
+	ThreadPool::instance()->run( &task, 0, pieces, 0, 1 );
+
+	// Report the first bad line {{{
+	unsigned int particles = 0;
+	lines = 0;
+	for( unsigned int p = 0; p < pieces; p++ )
+	{
+		piece[ p ].firstLine = lines;
+		lines += piece[ p ].lines;
+		if( piece[ p ].problem != NULL )
 		{
-			cerr << "Error loading on " << fileName << " on line " << l + 1 << "\n";
-			this->clear();
-			return;
+			cerr << "Error loading on " << fileName << " on line "
+				<< firstLine + piece[ p ].firstLine + piece[ p ].badLine + 1
+				<< ": " << piece[ p ].problem << "\n";
+			delete[] piece;
+			return false;
 		}
+		particles += piece[ p ].values[ 0 ].size();
+	} //}}}
 
-		if((this->minXP == NULL) || ( this->mParticles[ l ]->x < this->minXP->x ))
-			this->minXP = this->mParticles[ l ];
-		if((this->maxXP == NULL) || ( this->mParticles[ l ]->x > this->maxXP->x ))
-			this->maxXP = this->mParticles[ l ];
-		if((this->minYP == NULL) || ( this->mParticles[ l ]->y < this->minYP->y ))
-			this->minYP = this->mParticles[ l ];
-		if((this->maxYP == NULL) || ( this->mParticles[ l ]->y > this->maxYP->y ))
-			this->maxYP = this->mParticles[ l ];
-	}
+	// Put the pieces together, joining their bounds {{{
+	this->allocate( particles );
+	unsigned int next = 0;
+	for( unsigned int p = 0; p < pieces; p++ )
+	{
+		const TextPiece& part = piece[ p ];
+		if( part.values[ 0 ].empty() )
+			continue;
 
+		for( unsigned int f = 0; f < fields; f++ )
+			copy( part.values[ f ].begin(), part.values[ f ].end(),
+					this->mData + f * particles + next );
+		if(( next == 0 ) || ( part.left < this->mLeft ))
+			this->mLeft = part.left;
+		if(( next == 0 ) || ( part.right > this->mRight ))
+			this->mRight = part.right;
+		if(( next == 0 ) || ( part.bottom < this->mBottom ))
+			this->mBottom = part.bottom;
+		if(( next == 0 ) || ( part.top > this->mTop ))
+			this->mTop = part.top;
+		next += part.values[ 0 ].size();
+	} //}}}
+	delete[] piece;
+	return true;
+} //}}}
+
+void ParticleSystem::save( string fileName, unsigned int precision )
+{ //{{{
+	CompressedWriter file( fileName, CompressedReader::fromName( fileName ));
+	this->write( file, precision );
 	file.close();
 } //}}}
 
-void ParticleSystem::save( string fileName )
+void ParticleSystem::write( CompressedWriter& file, unsigned int precision )
+{ //{{{
+	// Format a round of pieces at once, then hand them to the writer in
+	// order, so only a few rounds of text are ever held
+	ThreadPool* pool = ThreadPool::instance();
+	unsigned int pieces = 4 * pool->getSize();
+	const Real* fields[ 5 ] =
+		{ this->mX, this->mY, this->mM, this->mFX, this->mFY };
+	TextSaveTask task( fields, this->mSize, precision, pieces );
+	for( unsigned int first = 0; first < this->mSize;
+			first += pieces * SAVE_PIECE_PARTICLES )
+	{
+		task.setFirst( first );
+		pool->run( &task, 0, pieces, 0, 1 );
+		for( unsigned int p = 0; p < pieces; p++ )
+			file.write( task.getText( p ), task.getLength( p ));
+	}
+} //}}}
+
+bool ParticleSystem::isBinary( string fileName )
+{ //{{{
+	ifstream file( fileName.c_str(), ifstream::binary );
+	char magic[ sizeof( BINARY_MAGIC ) ];
+	if( !file.read( magic, sizeof( magic )))
+		return false;
+	return memcmp( magic, BINARY_MAGIC, sizeof( magic )) == 0;
+} //}}}
+
+void ParticleSystem::loadBinary( string fileName, bool hasForces )
+{ //{{{
+	this->clear();
+
+	int fd = open( fileName.c_str(), O_RDONLY );
+	struct stat info;
+	if(( fd < 0 ) || ( fstat( fd, &info ) != 0 ) ||
+		( (size_t)info.st_size < sizeof( BinaryHeader )))
+	{
+		cerr << "ParticleSystem was passed bad file\n";
+		if( fd >= 0 )
+			close( fd );
+		return;
+	}
+
+	// Private so moving particles later copies the pages they are on
+	// instead of writing to the file
+	size_t length = info.st_size;
+	void* map = mmap( NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			fd, 0 );
+	close( fd );
+	if( map == MAP_FAILED )
+	{
+		cerr << "Could not map " << fileName << " into memory\n";
+		return;
+	}
+
+	BinaryHeader header;
+	memcpy( &header, map, sizeof( header ));
+	const char* problem = checkBinary( header, length, hasForces );
+	if( problem != NULL )
+	{
+		cerr << "Error loading " << fileName << ": it " << problem << "\n";
+		munmap( map, length );
+		return;
+	}
+
+	const char* arrays[ BINARY_FIELDS ];
+	findBinaryArrays( header, map, arrays );
+
+	unsigned int count = header.count;
+	if(( header.realType == BINARY_REAL ) && ( header.realBytes == sizeof( Real )))
+	{
+		this->allocate( count, false );
+		this->mX = (Real*)arrays[ 0 ];
+		this->mY = (Real*)arrays[ 1 ];
+		this->mM = (Real*)arrays[ 2 ];
+		this->mMap = map;
+		this->mMapLength = length;
+	}
+	else
+	{
+		this->allocate( count );
+		convertReals( arrays[ 0 ], header.realType, header.realBytes, count,
+				this->mX );
+		convertReals( arrays[ 1 ], header.realType, header.realBytes, count,
+				this->mY );
+		convertReals( arrays[ 2 ], header.realType, header.realBytes, count,
+				this->mM );
+	}
+	if( hasForces )
+	{
+		convertReals( arrays[ 3 ], header.realType, header.realBytes, count,
+				this->mFX );
+		convertReals( arrays[ 4 ], header.realType, header.realBytes, count,
+				this->mFY );
+	}
+	if( this->mMap == NULL )
+		munmap( map, length );
+
+	this->recalculateBounds();
+} //}}}
+
+bool ParticleSystem::saveBinary( string fileName, bool withForces )
 { //{{{
-	ofstream file( fileName.c_str() );
+	ofstream file( fileName.c_str(), ofstream::binary );
 	if( !file.good() )
 	{
 		cerr << "Could not save to file\n";
-		return;
+		return false;
 	}
 
-	for( unsigned int i = 0; i < this->mSize; ++i )
+	BinaryHeader header;
+	memset( &header, 0, sizeof( header ));
+	memcpy( header.magic, BINARY_MAGIC, sizeof( header.magic ));
+	header.version = BINARY_VERSION;
+	header.byteOrder = BINARY_BYTE_ORDER;
+	header.realType = BINARY_REAL;
+	header.realBytes = sizeof( Real );
+	header.fields = FIELD_X | FIELD_Y | FIELD_M;
+	if( withForces )
+		header.fields |= FIELD_FX | FIELD_FY;
+	header.count = this->mSize;
+	header.dataOffset = ( sizeof( header ) + BINARY_ALIGN - 1 ) /
+		BINARY_ALIGN * BINARY_ALIGN;
+
+	const char padding[ BINARY_ALIGN ] = { 0 };
+	file.write( (const char*)&header, sizeof( header ));
+	file.write( padding, header.dataOffset - sizeof( header ));
+
+	const Real* arrays[ BINARY_FIELDS ] =
+		{ this->mX, this->mY, this->mM, this->mFX, this->mFY };
+	uint64_t bytes = header.count * header.realBytes;
+	for( unsigned int f = 0; f < BINARY_FIELDS; f++ )
 	{
-		file
-			<< fixed << setprecision( 4 ) << setw( 8 ) << this->mParticles[ i ]->x << "\t"
-			<< fixed << setprecision( 4 ) << setw( 8 ) << this->mParticles[ i ]->y << "\t"
-			<< fixed << setprecision( 4 ) << setw( 8 ) << this->mParticles[ i ]->m << "\t"
-			<< fixed << setprecision( 4 ) << setw( 8 ) << this->mParticles[ i ]->fx << "\t"
-			<< fixed << setprecision( 4 ) << setw( 8 ) << this->mParticles[ i ]->fy << "\n";
+		if( !( header.fields & ( 1U << f )))
+			continue;
+		file.write( (const char*)arrays[ f ], bytes );
+		file.write( padding, binaryStride( header ) - bytes );
 	}
 
-	file.close();
+	if( !file.good() )
+	{
+		cerr << "Could not save to file\n";
+		return false;
+	}
+	return true;
 } //}}}
 
 void ParticleSystem::clear()
 { //{{{
-	if( this->mSize < 1 )
+	if( this->mMap != NULL )
+		munmap( this->mMap, this->mMapLength );
+	this->mMap = NULL;
+	this->mMapLength = 0;
+	delete[] this->mData;
+	this->mData = NULL;
+	delete[] this->mCost;
+	this->mCost = NULL;
+	this->mX = this->mY = this->mM = NULL;
+	this->mFX = this->mFY = NULL;
+	this->mVX = this->mVY = NULL;
+	this->mLeft = this->mRight = 0;
+	this->mBottom = this->mTop = 0;
+	this->mSize = 0;
+} //}}}
+
+void ParticleSystem::zeroForces()
+{ //{{{
+	fill( this->mFX, this->mFX + this->mSize, (Real)0 );
+	fill( this->mFY, this->mFY + this->mSize, (Real)0 );
+} //}}}
+
+unsigned int ParticleSystem::getSize() const
+{ //{{{
+	return this->mSize;
+} //}}}
+
+Particle ParticleSystem::getParticle( unsigned int indice ) const
+{ //{{{
+	Particle p;
+	if( indice >= this->mSize )
+		return p;
+
+	p.x = this->mX[ indice ];
+	p.y = this->mY[ indice ];
+	p.m = this->mM[ indice ];
+	p.fx = this->mFX[ indice ];
+	p.fy = this->mFY[ indice ];
+	return p;
+} //}}}
+
+void ParticleSystem::setParticle( unsigned int indice, const Particle& p )
+{ //{{{
+	if( indice >= this->mSize )
 		return;
 
+	this->mX[ indice ] = p.x;
+	this->mY[ indice ] = p.y;
+	this->mM[ indice ] = p.m;
+	this->mFX[ indice ] = p.fx;
+	this->mFY[ indice ] = p.fy;
+
+	if( p.x < this->mLeft )
+		this->mLeft = p.x;
+	if( p.x > this->mRight )
+		this->mRight = p.x;
+	if( p.y < this->mBottom )
+		this->mBottom = p.y;
+	if( p.y > this->mTop )
+		this->mTop = p.y;
+} //}}}
+
+Real ParticleSystem::getX( unsigned int indice ) const
+{ //{{{
+	return this->mX[ indice ];
+} //}}}
+
+Real ParticleSystem::getY( unsigned int indice ) const
+{ //{{{
+	return this->mY[ indice ];
+} //}}}
+
+Real ParticleSystem::getMass( unsigned int indice ) const
+{ //{{{
+	return this->mM[ indice ];
+} //}}}
+
+Real ParticleSystem::getFX( unsigned int indice ) const
+{ //{{{
+	return this->mFX[ indice ];
+} //}}}
+
+Real ParticleSystem::getFY( unsigned int indice ) const
+{ //{{{
+	return this->mFY[ indice ];
+} //}}}
+
+void ParticleSystem::addForce( unsigned int indice, Real fx, Real fy )
+{ //{{{
+	this->mFX[ indice ] += fx;
+	this->mFY[ indice ] += fy;
+} //}}}
+
+Real ParticleSystem::getVX( unsigned int indice ) const
+{ //{{{
+	return this->mVX[ indice ];
+} //}}}
+
+Real ParticleSystem::getVY( unsigned int indice ) const
+{ //{{{
+	return this->mVY[ indice ];
+} //}}}
+
+void ParticleSystem::setVelocity( unsigned int indice,
+		Real vx, Real vy )
+{ //{{{
+	this->mVX[ indice ] = vx;
+	this->mVY[ indice ] = vy;
+} //}}}
+
+void ParticleSystem::kick( Real dt )
+{ //{{{
 	for( unsigned int i = 0; i < this->mSize; i++ )
 	{
-		delete[] this->mParticles[ i ];
+		// Forces scale with the particle's own mass, so a massless particle
+		// feels nothing and keeps its velocity
+		if( fabs( this->mM[ i ] ) < numeric_limits<Real>::epsilon() )
+			continue;
+
+		this->mVX[ i ] += this->mFX[ i ] / this->mM[ i ] * dt;
+		this->mVY[ i ] += this->mFY[ i ] / this->mM[ i ] * dt;
 	}
-	delete[] this->mParticles;
-	this->mParticles = NULL;
-	this->minXP = NULL;
-	this->maxXP = NULL;
-	this->minYP = NULL;
-	this->maxYP = NULL;
-	this->mSize = 0;
 } //}}}
 
-void ParticleSystem::zeroForces()
+void ParticleSystem::drift( Real dt )
 { //{{{
 	for( unsigned int i = 0; i < this->mSize; i++ )
 	{
-		this->mParticles[ i ]->fx = 0;
-		this->mParticles[ i ]->fy = 0;
+		this->mX[ i ] += this->mVX[ i ] * dt;
+		this->mY[ i ] += this->mVY[ i ] * dt;
 	}
+	this->recalculateBounds();
 } //}}}
 
-unsigned int ParticleSystem::getSize() const
+unsigned int ParticleSystem::getCost( unsigned int indice ) const
 { //{{{
-	return this->mSize;
+	return this->mCost[ indice ];
 } //}}}
 
-Particle* ParticleSystem::getParticle( unsigned int indice ) const
+void ParticleSystem::setCost( unsigned int indice, unsigned int cost )
 { //{{{
-	if( indice >= this->mSize )
-		return NULL;
+	this->mCost[ indice ] = cost;
+} //}}}
 
-	return this->mParticles[ indice ];
+const Real* ParticleSystem::getXs() const
+{ //{{{
+	return this->mX;
+} //}}}
+
+const Real* ParticleSystem::getYs() const
+{ //{{{
+	return this->mY;
+} //}}}
+
+const Real* ParticleSystem::getMasses() const
+{ //{{{
+	return this->mM;
+} //}}}
+
+Real* ParticleSystem::getFXs()
+{ //{{{
+	return this->mFX;
+} //}}}
+
+Real* ParticleSystem::getFYs()
+{ //{{{
+	return this->mFY;
 } //}}}
 
 ostream& operator<<( ostream& out, const ParticleSystem& toPrint )
@@ -230,37 +1247,310 @@ ostream& operator<<( ostream& out, const ParticleSystem& toPrint )
 	out << "<-- ParticleSystem -->\n";
 	out << "this->mSize = " << toPrint.getSize() << "\n";
 	for( unsigned int i = 0; i < toPrint.getSize(); i++ )
-	{
-		Particle* p = toPrint.getParticle( i );
-		if( p != NULL )
-			out << *p << "\n";
-	}
+		out << toPrint.getParticle( i ) << "\n";
 	out << "<-- ParticleSystem -->\n";
+	return out;
 } //}}}
 
-long double ParticleSystem::getLeft() const
+Real ParticleSystem::getLeft() const
 { //{{{
-	return this->minXP->x;
+	return this->mLeft;
 } //}}}
 
-long double ParticleSystem::getRight() const
+Real ParticleSystem::getRight() const
 { //{{{
-	return this->maxXP->x;
+	return this->mRight;
 } //}}}
 
-long double ParticleSystem::getBottom() const
+Real ParticleSystem::getBottom() const
 { //{{{
-	return this->minYP->y;
+	return this->mBottom;
 } //}}}
 
-long double ParticleSystem::getTop() const
+Real ParticleSystem::getTop() const
 { //{{{
-	return this->maxYP->y;
+	return this->mTop;
+} //}}}
+
+Real ParticleSystem::getLargestBound() const
+{ //{{{
+	Real scale = 1.0;
+	if( fabs( this->mLeft ) > scale )
+		scale = fabs( this->mLeft );
+	if( fabs( this->mRight ) > scale )
+		scale = fabs( this->mRight );
+	if( fabs( this->mBottom ) > scale )
+		scale = fabs( this->mBottom );
+	if( fabs( this->mTop ) > scale )
+		scale = fabs( this->mTop );
+	return scale;
 } //}}}
 
 void ParticleSystem::printDimensions() const
 { //{{{
-	cout << "\t[" << this->minXP->x << ", " << this->maxXP->x << "] ["
-		<< this->minYP->y << ", " << this->maxYP->y << "]\n";
+	cout << "\t[" << this->mLeft << ", " << this->mRight << "] ["
+		<< this->mBottom << ", " << this->mTop << "]\n";
+} //}}}
+
+void ParticleSystem::allocate( unsigned int nSize, bool positions )
+{ //{{{
+	this->clear();
+	if( nSize < 1 )
+		return;
+
+	unsigned int fields = positions ? FIELDS : FIELDS - POSITION_FIELDS;
+	this->mSize = nSize;
+	this->mData = new Real[ fields * this->mSize ];
+	fill( this->mData, this->mData + fields * this->mSize, (Real)0 );
+	this->mFX = this->mData;
+	if( positions )
+	{
+		this->mX = this->mData;
+		this->mY = this->mX + this->mSize;
+		this->mM = this->mY + this->mSize;
+		this->mFX = this->mM + this->mSize;
+	}
+	this->mFY = this->mFX + this->mSize;
+	this->mVX = this->mFY + this->mSize;
+	this->mVY = this->mVX + this->mSize;
+
+	this->mCost = new unsigned int[ this->mSize ];
+	fill( this->mCost, this->mCost + this->mSize, 0U );
 } //}}}
 
+void ParticleSystem::recalculateBounds()
+{ //{{{
+	if( this->mSize < 1 )
+		return;
+
+	this->mLeft = this->mRight = this->mX[ 0 ];
+	this->mBottom = this->mTop = this->mY[ 0 ];
+	for( unsigned int i = 1; i < this->mSize; i++ )
+	{
+		if( this->mX[ i ] < this->mLeft )
+			this->mLeft = this->mX[ i ];
+		if( this->mX[ i ] > this->mRight )
+			this->mRight = this->mX[ i ];
+		if( this->mY[ i ] < this->mBottom )
+			this->mBottom = this->mY[ i ];
+		if( this->mY[ i ] > this->mTop )
+			this->mTop = this->mY[ i ];
+	}
+} //}}}
+
+ParticleStream::ParticleStream( string iFileName, unsigned int iChunkSize,
+		bool iHasForces ) :
+	fileName( iFileName ), //{{{
+	chunkSize( ( iChunkSize > 0 ) ? iChunkSize : 1 ),
+	hasForces( iHasForces ),
+	error( false ),
+	count( 0 ),
+	reader( NULL ),
+	text( NULL ),
+	length( 0 ),
+	capacity( 0 ),
+	scanned( 0 ),
+	newlines( 0 ),
+	lines( 0 ),
+	drained( false ),
+	map( NULL ),
+	mapLength( 0 ),
+	realType( 0 ),
+	realBytes( 0 ),
+	total( 0 )
+{
+	for( unsigned int f = 0; f < BINARY_FIELDS; f++ )
+		this->arrays[ f ] = NULL;
+
+	Compression format = CompressedReader::detect( this->fileName );
+	if(( format != COMPRESSION_NONE ) ||
+		!ParticleSystem::isBinary( this->fileName ))
+	{
+		this->reader = new CompressedReader( this->fileName, format,
+				STREAM_BLOCK_BYTES );
+		this->reader->start();
+		return;
+	}
+
+	// Map a binary file read only, so its pages can be dropped once passed {{{
+	int fd = open( this->fileName.c_str(), O_RDONLY );
+	struct stat info;
+	if(( fd < 0 ) || ( fstat( fd, &info ) != 0 ) ||
+		( (size_t)info.st_size < sizeof( BinaryHeader )))
+	{
+		cerr << "ParticleSystem was passed bad file\n";
+		if( fd >= 0 )
+			close( fd );
+		this->error = true;
+		return;
+	}
+	size_t fileLength = info.st_size;
+	void* fileMap = mmap( NULL, fileLength, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if( fileMap == MAP_FAILED )
+	{
+		cerr << "Could not map " << this->fileName << " into memory\n";
+		this->error = true;
+		return;
+	}
+	this->map = fileMap;
+	this->mapLength = fileLength;
+	madvise( this->map, this->mapLength, MADV_SEQUENTIAL ); //}}}
+
+	BinaryHeader header;
+	memcpy( &header, this->map, sizeof( header ));
+	const char* problem = checkBinary( header, this->mapLength,
+			this->hasForces );
+	if( problem != NULL )
+	{
+		cerr << "Error loading " << this->fileName << ": it " << problem
+			<< "\n";
+		this->error = true;
+		return;
+	}
+	findBinaryArrays( header, this->map, this->arrays );
+	this->realType = header.realType;
+	this->realBytes = header.realBytes;
+	this->total = header.count;
+} //}}}
+
+ParticleStream::~ParticleStream()
+{ //{{{
+	delete this->reader;
+	delete[] this->text;
+	if( this->map != NULL )
+		munmap( this->map, this->mapLength );
+} //}}}
+
+bool ParticleStream::next( ParticleSystem& chunk )
+{ //{{{
+	chunk.clear();
+	if( this->error )
+		return false;
+	if( this->reader != NULL )
+		return this->nextText( chunk );
+	return this->nextBinary( chunk );
+} //}}}
+
+bool ParticleStream::failed() const
+{ //{{{
+	return this->error;
+} //}}}
+
+unsigned int ParticleStream::getCount() const
+{ //{{{
+	return this->count;
+} //}}}
+
+bool ParticleStream::nextText( ParticleSystem& chunk )
+{ //{{{
+	// A chunk of nothing but blank lines gives no particles, so go on to
+	// the next
+	while( true )
+	{
+		// Gather blocks until there are lines enough for a chunk, or the
+		// file is used up {{{
+		while( !this->drained && ( this->newlines < this->chunkSize ))
+		{
+			size_t blockLength = 0;
+			const char* block = this->reader->next( blockLength );
+			if( block == NULL )
+			{
+				this->drained = true;
+				this->error = this->reader->failed();
+				break;
+			}
+			if( this->length + blockLength + 1 > this->capacity )
+			{
+				this->capacity = 2 * ( this->length + blockLength + 1 );
+				char* nText = new char[ this->capacity ];
+				copy( this->text, this->text + this->length, nText );
+				delete[] this->text;
+				this->text = nText;
+			}
+			copy( block, block + blockLength, this->text + this->length );
+			this->length += blockLength;
+			this->scan();
+		} //}}}
+		if( this->error || ( this->length == 0 ))
+			return false;
+
+		// Parse up to the end of the chunk's last line, then keep the rest
+		// for the next chunk {{{
+		size_t cut = ( this->newlines >= this->chunkSize ) ?
+			this->scanned : this->length;
+		char after = this->text[ cut ];
+		this->text[ cut ] = '\0';
+		unsigned int chunkLines = 0;
+		bool good = chunk.parseText( this->text, cut, this->fileName,
+				this->hasForces, this->lines, chunkLines );
+		this->text[ cut ] = after;
+		this->lines += chunkLines;
+		copy( this->text + cut, this->text + this->length, this->text );
+		this->length -= cut;
+		this->scanned = 0;
+		this->newlines = 0;
+		this->scan(); //}}}
+
+		if( !good )
+		{
+			this->error = true;
+			return false;
+		}
+		if( chunk.getSize() > 0 )
+		{
+			this->count += chunk.getSize();
+			return true;
+		}
+	}
+} //}}}
+
+bool ParticleStream::nextBinary( ParticleSystem& chunk )
+{ //{{{
+	if( this->count >= this->total )
+		return false;
+
+	unsigned int first = this->count;
+	unsigned int size = this->total - first;
+	if( size > this->chunkSize )
+		size = this->chunkSize;
+	chunk.allocate( size );
+	Real* to[ BINARY_FIELDS ] =
+		{ chunk.mX, chunk.mY, chunk.mM, chunk.mFX, chunk.mFY };
+	unsigned int fields = this->hasForces ? BINARY_FIELDS : POSITION_FIELDS;
+	for( unsigned int f = 0; f < fields; f++ )
+		convertReals( this->arrays[ f ] + (size_t)first * this->realBytes,
+				this->realType, this->realBytes, size, to[ f ] );
+	chunk.recalculateBounds();
+	this->count += size;
+
+	// Drop the pages of every array passed, so only a chunk's worth of the
+	// file is ever held {{{
+	size_t page = sysconf( _SC_PAGESIZE );
+	for( unsigned int f = 0; f < fields; f++ )
+	{
+		size_t begin = (size_t)this->arrays[ f ] / page * page;
+		size_t end = (size_t)( this->arrays[ f ] +
+				(size_t)this->count * this->realBytes ) / page * page;
+		if( end > begin )
+			madvise( (void*)begin, end - begin, MADV_DONTNEED );
+	} //}}}
+	return true;
+} //}}}
+
+void ParticleStream::scan()
+{ //{{{
+	while(( this->newlines < this->chunkSize ) &&
+		( this->scanned < this->length ))
+	{
+		const char* newline = (const char*)memchr( this->text + this->scanned,
+				'\n', this->length - this->scanned );
+		if( newline == NULL )
+		{
+			this->scanned = this->length;
+			return;
+		}
+		this->scanned = newline - this->text + 1;
+		this->newlines++;
+	}
+} //}}}
@@ -22,12 +22,27 @@
 
 #include <string>
 #include <ostream>
+#include <cstddef>
 
 #include "particle.cpp"
+#include "compressed_stream.hpp"
 
 /**
  * Utility class used for loading the descriptions of particles out of a file
  * and into memory, providing array like access.
+ *
+ * Particles are stored as a structure of arrays; x, y, m, fx, fy, vx and vy
+ * each live in their own contiguous array inside a single allocation, so loops
+ * over one field stream through memory instead of chasing a pointer per
+ * particle. Velocities are only used when stepping the system through time and
+ * are neither loaded nor saved; every particle starts at rest.
+ *
+ * Besides the text format, particles can be saved to and loaded from a
+ * binary format: a header giving the format's version, the number of
+ * particles, the precision and which fields follow, then one array per
+ * field. A binary file of the precision Real was built with is memory mapped
+ * and its positions and masses used in place, so nothing is parsed or
+ * copied up front.
  */
 class ParticleSystem
 {
@@ -63,17 +78,48 @@ class ParticleSystem
 		ParticleSystem& operator=( const ParticleSystem& rhs );
 
 		/**
-		 * Load a file into this system, trashing existing particles.
+		 * Load a file into this system, trashing existing particles. Binary
+		 * files are told apart from text files by their header, and text
+		 * files compressed with gzip or zstd by theirs.
 		 * @param fileName : filename to load from
 		 * @param hasForces : true if there are forces in the file
 		 */
 		void load( std::string fileName, bool hasForces = false );
 
 		/**
-		 * Saves to a file.
+		 * Saves to a file, one particle a line with its x, y, mass and x and
+		 * y force, in fixed notation. Lines are formatted by every thread
+		 * of the shared pool a block at a time, and written out, compressed
+		 * if the name ends in .gz or .zst, by a thread of their own while
+		 * the next block is formatted.
+		 * @param fileName : filename to save to
+		 * @param precision : digits after the decimal point; each value is
+		 * padded to 4 more characters than this
+		 */
+		void save( std::string fileName, unsigned int precision = 4 );
+
+		/**
+		 * Adds this to the end of a file being written, in the same text
+		 * format as save(), so a file can be built up from many systems.
+		 * @param file : file to write to
+		 * @param precision : digits after the decimal point
+		 */
+		void write( CompressedWriter& file, unsigned int precision = 4 );
+
+		/**
+		 * Saves to a file in the binary format, at the precision of Real.
 		 * @param fileName : filename to save to
+		 * @param withForces : true to save the forces as well
+		 * @return : true if the file was written
 		 */
-		void save( std::string fileName );
+		bool saveBinary( std::string fileName, bool withForces = false );
+
+		/**
+		 * Returns true if a file starts with the header of the binary format.
+		 * @param fileName : filename to check
+		 * @return : true if the file is binary
+		 */
+		static bool isBinary( std::string fileName );
 
 		/**
 		 * Clears all memory allocated for this.
@@ -92,11 +138,145 @@ class ParticleSystem
 		unsigned int getSize() const;
 
 		/**
-		 * Returns a long double[3] representing a particle.
-		 * @param indici : indice of particle to return
-		 * @return : long double[3] representing mParticles[indice]
+		 * Returns a copy of a particle.
+		 * @param indice : indice of particle to return
+		 * @return : copy of particle at indice, or an empty particle if out of range
+		 */
+		Particle getParticle( unsigned int indice ) const;
+
+		/**
+		 * Overwrites a particle's position, mass and force, growing the bounds
+		 * of this system if needed.
+		 * @param indice : indice of particle to overwrite
+		 * @param p : new values for particle
+		 */
+		void setParticle( unsigned int indice, const Particle& p );
+
+		/**
+		 * Returns the x coordinate of a particle.
+		 * @param indice : indice of particle
+		 * @return : x of particle
+		 */
+		Real getX( unsigned int indice ) const;
+
+		/**
+		 * Returns the y coordinate of a particle.
+		 * @param indice : indice of particle
+		 * @return : y of particle
+		 */
+		Real getY( unsigned int indice ) const;
+
+		/**
+		 * Returns the mass of a particle.
+		 * @param indice : indice of particle
+		 * @return : mass of particle
+		 */
+		Real getMass( unsigned int indice ) const;
+
+		/**
+		 * Returns the x force on a particle.
+		 * @param indice : indice of particle
+		 * @return : x force of particle
+		 */
+		Real getFX( unsigned int indice ) const;
+
+		/**
+		 * Returns the y force on a particle.
+		 * @param indice : indice of particle
+		 * @return : y force of particle
+		 */
+		Real getFY( unsigned int indice ) const;
+
+		/**
+		 * Adds to the force on a particle.
+		 * @param indice : indice of particle
+		 * @param fx : x force to add
+		 * @param fy : y force to add
+		 */
+		void addForce( unsigned int indice, Real fx, Real fy );
+
+		/**
+		 * Returns the x velocity of a particle.
+		 * @param indice : indice of particle
+		 * @return : x velocity of particle
+		 */
+		Real getVX( unsigned int indice ) const;
+
+		/**
+		 * Returns the y velocity of a particle.
+		 * @param indice : indice of particle
+		 * @return : y velocity of particle
+		 */
+		Real getVY( unsigned int indice ) const;
+
+		/**
+		 * Sets the velocity of a particle.
+		 * @param indice : indice of particle
+		 * @param vx : new x velocity
+		 * @param vy : new y velocity
+		 */
+		void setVelocity( unsigned int indice, Real vx, Real vy );
+
+		/**
+		 * Changes the velocity of every particle by the acceleration its
+		 * current force gives it over a span of time. Only the force is kept,
+		 * not the acceleration, so particles without mass are left alone
+		 * and go on in a straight line.
+		 * @param dt : span of time
+		 */
+		void kick( Real dt );
+
+		/**
+		 * Moves every particle along its velocity for a span of time, then
+		 * recomputes the bounds of this.
+		 * @param dt : span of time
+		 */
+		void drift( Real dt );
+
+		/**
+		 * Returns how many interactions the last force calculation for a
+		 * particle took.
+		 * @param indice : indice of particle
+		 * @return : interaction count, 0 if it was never calculated
+		 */
+		unsigned int getCost( unsigned int indice ) const;
+
+		/**
+		 * Records how many interactions a force calculation took.
+		 * @param indice : indice of particle
+		 * @param cost : interaction count
+		 */
+		void setCost( unsigned int indice, unsigned int cost );
+
+		/**
+		 * Returns the contiguous array of all x coordinates.
+		 * @return : array of getSize() x coordinates
+		 */
+		const Real* getXs() const;
+
+		/**
+		 * Returns the contiguous array of all y coordinates.
+		 * @return : array of getSize() y coordinates
+		 */
+		const Real* getYs() const;
+
+		/**
+		 * Returns the contiguous array of all masses.
+		 * @return : array of getSize() masses
+		 */
+		const Real* getMasses() const;
+
+		/**
+		 * Returns the contiguous array of all x forces.
+		 * @return : array of getSize() x forces
 		 */
-		Particle* getParticle( unsigned int indice ) const;
+		Real* getFXs();
+
+		/**
+		 * Returns the contiguous array of all y forces.
+		 * @return : array of getSize() y forces
+		 */
+		Real* getFYs();
 
 		/**
 		* Friend function used to print the internals of this to an ostream.
@@ -110,25 +290,39 @@ class ParticleSystem
 		 * Return the lowest x value of any particle.
 		 * @return : leftmost particle's x
 		 */
-		long double getLeft() const;
+		Real getLeft() const;
 
 		/**
 		 * Return the highest x value of any particle.
 		 * @return : rightmost particle's x
 		 */
-		long double getRight() const;
+		Real getRight() const;
 
 		/**
 		 * Return the lowest y value of any particle.
 		 * @return : bottom-most particle's y
 		 */
-		long double getBottom() const;
+		Real getBottom() const;
 
 		/**
 		 * Return the highest x valu of any particle.
 		 * @return : top-most particle's y
 		 */
-		long double getTop() const;
+		Real getTop() const;
+
+		/**
+		 * Return the largest magnitude of any side of the bounding box, and
+		 * at least 1. A tree scales its leeway by this to still push the
+		 * sides of its root past the particles at its edges, as the gap
+		 * between representable numbers grows with their magnitude.
+		 * @return : largest magnitude of any bound
+		 */
+		Real getLargestBound() const;
+
+		/**
+		 * Recomputes the bounding box of all particles.
+		 */
+		void recalculateBounds();
 
 		/**
 		 * Prints the dimensions of this to cout.
@@ -136,15 +330,179 @@ class ParticleSystem
 		void printDimensions() const;
 
 	private:
+		/**
+		 * Allocates storage for a number of zeroed particles, trashing existing
+		 * particles.
+		 * @param nSize : number of particles to make room for
+		 * @param positions : false to leave mX, mY and mM NULL for the caller
+		 * to point at storage of its own
+		 */
+		void allocate( unsigned int nSize, bool positions = true );
+
+		/**
+		 * Load a file in the text format into this system, trashing existing
+		 * particles. The file is read whole and parsed by every thread of
+		 * the shared pool, each taking a run of lines. Blank lines are
+		 * skipped, and numbers past the ones wanted on a line are ignored.
+		 * @param fileName : filename to load from
+		 * @param hasForces : true if there are forces in the file
+		 */
+		void loadText( std::string fileName, bool hasForces );
+
+		/**
+		 * Load a text file compressed with gzip or zstd into this system,
+		 * trashing existing particles. The file is gone through as a
+		 * ParticleStream, inflated by a thread of its own while the chunk
+		 * before is parsed, and the chunks joined at the end.
+		 * @param fileName : filename to load from
+		 * @param hasForces : true if there are forces in the file
+		 */
+		void loadCompressed( std::string fileName, bool hasForces );
+
+		/**
+		 * Parse text in the text format into this system, trashing existing
+		 * particles, by every thread of the shared pool.
+		 * @param text : text to parse, followed by a 0
+		 * @param length : length of text, not counting the 0
+		 * @param fileName : file the text is from, for messages
+		 * @param hasForces : true if there are forces in the text
+		 * @param firstLine : lines of the file before the text, for messages
+		 * @param lines : set to the number of lines in the text
+		 * @return : false, with a message printed, if the text is bad
+		 */
+		bool parseText( const char* text, size_t length, std::string fileName,
+				bool hasForces, unsigned int firstLine, unsigned int& lines );
+
+		/**
+		 * Load a file in the binary format into this system, trashing
+		 * existing particles.
+		 * @param fileName : filename to load from
+		 * @param hasForces : true if the forces in the file should be loaded
+		 */
+		void loadBinary( std::string fileName, bool hasForces );
+
+		friend class ParticleStream;
+
 		/// The number of particles in this system.
 		unsigned int mSize;
-		/// A Nx3 matrix representing mass and position.
-		Particle** mParticles;
+		/// One block holding the x, y, m, fx, fy, vx and vy arrays back to back.
+		Real* mData;
+		Real* mX;
+		Real* mY;
+		Real* mM;
+		Real* mFX;
+		Real* mFY;
+		Real* mVX;
+		Real* mVY;
+		/// Interactions each particle's last force calculation took.
+		unsigned int* mCost;
+		/// Binary file mapped into memory that mX, mY and mM point into, or
+		/// NULL if they are in mData.
+		void* mMap;
+		size_t mMapLength;
+
+		Real mLeft, mRight;
+		Real mBottom, mTop;
+};
+
+/**
+ * Reads a particle file a chunk of particles at a time, for files too big to
+ * load whole. Text files, compressed or not, are read by a CompressedReader
+ * while the chunk before is parsed; binary files are mapped and each chunk
+ * converted out of the map, which is let go of as it is passed.
+ */
+class ParticleStream
+{
+	public:
+		/**
+		 * Open a particle file.
+		 * @param iFileName : filename to read
+		 * @param iChunkSize : most particles in a chunk
+		 * @param iHasForces : true if there are forces in the file
+		 */
+		ParticleStream( std::string iFileName, unsigned int iChunkSize,
+				bool iHasForces = false );
+
+		/**
+		 * Stops reading and lets go of the file.
+		 */
+		~ParticleStream();
+
+		/**
+		 * Loads the next chunk of particles into a system, trashing
+		 * existing particles.
+		 * @param chunk : system to load into
+		 * @return : false, leaving chunk empty, once the file is used up or
+		 * could not be read
+		 */
+		bool next( ParticleSystem& chunk );
+
+		/**
+		 * Returns true if the file could not be read or held something
+		 * other than particles. Only meaningful once next() has returned
+		 * false.
+		 * @return : true if something went wrong
+		 */
+		bool failed() const;
+
+		/**
+		 * Returns the number of particles handed out so far.
+		 * @return : particles in every chunk so far
+		 */
+		unsigned int getCount() const;
+
+	private:
+		/**
+		 * Loads the next chunk of a text file.
+		 * @param chunk : system to load into
+		 * @return : false at the end of the file or on an error
+		 */
+		bool nextText( ParticleSystem& chunk );
+
+		/**
+		 * Loads the next chunk of a binary file.
+		 * @param chunk : system to load into
+		 * @return : false at the end of the file or on an error
+		 */
+		bool nextBinary( ParticleSystem& chunk );
+
+		/**
+		 * Counts the newlines of the text held not yet looked at, stopping
+		 * once there are enough for a chunk.
+		 */
+		void scan();
+
+		std::string fileName;
+		unsigned int chunkSize;
+		bool hasForces;
+		bool error;
+		unsigned int count;
+
+		/// Thread reading a text file, and the text read but not yet
+		/// parsed, with how much of it has been looked at for newlines and
+		/// the newlines found there.
+		CompressedReader* reader;
+		char* text;
+		size_t length;
+		size_t capacity;
+		size_t scanned;
+		unsigned int newlines;
+		/// Lines of the file already parsed, for messages.
+		unsigned int lines;
+		/// True once the reader has nothing more.
+		bool drained;
+
+		/// Binary file mapped into memory, where each field's array starts
+		/// in it, what its values are and how many there are.
+		void* map;
+		size_t mapLength;
+		const char* arrays[ 5 ];
+		unsigned int realType;
+		unsigned int realBytes;
+		unsigned int total;
 
-		Particle* minXP;
-		Particle* maxXP;
-		Particle* minYP;
-		Particle* maxYP;
+		ParticleStream( const ParticleStream& rhs );
+		ParticleStream& operator=( const ParticleStream& rhs );
 };
 
 #endif // PARTICLE_SYSTEM_HPP
@@ -25,6 +25,7 @@ using std::cerr;
 using std::cout;
 
 #include <algorithm>
+using std::copy;
 using std::swap;
 
 #include <limits>
@@ -32,18 +33,118 @@ using std::numeric_limits;
 
 #include <cmath>
 
+#include <new>
+
 static const unsigned int NOT_A_QUADRANT = 5;
-static const long double QUAD_LEEWAY = 8.0 * numeric_limits<long double>::epsilon();
+static const unsigned int NO_PARTICLE = numeric_limits<unsigned int>::max();
+static const Real QUAD_LEEWAY = 8.0 * numeric_limits<Real>::epsilon();
+/// Highest order of moments kept for each cell.
+static const unsigned int MAX_ORDER = 2;
+/// Most times a cell is halved; leaves this deep keep every particle they are
+/// given, so duplicated points can not split forever. It is capped at 32, as
+/// deep as the 64 bit Morton keys of LinearQuadtree go, and kept below the
+/// width of Real's mantissa so every halving is exact. In float that leaves
+/// the deepest cells a few ulps wide; in double and long double they are
+/// still millions of ulps wide.
+static const unsigned int MAX_DEPTH =
+	( numeric_limits<Real>::digits - 2 < 32 ) ?
+	numeric_limits<Real>::digits - 2 : 32;
+
+#if defined( __GNUC__ )
+/// Starts loading a cell that is about to be walked.
+#define QUADTREE_PREFETCH( cell ) __builtin_prefetch( cell )
+#else
+#define QUADTREE_PREFETCH( cell )
+#endif
+
+/**
+ * Two stacks of cells for a dual tree walk: those opened and still to be
+ * tested against the current cell, and those kept for the cells below it.
+ */
+struct Quadtree::DualWalk
+{
+	DualWalk() :
+		kept( NULL ), //{{{
+		keptCount( 0 ),
+		keptCapacity( 0 ),
+		pending( NULL ),
+		pendingCount( 0 ),
+		pendingCapacity( 0 )
+	{
+	} //}}}
+
+	~DualWalk()
+	{ //{{{
+		delete[] this->kept;
+		delete[] this->pending;
+	} //}}}
+
+	/**
+	 * Adds a cell to the end of a stack, growing it if it is full.
+	 * @param cells : stack to add to
+	 * @param count : number of cells in that stack
+	 * @param capacity : room in that stack
+	 * @param cell : cell to add
+	 */
+	static void push( const Quadtree**& cells, unsigned int& count,
+			unsigned int& capacity, const Quadtree* cell )
+	{ //{{{
+		if( count == capacity )
+		{
+			capacity = ( capacity < 16 ) ? 16 : 2 * capacity;
+			const Quadtree** nCells = new const Quadtree*[ capacity ];
+			copy( cells, cells + count, nCells );
+			delete[] cells;
+			cells = nCells;
+		}
+		cells[ count++ ] = cell;
+	} //}}}
+
+	void keep( const Quadtree* cell )
+	{ //{{{
+		push( this->kept, this->keptCount, this->keptCapacity, cell );
+	} //}}}
+
+	void open( const Quadtree* cell )
+	{ //{{{
+		push( this->pending, this->pendingCount, this->pendingCapacity, cell );
+	} //}}}
+
+	/// Cells handed down, each cell's share following its parent's.
+	const Quadtree** kept;
+	unsigned int keptCount;
+	unsigned int keptCapacity;
+	/// Cells still to be tested against the current cell.
+	const Quadtree** pending;
+	unsigned int pendingCount;
+	unsigned int pendingCapacity;
 
-Quadtree::Quadtree(long double iL, long double iR,
-		long double iB, long double iT, Particle* iMe) :
+	private:
+		DualWalk( const DualWalk& rhs );
+		DualWalk& operator=( const DualWalk& rhs );
+};
+
+Quadtree::Quadtree(Real iL, Real iR,
+		Real iB, Real iT, ParticleSystem* iPS, NodeArena* iArena,
+		unsigned int iLeafCapacity) :
 	left( iL ), //{{{
 	right( iR ),
 	top( iT ),
 	bottom( iB ),
 	tau( 0.5 ),
 	parent( false ),
-	me( iMe ),
+	me(),
+	pos(),
+	neg(),
+	order( 1 ),
+	mCount( 0 ),
+	mIndices( &this->mIndex ),
+	mCapacity( 1 ),
+	mIndex( NO_PARTICLE ),
+	leafCapacity( (iLeafCapacity > 0) ? iLeafCapacity : 1 ),
+	depth( 0 ),
+	mPS( iPS ),
+	mArena( iArena ),
 	mChildren( NULL )
 {
 	if( this->left > this->right )
@@ -52,24 +153,37 @@ Quadtree::Quadtree(long double iL, long double iR,
 		swap( this->bottom, this->top );
 } //}}}
 
-Quadtree::Quadtree( ParticleSystem* ps ) :
+Quadtree::Quadtree( ParticleSystem* ps, NodeArena* iArena,
+		unsigned int iLeafCapacity ) :
 	left( 0 ), //{{{
 	right( 0 ),
 	top( 0 ),
 	bottom( 0 ),
 	tau( 0.5 ),
 	parent( false ),
-	me( NULL ),
+	me(),
+	pos(),
+	neg(),
+	order( 1 ),
+	mCount( 0 ),
+	mIndices( &this->mIndex ),
+	mCapacity( 1 ),
+	mIndex( NO_PARTICLE ),
+	leafCapacity( (iLeafCapacity > 0) ? iLeafCapacity : 1 ),
+	depth( 0 ),
+	mPS( ps ),
+	mArena( iArena ),
 	mChildren( NULL )
 {
 	// Figure out the sides of the Quadtree {{{
-	this->left = ps->getLeft() - QUAD_LEEWAY;
-	this->right = ps->getRight() + QUAD_LEEWAY;
-	this->bottom = ps->getBottom() - QUAD_LEEWAY;
-	this->top = ps->getTop() + QUAD_LEEWAY;
+	Real leeway = QUAD_LEEWAY * ps->getLargestBound();
+	this->left = ps->getLeft() - leeway;
+	this->right = ps->getRight() + leeway;
+	this->bottom = ps->getBottom() - leeway;
+	this->top = ps->getTop() + leeway;
 
-	long double w = this->right - this->left;
-	long double h = this->top - this->bottom;
+	Real w = this->right - this->left;
+	Real h = this->top - this->bottom;
 	if( w > h )
 	{
 		this->bottom -= (w - h)/2.0;
@@ -89,40 +203,43 @@ Quadtree::~Quadtree()
 	this->clear();
 } //}}}
 
-void Quadtree::add(Particle* node)
+void Quadtree::add( unsigned int indice )
 { //{{{
-	if( node == NULL )
+	this->insert( indice, true );
+} //}}}
+
+void Quadtree::insert( unsigned int indice, bool recalculate )
+{ //{{{
+	if(( this->mPS == NULL ) || ( indice >= this->mPS->getSize() ))
 		return;
 
-	if( this->getQuadrant( node ) == NOT_A_QUADRANT )
+	Real x = this->mPS->getX( indice ), y = this->mPS->getY( indice );
+	if( this->getQuadrant( x, y ) == NOT_A_QUADRANT )
 	{
 		cerr << "Node does not fit here\n";
 		cerr << this->left << " " << this->right << "\n"
 			<< this->bottom << " " << this->top << "\n"
-			<< (*node) << "\n";
-		return;
-	}
-
-	if( this->me == NULL )
-	{
-		this->me = node;
+			<< this->mPS->getParticle( indice ) << "\n";
 		return;
 	}
 
 	if( !this->parent )
 	{
-		this->makeChildren();
-
-		this->mChildren[ this->getQuadrant( node ) ]->add( node );
-		this->mChildren[ this->getQuadrant( this->me ) ]->add( this->me );
-
-		this->me = new Particle( 0, 0, 0 );
-		this->recalculateMe();
-		return;
+		if(( this->mCount < this->leafCapacity ) || ( this->depth >= MAX_DEPTH ))
+		{
+			this->addIndex( indice );
+			if( this->mCount == 1 )
+				this->me = Particle( x, y, this->mPS->getMass( indice ) );
+			else if( recalculate )
+				this->recalculateMe();
+			return;
+		}
+		this->split( recalculate );
 	}
+	this->mChildren[ this->getQuadrant( x, y ) ]->insert( indice, recalculate );
 
-	this->mChildren[ this->getQuadrant( node ) ]->add( node );
-	this->recalculateMe();
+	if( recalculate )
+		this->recalculateMe();
 } //}}}
 
 void Quadtree::add( ParticleSystem* ps )
@@ -130,65 +247,208 @@ void Quadtree::add( ParticleSystem* ps )
 	if( ps == NULL )
 		return;
 
+	// Place everything first, then work out centers of mass once
+	this->mPS = ps;
 	for( unsigned int i = 0; i < ps->getSize(); i++ )
-		this->add( ps->getParticle( i ) );
+		this->insert( i, false );
+	this->recalculateAll();
+} //}}}
+
+bool Quadtree::refit( Real maxMigration )
+{ //{{{
+	if( this->mPS == NULL )
+		return false;
+	if(( this->mPS->getSize() > 0 ) && (
+		( this->getQuadrant( this->mPS->getLeft(), this->mPS->getBottom() )
+			== NOT_A_QUADRANT ) ||
+		( this->getQuadrant( this->mPS->getRight(), this->mPS->getTop() )
+			== NOT_A_QUADRANT )))
+		return false;
+
+	if( maxMigration > 1.0 )
+		maxMigration = 1.0;
+	unsigned int limit = 0;
+	if( maxMigration > 0.0 )
+		limit = (unsigned int)( maxMigration * this->mPS->getSize() );
+
+	unsigned int* moved = new unsigned int[ limit ];
+	unsigned int count = 0;
+	if( !this->detachMoved( moved, count, limit ) )
+	{
+		delete[] moved;
+		return false;
+	}
+
+	for( unsigned int i = 0; i < count; i++ )
+		this->insert( moved[ i ], false );
+	delete[] moved;
+
+	this->refitMoments();
+	return true;
 } //}}}
 
 void Quadtree::clear()
 { //{{{
-	this->me = NULL;
+	this->me = Particle();
+	this->releaseIndices();
 
 	if( !this->parent )
 		return;
 
-	for( unsigned int i = 0; i < 4; ++i )
+	if( this->mArena == NULL )
 	{
-		if( this->mChildren[ i ] == NULL )
-			continue;
-		delete this->mChildren[ i ];
-		this->mChildren[ i ] = NULL;
+		for( unsigned int i = 0; i < 4; ++i )
+		{
+			if( this->mChildren[ i ] == NULL )
+				continue;
+			delete this->mChildren[ i ];
+			this->mChildren[ i ] = NULL;
+		}
+		delete[] this->mChildren;
 	}
+	this->mChildren = NULL;
 	this->parent = false;
 } //}}}
 
-void Quadtree::update( Particle* p ) const
+void Quadtree::update( unsigned int indice ) const
 { //{{{
-	if(( this->me == NULL ) || ( p == NULL ) || ( this->me == p ))
+	if(( this->mPS == NULL ) || ( indice >= this->mPS->getSize() ))
 		return;
 
-	long double dx = this->me->x - p->x;
-	long double dy = this->me->y - p->y;
-	long double d2 = dx * dx + dy * dy;
-	long double d = sqrt( d2 );
-	long double d3 = d * d2;
+	Accumulator fx = 0, fy = 0;
+	unsigned int interactions = 0;
+	this->update( this->mPS->getX( indice ), this->mPS->getY( indice ),
+			this->mPS->getMass( indice ), indice, fx, fy, interactions );
+	this->mPS->addForce( indice, fx, fy );
+	this->mPS->setCost( indice, interactions );
+} //}}}
 
-	if( !this->parent )
+void Quadtree::update( Real x, Real y, Real m,
+		unsigned int self, Accumulator& fx, Accumulator& fy,
+		unsigned int& interactions ) const
+{ //{{{
+	// Opened cells push their children last first, so they come off in the
+	// same order a recursive walk would take them. Each level below this
+	// leaves at most three siblings waiting
+	const Quadtree* stack[ 3 * MAX_DEPTH + 4 ];
+	unsigned int waiting = 0;
+	stack[ waiting++ ] = this;
+	while( waiting > 0 )
 	{
-		if( fabs( this->me->m ) < 2.0*numeric_limits<long double>::epsilon() )
-			return;
-		long double gm = p->m * this->me->m;
-		p->fx += dx * gm / d3;
-		p->fy += dy * gm / d3;
-		return;
+		const Quadtree* cell = stack[ --waiting ];
+		if(( !cell->parent ) && ( cell->mCount < 2 ))
+		{
+			if(( cell->mCount == 0 ) || ( cell->mIndex == self ) ||
+				( fabs( cell->me.m ) < 2.0*numeric_limits<Real>::epsilon() ))
+				continue;
+			Real dx = cell->me.x - x;
+			Real dy = cell->me.y - y;
+			Real d2 = dx * dx + dy * dy;
+			Real d = sqrt( d2 );
+			Real d3 = d * d2;
+			Real gm = m * cell->me.m;
+			fx += dx * gm / d3;
+			fy += dy * gm / d3;
+			interactions++;
+			continue;
+		}
+
+		if( cell->isFarFrom( x, y ))
+		{
+			cell->addForce( cell->pos, x, y, m, fx, fy, interactions );
+			cell->addForce( cell->neg, x, y, m, fx, fy, interactions );
+			continue;
+		}
+		if( !cell->parent )
+		{
+			cell->updateLeaf( x, y, m, self, fx, fy, interactions );
+			continue;
+		}
+
+		for( unsigned int c = 4; c-- > 0; )
+		{
+			QUADTREE_PREFETCH( cell->mChildren[ c ] );
+			stack[ waiting++ ] = cell->mChildren[ c ];
+		}
 	}
+} //}}}
 
-	long double s = this->right - this->left;
-	if(( fabs( this->me->m ) < 2.0*numeric_limits<long double>::epsilon() ) ||
-		( (s / d) >= this->tau ) ||
-		( this->getQuadrant( p ) != NOT_A_QUADRANT ))
+bool Quadtree::isFarFrom( Real x, Real y ) const
+{ //{{{
+	if(( x >= this->left ) && ( x < this->right ) &&
+		( y >= this->bottom ) && ( y < this->top ))
+		return false;
+
+	// A cell with no mass of either sign is opened, as there is nothing to
+	// measure the distance to
+	const Moments* parts[ 2 ] = { &this->pos, &this->neg };
+	bool any = false;
+	Real s = this->right - this->left;
+	Real s2 = s * s;
+	Real tau2 = this->tau * this->tau;
+	for( unsigned int i = 0; i < 2; i++ )
 	{
-		this->mChildren[ 0 ]->update( p );
-		this->mChildren[ 1 ]->update( p );
-		this->mChildren[ 2 ]->update( p );
-		this->mChildren[ 3 ]->update( p );
+		if( fabs( parts[ i ]->m ) < 2.0*numeric_limits<Real>::epsilon() )
+			continue;
+		Real dx = parts[ i ]->x - x;
+		Real dy = parts[ i ]->y - y;
+		if( s2 >= tau2 * ( dx * dx + dy * dy ))
+			return false;
+		any = true;
+	}
+	return any;
+} //}}}
+
+void Quadtree::addForce( const Moments& part, Real x, Real y, Real m,
+		Accumulator& fx, Accumulator& fy, unsigned int& interactions ) const
+{ //{{{
+	if( fabs( part.m ) < 2.0*numeric_limits<Real>::epsilon() )
 		return;
+
+	Real dx = part.x - x;
+	Real dy = part.y - y;
+	Real d2 = dx * dx + dy * dy;
+	Real d = sqrt( d2 );
+	Real d3 = d * d2;
+	Real gm = m * part.m;
+	fx += dx * gm / d3;
+	fy += dy * gm / d3;
+	if( this->order >= 2 )
+	{
+		// The quadrupole's part of the force, from the gradient of
+		// -(d.Q.d) / (2 |d|^5)
+		Real d5 = d3 * d2;
+		Real qdx = part.qxx * dx + part.qxy * dy;
+		Real qdy = part.qxy * dx + part.qyy * dy;
+		Real qdd = 2.5 * ( qdx * dx + qdy * dy ) / d2;
+		fx += m * ( qdd * dx - qdx ) / d5;
+		fy += m * ( qdd * dy - qdy ) / d5;
 	}
-	else
+	interactions++;
+} //}}}
+
+void Quadtree::updateLeaf( Real x, Real y, Real m,
+		unsigned int self, Accumulator& fx, Accumulator& fy,
+		unsigned int& interactions ) const
+{ //{{{
+	const Real* xs = this->mPS->getXs();
+	const Real* ys = this->mPS->getYs();
+	const Real* ms = this->mPS->getMasses();
+	for( unsigned int k = 0; k < this->mCount; k++ )
 	{
-		long double gm = p->m * this->me->m;
-		p->fx += dx * gm / d3;
-		p->fy += dy * gm / d3;
-		return;
+		unsigned int j = this->mIndices[ k ];
+		if(( j == self ) || ( fabs( ms[ j ] ) < 2.0*numeric_limits<Real>::epsilon() ))
+			continue;
+
+		Real dx = xs[ j ] - x;
+		Real dy = ys[ j ] - y;
+		Real d2 = dx * dx + dy * dy;
+		Real d = sqrt( d2 );
+		Real d3 = d * d2;
+		Real gm = m * ms[ j ];
+		fx += dx * gm / d3;
+		fy += dy * gm / d3;
+		interactions++;
 	}
 } //}}}
 
@@ -197,62 +457,354 @@ void Quadtree::update( ParticleSystem* ps ) const
 	if( ps == NULL )
 		return;
 
+	unsigned int self = NO_PARTICLE;
 	for( unsigned int i = 0; i < ps->getSize(); i++ )
-		this->update( ps->getParticle( i ) );
+	{
+		Accumulator fx = 0, fy = 0;
+		unsigned int interactions = 0;
+		if( ps == this->mPS )
+			self = i;
+		this->update( ps->getX( i ), ps->getY( i ), ps->getMass( i ),
+				self, fx, fy, interactions );
+		ps->addForce( i, fx, fy );
+		ps->setCost( i, interactions );
+	}
 } //}}}
 
-Particle* Quadtree::getMe()
+void Quadtree::updateDual( const Quadtree* source ) const
 { //{{{
-	return this->me;
+	if(( this->mPS == NULL ) || ( this->getMe() == NULL ) || ( source == NULL ))
+		return;
+
+	DualWalk walk;
+	walk.keep( source );
+	Field field;
+	field.ax = field.ay = 0;
+	field.gxx = field.gxy = field.gyy = 0;
+	field.far = 0;
+	this->walkDual( walk, 0, 1, field );
 } //}}}
 
-void Quadtree::recalculateMe()
+void Quadtree::walkDual( DualWalk& walk, unsigned int begin,
+		unsigned int end, Field field ) const
 { //{{{
-	if( !this->parent )
+	// Use the cells far enough away whole, open those bigger than this and
+	// keep the rest for this's children {{{
+	unsigned int first = walk.keptCount;
+	for( unsigned int i = begin; i < end; i++ )
+		walk.open( walk.kept[ i ] );
+	Real s = this->right - this->left;
+	while( walk.pendingCount > 0 )
+	{
+		const Quadtree* source = walk.pending[ --walk.pendingCount ];
+		if( source->getMe() == NULL )
+			continue;
+		if( this->isSeparated( source ))
+		{
+			this->addField( source, field );
+			field.far++;
+		}
+		else if( this->parent && source->parent &&
+			( source->right - source->left > s ))
+		{
+			walk.open( source->mChildren[ 0 ] );
+			walk.open( source->mChildren[ 1 ] );
+			walk.open( source->mChildren[ 2 ] );
+			walk.open( source->mChildren[ 3 ] );
+		}
+		else
+			walk.keep( source );
+	}
+	unsigned int last = walk.keptCount; //}}}
+
+	Real cx = ( this->left + this->right ) / 2.0;
+	Real cy = ( this->bottom + this->top ) / 2.0;
+	if( this->parent )
+	{
+		for( unsigned int c = 0; c < 4; c++ )
+		{
+			const Quadtree* child = this->mChildren[ c ];
+			if( child->getMe() == NULL )
+				continue;
+
+			// Move the field over to the child's center
+			Real dx = ( child->left + child->right ) / 2.0 - cx;
+			Real dy = ( child->bottom + child->top ) / 2.0 - cy;
+			Field shifted = field;
+			shifted.ax += field.gxx * dx + field.gxy * dy;
+			shifted.ay += field.gxy * dx + field.gyy * dy;
+			child->walkDual( walk, first, last, shifted );
+		}
+		walk.keptCount = first;
 		return;
+	}
 
-	this->me->x = 0; this->me->y = 0; this->me->m = 0;
-	for( unsigned int i = 0; i < 4; i++ )
+	const Real* xs = this->mPS->getXs();
+	const Real* ys = this->mPS->getYs();
+	const Real* ms = this->mPS->getMasses();
+	for( unsigned int k = 0; k < this->mCount; k++ )
+	{
+		unsigned int j = this->mIndices[ k ];
+		Real dx = xs[ j ] - cx;
+		Real dy = ys[ j ] - cy;
+		Accumulator fx = ms[ j ] *
+			( field.ax + field.gxx * dx + field.gxy * dy );
+		Accumulator fy = ms[ j ] *
+			( field.ay + field.gxy * dx + field.gyy * dy );
+		unsigned int interactions = field.far;
+		for( unsigned int i = first; i < last; i++ )
+			walk.kept[ i ]->update( xs[ j ], ys[ j ], ms[ j ], j,
+					fx, fy, interactions );
+		this->mPS->addForce( j, fx, fy );
+		this->mPS->setCost( j, interactions );
+	}
+	walk.keptCount = first;
+} //}}}
+
+bool Quadtree::isSeparated( const Quadtree* source ) const
+{ //{{{
+	if(( source->left <= this->right ) && ( this->left <= source->right ) &&
+		( source->bottom <= this->top ) && ( this->bottom <= source->top ))
+		return false;
+
+	const Moments* parts[ 2 ] = { &source->pos, &source->neg };
+	bool any = false;
+	Real cx = ( this->left + this->right ) / 2.0;
+	Real cy = ( this->bottom + this->top ) / 2.0;
+	Real s = ( this->right - this->left ) + ( source->right - source->left );
+	for( unsigned int i = 0; i < 2; i++ )
+	{
+		if( fabs( parts[ i ]->m ) < 2.0*numeric_limits<Real>::epsilon() )
+			continue;
+		Real dx = parts[ i ]->x - cx;
+		Real dy = parts[ i ]->y - cy;
+		if( s * s >= this->tau * this->tau * ( dx * dx + dy * dy ))
+			return false;
+		any = true;
+	}
+	return any;
+} //}}}
+
+void Quadtree::addField( const Quadtree* source, Field& field ) const
+{ //{{{
+	const Moments* parts[ 2 ] = { &source->pos, &source->neg };
+	for( unsigned int i = 0; i < 2; i++ )
+	{
+		const Moments& part = *parts[ i ];
+		if( fabs( part.m ) < 2.0*numeric_limits<Real>::epsilon() )
+			continue;
+
+		Real dx = part.x - ( this->left + this->right ) / 2.0;
+		Real dy = part.y - ( this->bottom + this->top ) / 2.0;
+		Real d2 = dx * dx + dy * dy;
+		Real d = sqrt( d2 );
+		Real d3 = d * d2;
+		Real d5 = d3 * d2;
+
+		field.ax += part.m * dx / d3;
+		field.ay += part.m * dy / d3;
+		field.gxx += part.m * ( 3.0 * dx * dx / d5 - 1.0 / d3 );
+		field.gxy += part.m * 3.0 * dx * dy / d5;
+		field.gyy += part.m * ( 3.0 * dy * dy / d5 - 1.0 / d3 );
+		if( source->order >= 2 )
+		{
+			Real qdx = part.qxx * dx + part.qxy * dy;
+			Real qdy = part.qxy * dx + part.qyy * dy;
+			Real qdd = 2.5 * ( qdx * dx + qdy * dy ) / d2;
+			field.ax += ( qdd * dx - qdx ) / d5;
+			field.ay += ( qdd * dy - qdy ) / d5;
+		}
+	}
+} //}}}
+
+unsigned int Quadtree::getSubtrees( const Quadtree** subtrees,
+		unsigned int levels ) const
+{ //{{{
+	if( this->getMe() == NULL )
+		return 0;
+	if(( levels == 0 ) || ( !this->parent ))
 	{
-		if( this->mChildren[ i ]->getMe() != NULL )
-			this->me->m += this->mChildren[ i ]->getMe()->m;
+		subtrees[ 0 ] = this;
+		return 1;
 	}
 
-	if( fabs( this->me->m ) < 2.0*numeric_limits<long double>::epsilon() )
+	unsigned int count = 0;
+	for( unsigned int c = 0; c < 4; c++ )
+		count += this->mChildren[ c ]->getSubtrees( subtrees + count,
+				levels - 1 );
+	return count;
+} //}}}
+
+const Particle* Quadtree::getMe() const
+{ //{{{
+	if(( !this->parent ) && ( this->mCount == 0 ))
+		return NULL;
+	return &this->me;
+} //}}}
+
+void Quadtree::recalculateMe()
+{ //{{{
+	Moments empty = { 0, 0, 0, 0, 0, 0 };
+	this->pos = this->neg = empty;
+	if( !this->parent )
+	{
+		if( this->mCount == 0 )
+		{
+			this->me = Particle();
+			return;
+		}
+		if( this->mCount == 1 )
+		{
+			this->me = Particle( this->mPS->getX( this->mIndex ),
+					this->mPS->getY( this->mIndex ),
+					this->mPS->getMass( this->mIndex ) );
+			Moments& part = ( this->me.m < 0 ) ? this->neg : this->pos;
+			part.x = this->me.x;
+			part.y = this->me.y;
+			part.m = this->me.m;
+			return;
+		}
+
+		Accumulator pm = 0, px = 0, py = 0;
+		Accumulator nm = 0, nx = 0, ny = 0;
+		for( unsigned int k = 0; k < this->mCount; k++ )
+		{
+			unsigned int j = this->mIndices[ k ];
+			Real jm = this->mPS->getMass( j );
+			if( jm < 0 )
+			{
+				nm += jm;
+				nx += this->mPS->getX( j ) * jm;
+				ny += this->mPS->getY( j ) * jm;
+			}
+			else
+			{
+				pm += jm;
+				px += this->mPS->getX( j ) * jm;
+				py += this->mPS->getY( j ) * jm;
+			}
+		}
+		this->pos.m = pm;
+		if( fabs( this->pos.m ) >= 2.0*numeric_limits<Real>::epsilon() )
+		{
+			this->pos.x = px / pm;
+			this->pos.y = py / pm;
+		}
+		this->neg.m = nm;
+		if( fabs( this->neg.m ) >= 2.0*numeric_limits<Real>::epsilon() )
+		{
+			this->neg.x = nx / nm;
+			this->neg.y = ny / nm;
+		}
+		this->recalculateNet();
+
+		if( this->order < 2 )
+			return;
+		for( unsigned int k = 0; k < this->mCount; k++ )
+		{
+			unsigned int j = this->mIndices[ k ];
+			Real jm = this->mPS->getMass( j );
+			Moments& part = ( jm < 0 ) ? this->neg : this->pos;
+			Quadtree::addQuadrupole( part, this->mPS->getX( j ) - part.x,
+					this->mPS->getY( j ) - part.y, jm );
+		}
 		return;
+	}
 
-	Particle* tChild = NULL;
-	for( unsigned int i = 0; i < 4; i++ )
+	Moments* parts[ 2 ] = { &this->pos, &this->neg };
+	for( unsigned int p = 0; p < 2; p++ )
 	{
-		tChild = this->mChildren[ i ]->getMe();
-		if( tChild != NULL )
+		Moments& part = *parts[ p ];
+		for( unsigned int i = 0; i < 4; i++ )
+		{
+			if( this->mChildren[ i ]->getMe() != NULL )
+				part.m += this->mChildren[ i ]->part( p ).m;
+		}
+
+		if( fabs( part.m ) < 2.0*numeric_limits<Real>::epsilon() )
+			continue;
+
+		for( unsigned int i = 0; i < 4; i++ )
 		{
-			this->me->x += tChild->x * tChild->m;
-			this->me->y += tChild->y * tChild->m;
+			if( this->mChildren[ i ]->getMe() == NULL )
+				continue;
+			const Moments& tChild = this->mChildren[ i ]->part( p );
+			part.x += tChild.x * tChild.m;
+			part.y += tChild.y * tChild.m;
+		}
+		part.x /= part.m;
+		part.y /= part.m;
+
+		// Each child's moment moved from its center of mass to this's
+		if( this->order < 2 )
+			continue;
+		for( unsigned int i = 0; i < 4; i++ )
+		{
+			if( this->mChildren[ i ]->getMe() == NULL )
+				continue;
+			const Moments& child = this->mChildren[ i ]->part( p );
+			part.qxx += child.qxx;
+			part.qxy += child.qxy;
+			part.qyy += child.qyy;
+			Quadtree::addQuadrupole( part, child.x - part.x,
+					child.y - part.y, child.m );
 		}
 	}
-	this->me->x /= this->me->m;
-	this->me->y /= this->me->m;
+	this->recalculateNet();
 } //}}}
 
-unsigned int Quadtree::getQuadrant( Particle* node ) const
+void Quadtree::recalculateNet()
 { //{{{
-	if( node == NULL )
-		return NOT_A_QUADRANT;
+	this->me = Particle( 0, 0, this->pos.m + this->neg.m );
+	if( fabs( this->me.m ) < 2.0*numeric_limits<Real>::epsilon() )
+		return;
+	this->me.x = ( this->pos.x * this->pos.m + this->neg.x * this->neg.m ) /
+		this->me.m;
+	this->me.y = ( this->pos.y * this->pos.m + this->neg.y * this->neg.m ) /
+		this->me.m;
+} //}}}
+
+const Quadtree::Moments& Quadtree::part( unsigned int sign ) const
+{ //{{{
+	return ( sign == 0 ) ? this->pos : this->neg;
+} //}}}
+
+void Quadtree::addQuadrupole( Moments& part, Real dx, Real dy, Real m )
+{ //{{{
+	// In plane parts of sum( m (3 d d^T - |d|^2 I) )
+	part.qxx += m * ( 2.0 * dx * dx - dy * dy );
+	part.qxy += m * 3.0 * dx * dy;
+	part.qyy += m * ( 2.0 * dy * dy - dx * dx );
+} //}}}
 
-	if(( node->x < this->left ) || ( node->x >= this->right ) ||
-		( node->y < this->bottom ) || ( node->y >= this->top ))
+void Quadtree::recalculateAll()
+{ //{{{
+	if( !this->parent )
+	{
+		this->recalculateMe();
+		return;
+	}
+
+	for( unsigned int i = 0; i < 4; i++ )
+		this->mChildren[ i ]->recalculateAll();
+	this->recalculateMe();
+} //}}}
+
+unsigned int Quadtree::getQuadrant( Real x, Real y ) const
+{ //{{{
+	if(( x < this->left ) || ( x >= this->right ) ||
+		( y < this->bottom ) || ( y >= this->top ))
 		return NOT_A_QUADRANT;
 
-	if( node->x < (this->left + this->right)/2.0 )
+	if( x < (this->left + this->right)/2.0 )
 	{
-		if( node->y < (this->top + this->bottom)/2.0 )
+		if( y < (this->top + this->bottom)/2.0 )
 			return 2;
 		return 1;
 	}
 	else
 	{
-		if( node->y < (this->top + this->bottom)/2.0 )
+		if( y < (this->top + this->bottom)/2.0 )
 			return 3;
 		return 0;
 	}
@@ -262,67 +814,221 @@ unsigned int Quadtree::getQuadrant( Particle* node ) const
 
 void Quadtree::makeChildren()
 { //{{{
-	if( this->me == NULL )
-		return;
-
 	if( this->parent )
 	{
-		for( unsigned int i = 0; i < 4; ++i )
-		{
-			delete this->mChildren[ i ];
-			this->mChildren[ i ] = NULL;
-		}
+		Particle oldMe = this->me;
+		this->clear();
+		this->me = oldMe;
 	}
 
-	this->mChildren = new Quadtree*[ 4 ];
-	long double midX = (this->left + this->right)/2.0;
-	long double midY = (this->bottom + this->top)/2.0;
-	this->mChildren[ 0 ] = new Quadtree(
+	Real midX = (this->left + this->right)/2.0;
+	Real midY = (this->bottom + this->top)/2.0;
+	this->mChildren = this->allocateChildren();
+	this->mChildren[ 0 ] = this->newChild(
 			midX, this->right,
-			midY, this->top, NULL );
-	this->mChildren[ 0 ]->setTau( this->tau );
-	this->mChildren[ 1 ] = new Quadtree(
+			midY, this->top );
+	this->mChildren[ 1 ] = this->newChild(
 			this->left, midX,
-			midY, this->top, NULL );
-	this->mChildren[ 1 ]->setTau( this->tau );
-	this->mChildren[ 2 ] = new Quadtree(
+			midY, this->top );
+	this->mChildren[ 2 ] = this->newChild(
 			this->left, midX,
-			this->bottom, midY, NULL );
-	this->mChildren[ 2 ]->setTau( this->tau );
-	this->mChildren[ 3 ] = new Quadtree(
+			this->bottom, midY );
+	this->mChildren[ 3 ] = this->newChild(
 			midX, this->right,
-			this->bottom, midY, NULL );
-	this->mChildren[ 3 ]->setTau( this->tau );
+			this->bottom, midY );
 
 	this->parent = true;
 } //}}}
 
-long double Quadtree::getLeft() const
+void Quadtree::addIndex( unsigned int indice )
+{ //{{{
+	if( this->mCount == this->mCapacity )
+	{
+		unsigned int nCapacity = (this->mCapacity < this->leafCapacity) ?
+			this->leafCapacity : 2 * this->mCapacity;
+		unsigned int* nIndices = NULL;
+		if( this->mArena == NULL )
+			nIndices = new unsigned int[ nCapacity ];
+		else
+			nIndices = static_cast<unsigned int*>(
+					this->mArena->allocate( nCapacity * sizeof( unsigned int ) ));
+		for( unsigned int k = 0; k < this->mCount; k++ )
+			nIndices[ k ] = this->mIndices[ k ];
+
+		unsigned int count = this->mCount;
+		unsigned int first = this->mIndex;
+		this->releaseIndices();
+		this->mIndices = nIndices;
+		this->mCapacity = nCapacity;
+		this->mCount = count;
+		this->mIndex = first;
+	}
+
+	if( this->mCount == 0 )
+		this->mIndex = indice;
+	this->mIndices[ this->mCount++ ] = indice;
+} //}}}
+
+void Quadtree::releaseIndices()
+{ //{{{
+	if(( this->mIndices != &this->mIndex ) && ( this->mArena == NULL ))
+		delete[] this->mIndices;
+	this->mIndices = &this->mIndex;
+	this->mCapacity = 1;
+	this->mCount = 0;
+	this->mIndex = NO_PARTICLE;
+} //}}}
+
+void Quadtree::split( bool recalculate )
+{ //{{{
+	// Take the list over before becoming a parent forgets it
+	unsigned int count = this->mCount;
+	unsigned int first = this->mIndex;
+	unsigned int* held = (this->mIndices == &this->mIndex) ?
+		&first : this->mIndices;
+	bool owned = ( held != &first ) && ( this->mArena == NULL );
+	this->mIndices = &this->mIndex;
+	this->mCapacity = 1;
+	this->mCount = 0;
+	this->mIndex = NO_PARTICLE;
+
+	this->makeChildren();
+	for( unsigned int k = 0; k < count; k++ )
+	{
+		unsigned int j = held[ k ];
+		this->mChildren[ this->getQuadrant( this->mPS->getX( j ),
+				this->mPS->getY( j )) ]->insert( j, recalculate );
+	}
+	if( owned )
+		delete[] held;
+} //}}}
+
+void Quadtree::gatherIndices( unsigned int* indices,
+		unsigned int& count ) const
+{ //{{{
+	if( !this->parent )
+	{
+		for( unsigned int k = 0; k < this->mCount; k++ )
+			indices[ count++ ] = this->mIndices[ k ];
+		return;
+	}
+	for( unsigned int i = 0; i < 4; i++ )
+		this->mChildren[ i ]->gatherIndices( indices, count );
+} //}}}
+
+bool Quadtree::detachMoved( unsigned int* moved, unsigned int& count,
+		unsigned int limit )
+{ //{{{
+	if( !this->parent )
+	{
+		unsigned int kept = 0;
+		for( unsigned int k = 0; k < this->mCount; k++ )
+		{
+			unsigned int j = this->mIndices[ k ];
+			if( this->getQuadrant( this->mPS->getX( j ), this->mPS->getY( j ))
+					!= NOT_A_QUADRANT )
+			{
+				this->mIndices[ kept++ ] = j;
+				continue;
+			}
+			if( count >= limit )
+				return false;
+			moved[ count++ ] = j;
+		}
+		this->mCount = kept;
+		this->mIndex = (kept > 0) ? this->mIndices[ 0 ] : NO_PARTICLE;
+		return true;
+	}
+
+	for( unsigned int i = 0; i < 4; i++ )
+	{
+		if( !this->mChildren[ i ]->detachMoved( moved, count, limit ) )
+			return false;
+	}
+	return true;
+} //}}}
+
+unsigned int Quadtree::refitMoments()
+{ //{{{
+	if( !this->parent )
+	{
+		this->recalculateMe();
+		return this->mCount;
+	}
+
+	unsigned int count = 0;
+	for( unsigned int i = 0; i < 4; i++ )
+		count += this->mChildren[ i ]->refitMoments();
+	if( count > this->leafCapacity )
+	{
+		this->recalculateMe();
+		return count;
+	}
+
+	// Nothing left to split, so this goes back to being a leaf like it would
+	// be in a freshly built tree
+	unsigned int* held = new unsigned int[ count + 1 ];
+	unsigned int n = 0;
+	this->gatherIndices( held, n );
+	this->clear();
+	for( unsigned int k = 0; k < n; k++ )
+		this->addIndex( held[ k ] );
+	delete[] held;
+	this->recalculateMe();
+	return count;
+} //}}}
+
+Quadtree** Quadtree::allocateChildren()
+{ //{{{
+	if( this->mArena == NULL )
+		return new Quadtree*[ 4 ];
+	return static_cast<Quadtree**>(
+			this->mArena->allocate( 4 * sizeof( Quadtree* ) ));
+} //}}}
+
+Quadtree* Quadtree::newChild( Real iL, Real iR,
+		Real iB, Real iT )
+{ //{{{
+	Quadtree* child = NULL;
+	if( this->mArena == NULL )
+		child = new Quadtree( iL, iR, iB, iT, this->mPS, NULL,
+				this->leafCapacity );
+	else
+		child = new ( this->mArena->allocate( sizeof( Quadtree ) ) )
+			Quadtree( iL, iR, iB, iT, this->mPS, this->mArena,
+					this->leafCapacity );
+	child->setTau( this->tau );
+	child->order = this->order;
+	child->depth = this->depth + 1;
+	return child;
+} //}}}
+
+Real Quadtree::getLeft() const
 { //{{{
 	return this->left;
 } //}}}
 
-long double Quadtree::getRight() const
+Real Quadtree::getRight() const
 { //{{{
 	return this->right;
 } //}}}
 
-long double Quadtree::getTop() const
+Real Quadtree::getTop() const
 { //{{{
 	return this->top;
 } //}}}
 
-long double Quadtree::getBottom() const
+Real Quadtree::getBottom() const
 { //{{{
 	return this->bottom;
 } //}}}
 
-long double Quadtree::getTau() const
+Real Quadtree::getTau() const
 { //{{{
 	return this->tau;
 } //}}}
 
-void Quadtree::setTau( long double nTau )
+void Quadtree::setTau( Real nTau )
 { //{{{
 	this->tau = nTau;
 	if( !this->parent )
@@ -331,11 +1037,46 @@ void Quadtree::setTau( long double nTau )
 		this->mChildren[ i ]->setTau( this->tau );
 } //}}}
 
+unsigned int Quadtree::getOrder() const
+{ //{{{
+	return this->order;
+} //}}}
+
+void Quadtree::setOrder( unsigned int nOrder )
+{ //{{{
+	if( nOrder < 1 )
+		nOrder = 1;
+	if( nOrder > MAX_ORDER )
+	{
+		cerr << "Moments past order " << MAX_ORDER << " are not supported\n";
+		nOrder = MAX_ORDER;
+	}
+
+	// Children first, so each node's moments are built from current ones
+	this->order = nOrder;
+	if( this->parent )
+	{
+		for( unsigned int i = 0; i < 4; i++ )
+			this->mChildren[ i ]->setOrder( this->order );
+	}
+	this->recalculateMe();
+} //}}}
+
 Quadtree* Quadtree::getChild( unsigned int indice )
 { //{{{
 	return this->mChildren[ indice % 4 ];
 } //}}}
 
+unsigned int Quadtree::getLeafCapacity() const
+{ //{{{
+	return this->leafCapacity;
+} //}}}
+
+unsigned int Quadtree::getParticleCount() const
+{ //{{{
+	return this->mCount;
+} //}}}
+
 bool Quadtree::isParent() const
 { //{{{
 	return this->parent;
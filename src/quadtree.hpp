@@ -21,30 +21,46 @@
 #define QUADTREE_HPP
 
 #include "particle_system.hpp"
+#include "node_arena.hpp"
 
 /**
  * Class representing a recursive space division into four quadrants.
+ *
+ * Each cell stands in for its contents with the total of their positive
+ * masses at the center of those, and the total of their negative masses at
+ * the center of those. Kept apart, both centers stay inside the cell even
+ * where the masses nearly cancel out, so such a cell can still be used whole
+ * instead of being opened. At order 2 a cell also keeps the quadrupole
+ * moment of each about its center, which corrects the force of a cell for
+ * its contents not being two points, so cells can be accepted closer up for
+ * the same error.
  */
 class Quadtree
 {
 	public:
 		/**
-		 * Create a quadtree representing a certain amount of space.
+		 * Create an empty quadtree representing a certain amount of space.
 		 * @param iL : left hand coordinate
 		 * @param iR : right hand coordinate
 		 * @param iB : top coordinate
 		 * @param iT : bottom coordinate
-		 * @param iMe : initial point to contain
-		 * @note : iMe should only be NULL for empty nodes
+		 * @param iPS : particle system whose particles will be added
+		 * @param iArena : arena to allocate children from, NULL to use new
+		 * @param iLeafCapacity : most particles a leaf holds before it is split
 		 */
-		Quadtree( long double iL, long double iR,
-				long double iB, long double iT, Particle* iMe );
+		Quadtree( Real iL, Real iR,
+				Real iB, Real iT, ParticleSystem* iPS = NULL,
+				NodeArena* iArena = NULL, unsigned int iLeafCapacity = 1 );
 
 		/**
 		 * Create a quadtree based on a particle system.
 		 * @param ps : ParticleSystem to base this off of
+		 * @param iArena : arena to allocate children from, NULL to use new
+		 * @param iLeafCapacity : most particles a leaf holds before it is split
+		 * @note : the arena must not be reset while this is still in use
 		 */
-		Quadtree( ParticleSystem* ps );
+		Quadtree( ParticleSystem* ps, NodeArena* iArena = NULL,
+				unsigned int iLeafCapacity = 1 );
 
 		/**
 		 * Proper deconstructor that delets all associated memory.
@@ -52,27 +68,43 @@ class Quadtree
 		~Quadtree();
 
 		/**
-		 * Add a node to this tree.
-		 * @param node : node to be added
+		 * Add a particle of the associated particle system to this tree.
+		 * @param indice : indice of particle to be added
 		 */
-		void add( Particle* node );
+		void add( unsigned int indice );
 
 		/**
-		 * Add a particle system to this tree.
+		 * Add a particle system to this tree, associating it with this.
+		 * Centers of mass are calculated once after every particle is placed.
 		 * @param ps : ParticleSystem which should be added
 		 */
 		void add( ParticleSystem* ps );
 
 		/**
-		 * Delete all contents of this.
+		 * Brings this tree up to date after the particles of the associated
+		 * system have moved, keeping the existing cells. Only particles that
+		 * left their cell are taken out and placed again, cells left with no
+		 * more particles than a leaf holds are folded back into leaves, and
+		 * centers of mass are recalculated children before parents.
+		 * @param maxMigration : fraction of particles allowed to change cells
+		 * @return : true if this was refit, false if too many particles
+		 * changed cells or one left this tree; this is then unusable and has
+		 * to be cleared and built again
+		 */
+		bool refit( Real maxMigration = 0.1 );
+
+		/**
+		 * Delete all contents of this. Children allocated from an arena are
+		 * simply forgotten; the arena's owner reclaims them with reset().
 		 */
 		void clear();
 
 		/**
-		 * Updates a particle's acceleration by using the Barnes-Hut algorithm.
-		 * @param p : Particle to update
+		 * Updates a particle's acceleration by using the Barnes-Hut algorithm,
+		 * recording the number of interactions it took as its cost.
+		 * @param indice : indice of particle in the associated system to update
 		 */
-		void update( Particle* p ) const;
+		void update( unsigned int indice ) const;
 
 		/**
 		 * Updates an entire particle system's particles with new forces.
@@ -80,59 +112,103 @@ class Quadtree
 		 */
 		void update( ParticleSystem* ps ) const;
 
+		/**
+		 * Updates the particles in this with the forces of everything in a
+		 * tree by a dual tree walk, recording the number of interactions each
+		 * took as its cost. A pair of cells whose widths add up to less than
+		 * tau times the distance between them interact once as a whole,
+		 * giving this side a field and its gradient that are passed down to
+		 * the particles under it. Whatever is still too close at a leaf is
+		 * walked for each of its particles, as update() would.
+		 * @param source : tree to take forces from, usually the root of this
+		 */
+		void updateDual( const Quadtree* source ) const;
+
+		/**
+		 * Lists the non-empty cells a number of levels below this, and
+		 * non-empty leaves above that, so the particles of this are split
+		 * between them.
+		 * @param subtrees : where to list them, with room for 4^levels cells
+		 * @param levels : number of levels to go down
+		 * @return : number of cells listed
+		 */
+		unsigned int getSubtrees( const Quadtree** subtrees,
+				unsigned int levels ) const;
+
 		/**
 		 * Return the point this Quadtree represents.
-		 * @return : point representing average of all nodes in this
+		 * @return : point representing average of all nodes in this, or NULL
+		 * if this is empty
 		 */
-		Particle* getMe();
+		const Particle* getMe() const;
 
 		/**
-		 * Recursively re-calculate a new me
+		 * Re-calculate a new me, and the quadrupole moment at order 2, from
+		 * this's children, or from the particles in this if it is a leaf.
 		 */
 		void recalculateMe();
 
 		/**
-		 * Return the quadrant a node shoud be point into in this tree.
-		 * @param node : node to find quadrant of
-		 * @return : quadrant where node should go
+		 * Re-calculate me for every node in this, children before parents.
+		 */
+		void recalculateAll();
+
+		/**
+		 * Return the quadrant a point shoud be put into in this tree.
+		 * @param x : x coordinate of point
+		 * @param y : y coordinate of point
+		 * @return : quadrant where point should go
 		 */
-		unsigned int getQuadrant( Particle* node ) const;
+		unsigned int getQuadrant( Real x, Real y ) const;
 
 		/**
 		 * Returns left side.
 		 * @return : left side
 		 */
-		long double getLeft() const;
+		Real getLeft() const;
 
 		/**
 		 * Returns right side.
 		 * @return : right side
 		 */
-		long double getRight() const;
+		Real getRight() const;
 
 		/**
 		 * Returns top side.
 		 * @return : top side
 		 */
-		long double getTop() const;
+		Real getTop() const;
 
 		/**
 		 * Returns bottom side.
 		 * @return : bottom side
 		 */
-		long double getBottom() const;
+		Real getBottom() const;
 
 		/**
 		 * Returns the tau of this quadtree.
 		 * @return : this's tau
 		 */
-		long double getTau() const;
+		Real getTau() const;
 
 		/**
 		 * Sets this tau of this quadtree.
 		 * @param nTau : new value for tau
 		 */
-		void setTau( long double nTau );
+		void setTau( Real nTau );
+
+		/**
+		 * Returns the order of the moments used for cells far enough away.
+		 * @return : 1 for the monopole alone, 2 to add the quadrupole
+		 */
+		unsigned int getOrder() const;
+
+		/**
+		 * Sets the order of the moments used for cells far enough away,
+		 * calculating the moments that are needed.
+		 * @param nOrder : 1 for the monopole alone, 2 to add the quadrupole
+		 */
+		void setOrder( unsigned int nOrder );
 
 		/**
 		 * Returns a pointer to a child.
@@ -141,6 +217,20 @@ class Quadtree
 		 */
 		Quadtree* getChild( unsigned int indice );
 
+		/**
+		 * Returns the most particles a leaf holds before it is split. Leaves
+		 * at the deepest level hold any number, so coincident particles
+		 * cannot divide space forever.
+		 * @return : leaf capacity
+		 */
+		unsigned int getLeafCapacity() const;
+
+		/**
+		 * Returns the number of particles in this if it is a leaf.
+		 * @return : number of particles held, 0 for parents
+		 */
+		unsigned int getParticleCount() const;
+
 		/**
 		 * Returns true if this has children.
 		 * @return : true if this has children
@@ -153,16 +243,240 @@ class Quadtree
 		void printDimensions() const;
 
 	private:
+		/**
+		 * Field of the cells a dual tree walk accepted for a cell, and its
+		 * gradient, at the cell's center.
+		 */
+		struct Field
+		{
+			Real ax, ay;
+			Real gxx, gxy, gyy;
+			/// Number of cells accepted for the cell and the cells above it.
+			unsigned int far;
+		};
+
+		/**
+		 * Cells a dual tree walk still has to deal with.
+		 */
+		struct DualWalk;
+
+		/**
+		 * Places a particle of the associated particle system in this tree.
+		 * @param indice : indice of particle to be placed
+		 * @param recalculate : true to update me along the way, false to
+		 * leave it for a later recalculateAll()
+		 */
+		void insert( unsigned int indice, bool recalculate );
+
+		/**
+		 * Mass, center of mass and quadrupole moment about that center of
+		 * the particles of one sign in a cell.
+		 */
+		struct Moments
+		{
+			Real x, y, m;
+			Real qxx, qxy, qyy;
+		};
+
+		/**
+		 * Adds the quadrupole moment of a point mass to a cell's.
+		 * @param part : moments to add to
+		 * @param dx : x offset of the mass from their center of mass
+		 * @param dy : y offset of the mass from their center of mass
+		 * @param m : mass
+		 */
+		static void addQuadrupole( Moments& part, Real dx, Real dy, Real m );
+
+		/**
+		 * Sets me to the net mass of this and its center of mass, from the
+		 * moments of the positive and negative masses.
+		 */
+		void recalculateNet();
+
+		/**
+		 * Returns the moments of the masses of one sign in this.
+		 * @param sign : 0 for the positive masses, 1 for the negative ones
+		 * @return : those moments
+		 */
+		const Moments& part( unsigned int sign ) const;
+
+		/**
+		 * Returns true if this is far enough from a point to be used whole,
+		 * that is its width over the distance from the point to the center
+		 * of its positive masses, and to that of its negative masses, is
+		 * less than tau.
+		 * @param x : x coordinate of point
+		 * @param y : y coordinate of point
+		 * @return : true if this can be used whole, false if it has to be
+		 * opened
+		 */
+		bool isFarFrom( Real x, Real y ) const;
+
+		/**
+		 * Accumulates the force on a point from the masses of one sign in
+		 * this, used whole.
+		 * @param part : moments of those masses
+		 * @param x : x coordinate of point
+		 * @param y : y coordinate of point
+		 * @param m : mass of point
+		 * @param fx : x force accumulator
+		 * @param fy : y force accumulator
+		 * @param interactions : incremented if there are any such masses
+		 */
+		void addForce( const Moments& part, Real x, Real y, Real m,
+				Accumulator& fx, Accumulator& fy,
+				unsigned int& interactions ) const;
+
+		/**
+		 * Adds a particle to this leaf's list, growing the list if it is full.
+		 * @param indice : indice of particle to be added
+		 */
+		void addIndex( unsigned int indice );
+
+		/**
+		 * Forgets the particles in this leaf, freeing their list if it was
+		 * not allocated from the arena.
+		 */
+		void releaseIndices();
+
+		/**
+		 * Turns this full leaf into a parent and places its particles in the
+		 * new children.
+		 * @param recalculate : passed on to insert()
+		 */
+		void split( bool recalculate );
+
+		/**
+		 * Lists every particle in this tree.
+		 * @param indices : where to list them
+		 * @param count : number of particles listed so far
+		 */
+		void gatherIndices( unsigned int* indices, unsigned int& count ) const;
+
+		/**
+		 * Takes particles that have left their cell out of this tree.
+		 * @param moved : where to list the indices of particles taken out
+		 * @param count : number of particles listed in moved so far
+		 * @param limit : most particles moved may hold
+		 * @return : false if more than limit particles had to be taken out
+		 */
+		bool detachMoved( unsigned int* moved, unsigned int& count,
+				unsigned int limit );
+
+		/**
+		 * Refreshes every leaf from the associated particle system, folds
+		 * cells holding no more than leafCapacity particles into leaves, and
+		 * recalculates me for every node, children before parents.
+		 * @return : number of particles in this
+		 */
+		unsigned int refitMoments();
+
 		/**
 		 * Allocates space for and creates children Quadtrees
 		 */
 		void makeChildren();
 
-		long double left, right;
-		long double top, bottom;
-		long double tau;
+		/**
+		 * Allocates an array for four children, from the arena if there is one.
+		 * @return : uninitialized array of four child pointers
+		 */
+		Quadtree** allocateChildren();
+
+		/**
+		 * Creates a child sharing this's particle system, arena, tau, order
+		 * and leaf capacity.
+		 * @param iL : left hand coordinate
+		 * @param iR : right hand coordinate
+		 * @param iB : bottom coordinate
+		 * @param iT : top coordinate
+		 * @return : the new child
+		 */
+		Quadtree* newChild( Real iL, Real iR,
+				Real iB, Real iT );
+
+		/**
+		 * Accumulates the force on a point from everything in this.
+		 * @param x : x coordinate of point
+		 * @param y : y coordinate of point
+		 * @param m : mass of point
+		 * @param self : indice of the point in the system, skipped if found
+		 * @param fx : x force accumulator
+		 * @param fy : y force accumulator
+		 * @param interactions : incremented for each cell or particle used
+		 */
+		void update( Real x, Real y, Real m,
+				unsigned int self, Accumulator& fx, Accumulator& fy,
+				unsigned int& interactions ) const;
+
+		/**
+		 * Accumulates the force on a point from each particle in this leaf.
+		 * @param x : x coordinate of point
+		 * @param y : y coordinate of point
+		 * @param m : mass of point
+		 * @param self : indice of the point in the system, skipped if found
+		 * @param fx : x force accumulator
+		 * @param fy : y force accumulator
+		 * @param interactions : incremented for each particle used
+		 */
+		void updateLeaf( Real x, Real y, Real m,
+				unsigned int self, Accumulator& fx, Accumulator& fy,
+				unsigned int& interactions ) const;
+
+		/**
+		 * Returns true if a cell is far enough from this, for a dual tree
+		 * walk, to be used whole for every particle in this.
+		 * @param source : cell to test
+		 * @return : true if the widths of the two add up to less than tau
+		 * times the distance from the centers of source's positive and
+		 * negative masses to this's center, and they do not overlap
+		 */
+		bool isSeparated( const Quadtree* source ) const;
+
+		/**
+		 * Adds the field of a cell, and its gradient, at this's center.
+		 * @param source : cell far enough from this
+		 * @param field : field to add to
+		 */
+		void addField( const Quadtree* source, Field& field ) const;
+
+		/**
+		 * Sorts the cells left over from this's parent into those used whole
+		 * for this, those opened, and those handed down to this's children,
+		 * then recurses, and at a leaf sets the forces on its particles.
+		 * @param walk : cells handed down and still to be sorted
+		 * @param begin : first cell handed down to this
+		 * @param end : one past the last cell handed down to this
+		 * @param field : field at this's center from the cells used so far
+		 */
+		void walkDual( DualWalk& walk, unsigned int begin, unsigned int end,
+				Field field ) const;
+
+		Real left, right;
+		Real top, bottom;
+		Real tau;
 		bool parent;
-		Particle* me;
+		/// Mass and position of the contained particle, or the net mass and
+		/// center of mass of this, which is far off when that is close to 0.
+		Particle me;
+		/// Moments of the positive and of the negative masses in this.
+		Moments pos, neg;
+		/// Order of the moments used; the quadrupole moments are kept when
+		/// it is 2.
+		unsigned int order;
+		/// Number of particles in this if it is a leaf.
+		unsigned int mCount;
+		/// Indices of the particles in this if it is a leaf. Points at mIndex
+		/// until a second particle arrives, so most leaves allocate nothing.
+		unsigned int* mIndices;
+		unsigned int mCapacity;
+		/// First particle in this if it is a non-empty leaf.
+		unsigned int mIndex;
+		/// Most particles a leaf holds before it is split.
+		unsigned int leafCapacity;
+		/// Number of levels between this and the root.
+		unsigned int depth;
+		ParticleSystem* mPS;
+		NodeArena* mArena;
 		Quadtree** mChildren;
 
 		Quadtree( const Quadtree& rhs );
@@ -0,0 +1,50 @@
+/** {{{
+ * Copyright 2010 Jeff Chapman.
+ *
+ * This file is a part of Barnes-Hut
+ *
+ * Barnes-Hut is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Barnes-Hut is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Barnes-Hut.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */// }}}
+#ifndef REAL_HPP
+#define REAL_HPP
+
+/**
+ * Scalar types used for particles, trees and forces, picked when building.
+ *
+ * Real is what positions, masses, forces and cell moments are stored in, and
+ * Accumulator is what forces are summed in while walking a tree. By default
+ * both are long double; building with PRECISION_DOUBLE makes both double, and
+ * PRECISION_FLOAT stores float but still sums in double, trading precision
+ * for memory bandwidth and throughput.
+ *
+ * Lane is what the SIMD force kernel is fed: float when Real is, so twice as
+ * many interactions fit in a vector, and double otherwise, as there are no
+ * vectors of long double.
+ */
+#if defined( PRECISION_FLOAT )
+typedef float Real;
+typedef double Accumulator;
+typedef float Lane;
+#elif defined( PRECISION_DOUBLE )
+typedef double Real;
+typedef double Accumulator;
+typedef double Lane;
+#else
+typedef long double Real;
+typedef long double Accumulator;
+typedef double Lane;
+#endif
+
+#endif // REAL_HPP
@@ -0,0 +1,252 @@
+/** {{{
+ * Copyright 2010 Jeff Chapman.
+ *
+ * This file is a part of Barnes-Hut
+ *
+ * Barnes-Hut is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Barnes-Hut is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Barnes-Hut.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */// }}}
+
+#include "thread_pool.hpp"
+
+/// Chunks each thread's share is cut into when the grain is automatic.
+static const unsigned int CHUNKS_PER_THREAD = 64;
+
+ThreadPool::Worker::Worker( ThreadPool* iPool, unsigned int iId ) :
+	QThread(), //{{{
+	pool( iPool ),
+	id( iId )
+{
+} //}}}
+
+void ThreadPool::Worker::run()
+{ //{{{
+	unsigned int seen = 0;
+	while( true )
+	{
+		this->pool->lock.lock();
+		while(( !this->pool->stopping ) && ( this->pool->generation == seen ))
+			this->pool->wake.wait( &this->pool->lock );
+		if( this->pool->stopping )
+		{
+			this->pool->lock.unlock();
+			return;
+		}
+		seen = this->pool->generation;
+		bool needed = ( this->id < this->pool->participants );
+		this->pool->lock.unlock();
+
+		if( needed )
+			this->pool->participate( this->id );
+
+		this->pool->lock.lock();
+		if( --this->pool->pending == 0 )
+			this->pool->done.wakeAll();
+		this->pool->lock.unlock();
+	}
+} //}}}
+
+ThreadPool::ThreadPool( unsigned int iSize ) :
+	size( iSize ), //{{{
+	workers( NULL ),
+	shares( NULL ),
+	busy(),
+	lock(),
+	wake(),
+	done(),
+	mTask( NULL ),
+	mGrain( 1 ),
+	participants( 0 ),
+	generation( 0 ),
+	pending( 0 ),
+	stopping( false )
+{
+	if( this->size == 0 )
+	{
+		int ideal = QThread::idealThreadCount();
+		this->size = (ideal > 0) ? ideal : 1;
+	}
+
+	// Share 0 belongs to whoever calls run(), the rest to the workers
+	this->shares = new Share[ this->size ];
+	this->workers = new Worker*[ this->size ];
+	this->workers[ 0 ] = NULL;
+	for( unsigned int i = 1; i < this->size; i++ )
+	{
+		this->workers[ i ] = new Worker( this, i );
+		this->workers[ i ]->start();
+	}
+} //}}}
+
+ThreadPool::~ThreadPool()
+{ //{{{
+	this->lock.lock();
+	this->stopping = true;
+	this->wake.wakeAll();
+	this->lock.unlock();
+
+	for( unsigned int i = 1; i < this->size; i++ )
+	{
+		this->workers[ i ]->wait();
+		delete this->workers[ i ];
+	}
+	delete[] this->workers;
+	delete[] this->shares;
+} //}}}
+
+ThreadPool* ThreadPool::instance()
+{ //{{{
+	static ThreadPool pool;
+	return &pool;
+} //}}}
+
+void ThreadPool::run( Task* task, unsigned int first, unsigned int last,
+		unsigned int maxThreads, unsigned int grain )
+{ //{{{
+	if(( task == NULL ) || ( first >= last ))
+		return;
+
+	unsigned int threads = this->size;
+	if(( maxThreads > 0 ) && ( maxThreads < threads ))
+		threads = maxThreads;
+	if( threads > last - first )
+		threads = last - first;
+	if( threads < 2 )
+	{
+		task->process( first, last );
+		return;
+	}
+
+	unsigned int* bounds = new unsigned int[ threads + 1 ];
+	for( unsigned int i = 0; i <= threads; i++ )
+		bounds[ i ] = first + (unsigned int)(
+			(unsigned long long)(last - first) * i / threads );
+	this->run( task, bounds, threads, grain );
+	delete[] bounds;
+} //}}}
+
+void ThreadPool::run( Task* task, const unsigned int* bounds,
+		unsigned int zones, unsigned int grain )
+{ //{{{
+	if(( task == NULL ) || ( bounds == NULL ) || ( zones == 0 ) ||
+			( bounds[ 0 ] >= bounds[ zones ] ))
+		return;
+
+	unsigned int first = bounds[ 0 ], last = bounds[ zones ];
+	unsigned int threads = (zones < this->size) ? zones : this->size;
+
+	// Nested or concurrent use would deadlock or oversubscribe, so do it here
+	if(( threads < 2 ) || ( !this->busy.tryLock() ))
+	{
+		task->process( first, last );
+		return;
+	}
+
+	if( grain == 0 )
+		grain = (last - first) / (threads * CHUNKS_PER_THREAD);
+	if( grain == 0 )
+		grain = 1;
+
+	// Any zones past the number of threads go to the last thread
+	for( unsigned int i = 0; i < this->size; i++ )
+	{
+		this->shares[ i ].begin = this->shares[ i ].end = last;
+		if( i < threads )
+		{
+			this->shares[ i ].begin = bounds[ i ];
+			this->shares[ i ].end = (i + 1 < threads) ? bounds[ i + 1 ] : last;
+		}
+	}
+
+	this->lock.lock();
+	this->mTask = task;
+	this->mGrain = grain;
+	this->participants = threads;
+	this->pending = this->size - 1;
+	this->generation++;
+	this->wake.wakeAll();
+	this->lock.unlock();
+
+	this->participate( 0 );
+
+	this->lock.lock();
+	while( this->pending > 0 )
+		this->done.wait( &this->lock );
+	this->mTask = NULL;
+	this->lock.unlock();
+
+	this->busy.unlock();
+} //}}}
+
+unsigned int ThreadPool::getSize() const
+{ //{{{
+	return this->size;
+} //}}}
+
+void ThreadPool::participate( unsigned int id )
+{ //{{{
+	unsigned int first = 0, last = 0;
+	while( true )
+	{
+		while( this->take( id, first, last ) )
+			this->mTask->process( first, last );
+
+		if( !this->steal( id ) )
+			return;
+	}
+} //}}}
+
+bool ThreadPool::take( unsigned int id, unsigned int& first, unsigned int& last )
+{ //{{{
+	Share& share = this->shares[ id ];
+	QMutexLocker locker( &share.lock );
+	if( share.begin >= share.end )
+		return false;
+
+	first = share.begin;
+	last = (share.end - share.begin > this->mGrain) ?
+		share.begin + this->mGrain : share.end;
+	share.begin = last;
+	return true;
+} //}}}
+
+bool ThreadPool::steal( unsigned int id )
+{ //{{{
+	for( unsigned int i = 1; i < this->participants; i++ )
+	{
+		Share& victim = this->shares[ (id + i) % this->participants ];
+		unsigned int begin = 0, end = 0;
+
+		victim.lock.lock();
+		if( victim.begin < victim.end )
+		{
+			// Leave the victim the chunk it is about to take
+			unsigned int left = victim.end - victim.begin;
+			begin = (left > this->mGrain) ?
+				victim.begin + (left - left / 2) : victim.begin;
+			end = victim.end;
+			victim.end = begin;
+		}
+		victim.lock.unlock();
+
+		if( begin < end )
+		{
+			QMutexLocker locker( &this->shares[ id ].lock );
+			this->shares[ id ].begin = begin;
+			this->shares[ id ].end = end;
+			return true;
+		}
+	}
+	return false;
+} //}}}
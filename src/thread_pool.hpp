@@ -0,0 +1,185 @@
+/** {{{
+ * Copyright 2010 Jeff Chapman.
+ *
+ * This file is a part of Barnes-Hut
+ *
+ * Barnes-Hut is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Barnes-Hut is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Barnes-Hut.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */// }}}
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <QtCore/QThread>
+#include <QtCore/QMutex>
+#include <QtCore/QWaitCondition>
+
+/**
+ * Persistent set of worker threads that split ranges of indices between
+ * them.
+ *
+ * A range handed to run() is divided evenly between the workers and the
+ * calling thread, each of which takes small chunks off the front of its own
+ * share. Anyone who runs out steals the back half of another thread's
+ * share, so uneven work still keeps every thread busy.
+ */
+class ThreadPool
+{
+	public:
+		/**
+		 * Work that can be split into ranges of indices.
+		 */
+		class Task
+		{
+			public:
+				virtual ~Task() {}
+
+				/**
+				 * Do the work for a range of indices. Called from several
+				 * threads at once with ranges that never overlap.
+				 * @param first : first indice to work on
+				 * @param last : one past the last indice to work on
+				 */
+				virtual void process( unsigned int first, unsigned int last ) = 0;
+		};
+
+		/**
+		 * Create a pool and start its workers.
+		 * @param iSize : number of threads including the caller of run(),
+		 * 0 for one per core
+		 */
+		ThreadPool( unsigned int iSize = 0 );
+
+		/**
+		 * Stops and deletes all workers.
+		 */
+		~ThreadPool();
+
+		/**
+		 * Returns the pool shared by everything in the program, sized to the
+		 * machine.
+		 * @return : shared pool
+		 */
+		static ThreadPool* instance();
+
+		/**
+		 * Run a task over a range of indices and wait for it to finish. If the
+		 * pool is already busy the calling thread does all the work itself.
+		 * @param task : task to run
+		 * @param first : first indice
+		 * @param last : one past the last indice
+		 * @param maxThreads : most threads to use, 0 for the whole pool
+		 * @param grain : indices taken at a time, 0 to pick automatically
+		 */
+		void run( Task* task, unsigned int first, unsigned int last,
+				unsigned int maxThreads = 0, unsigned int grain = 0 );
+
+		/**
+		 * Run a task over consecutive zones of indices, one zone per thread,
+		 * and wait for it to finish. Threads that finish their zone early
+		 * still steal from the others.
+		 * @param task : task to run
+		 * @param bounds : zones + 1 increasing indices, zone i being
+		 * [bounds[i], bounds[i + 1])
+		 * @param zones : number of zones, extra zones past getSize() are given
+		 * to the last thread
+		 * @param grain : indices taken at a time, 0 to pick automatically
+		 */
+		void run( Task* task, const unsigned int* bounds, unsigned int zones,
+				unsigned int grain = 0 );
+
+		/**
+		 * Returns the number of threads work is split between, including the
+		 * caller of run().
+		 * @return : number of threads
+		 */
+		unsigned int getSize() const;
+
+	private:
+		/**
+		 * One thread's share of the current range.
+		 */
+		struct Share
+		{
+			Share() : lock(), begin( 0 ), end( 0 ) {}
+
+			QMutex lock;
+			unsigned int begin;
+			unsigned int end;
+		};
+
+		/**
+		 * Thread that waits for work from the pool.
+		 */
+		class Worker : public QThread
+		{
+			public:
+				Worker( ThreadPool* iPool, unsigned int iId );
+				void run();
+
+			private:
+				ThreadPool* pool;
+				unsigned int id;
+
+				Worker( const Worker& rhs );
+				Worker& operator=( const Worker& rhs );
+		};
+
+		/**
+		 * Works through a share of the current range, then steals from the
+		 * others until there is nothing left.
+		 * @param id : which share to start with
+		 */
+		void participate( unsigned int id );
+
+		/**
+		 * Takes the next chunk off the front of a share.
+		 * @param id : which share
+		 * @param first : set to the first indice of the chunk
+		 * @param last : set to one past the last indice of the chunk
+		 * @return : false if the share is empty
+		 */
+		bool take( unsigned int id, unsigned int& first, unsigned int& last );
+
+		/**
+		 * Moves the back half of another share into a share.
+		 * @param id : share to steal for
+		 * @return : false if there was nothing left to steal
+		 */
+		bool steal( unsigned int id );
+
+		unsigned int size;
+		Worker** workers;
+		Share* shares;
+
+		/// Held by whoever is currently using the pool.
+		QMutex busy;
+
+		/// Protects everything below.
+		QMutex lock;
+		QWaitCondition wake;
+		QWaitCondition done;
+		Task* mTask;
+		unsigned int mGrain;
+		unsigned int participants;
+		/// Bumped for every new range, so workers know there is work.
+		unsigned int generation;
+		/// Workers still working on the current range.
+		unsigned int pending;
+		bool stopping;
+
+		ThreadPool( const ThreadPool& rhs );
+		ThreadPool& operator=( const ThreadPool& rhs );
+};
+
+#endif // THREAD_POOL_HPP